@@ -4,7 +4,7 @@
 
 namespace ctr {
     namespace core {
-        bool init(int argc);
+        bool init(int argc, u32 commandBufferSize = 0x80000, u32 vramSize = 0x400000);
         void exit();
         bool running();
         bool launcher();
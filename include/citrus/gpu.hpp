@@ -9,6 +9,8 @@ namespace ctr {
         const u32 BOTTOM_WIDTH = 320;
         const u32 BOTTOM_HEIGHT = 240;
 
+        const u32 TEX_ENV_COUNT = 6;
+
         typedef enum {
             SCREEN_TOP = 0,
             SCREEN_BOTTOM = 1
@@ -174,6 +176,12 @@ namespace ctr {
             PIXEL_ETC1A4 = 0xD
         } PixelFormat;
 
+        typedef enum {
+            DEPTH_16 = 0x0,
+            DEPTH_24 = 0x2,
+            DEPTH_24_STENCIL_8 = 0x3
+        } DepthFormat;
+
         typedef enum {
             SCISSOR_DISABLE = 0x0,
             SCISSOR_INVERT = 0x1,
@@ -182,9 +190,94 @@ namespace ctr {
 
         typedef enum {
             TEXTURE_PLACE_RAM = 0,
-            TEXTURE_PLACE_VRAM = 1
+            TEXTURE_PLACE_VRAM = 1,
+            TEXTURE_PLACE_VRAM_A = 2,
+            TEXTURE_PLACE_VRAM_B = 3
         } TexturePlace;
 
+        typedef enum {
+            ANTIALIAS_NONE = 0,
+            ANTIALIAS_2X = 1,
+            ANTIALIAS_4X = 2
+        } AntiAliasMode;
+
+        typedef enum {
+            CLEAR_COLOR = 1,
+            CLEAR_DEPTH = 2,
+            CLEAR_ALL = 3
+        } ClearBuffer;
+
+        typedef enum {
+            VRAM_BANK_ANY = 0,
+            VRAM_BANK_A = 1,
+            VRAM_BANK_B = 2
+        } VramBank;
+
+        typedef struct {
+            u32 draws;
+            u32 indexedDraws;
+            u32 arrayDraws;
+            u32 vertices;
+            u32 stateGroups;
+            u32 uniformVectors;
+            u32 textureBinds;
+            u32 transferBytes;
+            u32 commandWords;
+            u32 renderWaitUs;
+            u32 transferWaitUs;
+            u32 fillWaitUs;
+            u32 vblankWaitUs;
+        } FrameStats;
+
+        typedef struct {
+            u16 rgbSources;
+            u16 alphaSources;
+            u16 rgbOperands;
+            u16 alphaOperands;
+            CombineFunc rgbCombine;
+            CombineFunc alphaCombine;
+            u32 constantColor;
+        } TexEnv;
+
+        typedef struct {
+            CullMode cullMode;
+
+            bool stencilEnable;
+            TestFunc stencilFunc;
+            u8 stencilRef;
+            u8 stencilInputMask;
+            u8 stencilWriteMask;
+            StencilOp stencilFail;
+            StencilOp stencilZFail;
+            StencilOp stencilZPass;
+
+            u8 blendRed;
+            u8 blendGreen;
+            u8 blendBlue;
+            u8 blendAlpha;
+            BlendEquation blendColorEquation;
+            BlendEquation blendAlphaEquation;
+            BlendFactor blendColorSrc;
+            BlendFactor blendColorDst;
+            BlendFactor blendAlphaSrc;
+            BlendFactor blendAlphaDst;
+
+            bool alphaEnable;
+            TestFunc alphaFunc;
+            u8 alphaRef;
+
+            bool depthEnable;
+            TestFunc depthFunc;
+
+            bool colorMaskRed;
+            bool colorMaskGreen;
+            bool colorMaskBlue;
+            bool colorMaskAlpha;
+            bool depthMask;
+
+            TexEnv texEnv[TEX_ENV_COUNT];
+        } PipelineState;
+
         inline u32 bitsPerPixel(PixelFormat format) {
             static const u32 bitsPerPixelFormat[] = {
                     32, // RGBA8
@@ -252,17 +345,42 @@ namespace ctr {
         void* galloc(u32 size);
         void gfree(void* mem);
 
+        void* valloc(u32 size, VramBank bank = VRAM_BANK_ANY);
+        void vfree(void* mem);
+        void getVramUsage(VramBank bank, u32* used, u32* total);
+
         void flushCommands();
+        void getCommandBufferUsage(u32* size, u32* highWater, u32* overflows);
+
+        void getFrameStats(FrameStats* out);
+
+        bool startCommandTrace(const std::string path);
+        bool tracingCommands();
         void flushBuffer();
+        void flushBufferRange(u32 x, u32 width);
         void swapBuffers(bool vblank);
 
         void dumpScreen(ctr::gpu::Screen screen, ctr::gpu::ScreenSide side, void** pixels, PixelFormat* format, u32* width, u32* height);
+        void copyFrameBuffer(void* dst, PixelFormat format);
 
-        void clear();
+        void clear(u32 buffers = CLEAR_ALL, bool async = false);
+        void clearRect(int x, int y, u32 width, u32 height, u32 buffers = CLEAR_ALL, bool async = false);
 
         void setClearColor(u8 red, u8 green, u8 blue, u8 alpha);
         void setClearDepth(u32 depth);
 
+        void setRenderTargetFormat(PixelFormat colorFormat, DepthFormat depthFormat);
+        void getRenderTargetFormat(PixelFormat* colorFormat, DepthFormat* depthFormat);
+
+        void setAntiAlias(Screen screen, AntiAliasMode mode);
+        void getAntiAlias(Screen screen, AntiAliasMode* out);
+        void getRenderTargetVram(u32* out);
+
+        void setDynamicResolution(bool enabled, float targetGpuTime = 14.0f, float minScale = 0.5f);
+        void getActiveAntiAlias(Screen screen, AntiAliasMode* out);
+        void getActiveResolutionScale(Screen screen, float* out);
+        void getGpuTime(float* out);
+
         void setAllow3d(bool allow3d);
         void setScreenSide(ScreenSide side);
 
@@ -288,25 +406,42 @@ namespace ctr {
         void setColorMask(bool red, bool green, bool blue, bool alpha);
         void setDepthMask(bool depth);
 
+        void getPipelineState(PipelineState* out);
+        void setPipelineState(const PipelineState* state);
+        void createPipelineState(u32* pipelineState, const PipelineState* desc);
+        void freePipelineState(u32 pipelineState);
+        void bindPipelineState(u32 pipelineState);
+
         void createShader(u32* shader);
         void freeShader(u32 shader);
         void loadShader(u32 shader, const void* data, u32 size, u8 geometryStride = 0);
+        void getShader(u32* out);
         void useShader(u32 shader);
         void getUniform(u32 shader, ShaderType type, const std::string name, float* data, u32 elements);
         void setUniform(u32 shader, ShaderType type, const std::string name, const float* data, u32 elements);
         void getUniformBool(u32 shader, ShaderType type, int id, bool* value);
         void setUniformBool(u32 shader, ShaderType type, int id, bool value);
 
+        void createUniformBlock(u32* block, ShaderType type, u32 firstRegister, u32 registers);
+        void freeUniformBlock(u32 block);
+        void setUniformBlock(u32 block, const float* data, u32 offset, u32 elements);
+
         void createVbo(u32* vbo);
         void freeVbo(u32 vbo);
         void getVboData(u32 vbo, void** out);
         void setVboDataInfo(u32 vbo, u32 numVertices, Primitive primitive);
         void setVboData(u32 vbo, const void *data, u32 numVertices, Primitive primitive);
+        void setVboSubData(u32 vbo, u32 offset, const void* data, u32 size);
+        void mapVbo(u32 vbo, u32 offset, u32 size, void** out);
+        void unmapVbo(u32 vbo);
         void getVboIndices(u32 vbo, void** out);
         void setVboIndicesInfo(u32 vbo, u32 size);
         void setVboIndices(u32 vbo, const void *data, u32 size);
+        void mapVboIndices(u32 vbo, u32 offset, u32 size, void** out);
+        void unmapVboIndices(u32 vbo);
         void setVboAttributes(u32 vbo, u64 attributes, u8 attributeCount);
         void drawVbo(u32 vbo);
+        void drawVboRange(u32 vbo, u32 first, u32 count);
 
         void setTexEnv(u32 env, u16 rgbSources, u16 alphaSources, u16 rgbOperands, u16 alphaOperands, CombineFunc rgbCombine, CombineFunc alphaCombine, u32 constantColor);
 
@@ -315,7 +450,9 @@ namespace ctr {
         void getTextureData(u32 texture, void** out);
         void setTextureInfo(u32 texture, u32 width, u32 height, PixelFormat format, u32 params, TexturePlace place = TEXTURE_PLACE_RAM);
         void setTextureData(u32 texture, const void *data, u32 width, u32 height, PixelFormat format, u32 params, TexturePlace place = TEXTURE_PLACE_RAM);
+        void setTextureSubData(u32 texture, u32 x, u32 y, u32 width, u32 height, const void* data);
         void setTextureBorderColor(u32 texture, u8 red, u8 green, u8 blue, u8 alpha);
+        void getBoundTexture(TexUnit unit, u32* out);
         void bindTexture(TexUnit unit, u32 texture);
     }
 }
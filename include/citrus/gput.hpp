@@ -5,9 +5,45 @@
 
 namespace ctr {
     namespace gput {
+        typedef struct {
+            u32 capturedFrames;
+            u32 droppedFrames;
+            u32 writtenFrames;
+            u64 writtenBytes;
+            u64 copyTimeUs;
+            u64 compressTimeUs;
+        } CaptureStats;
+
+        typedef enum {
+            TEXT_ALIGN_LEFT = 0,
+            TEXT_ALIGN_CENTER = 1,
+            TEXT_ALIGN_RIGHT = 2
+        } TextAlign;
+
+        typedef struct {
+            float x;
+            float y;
+            float z;
+            float radius;
+        } BoundingSphere;
+
+        typedef struct {
+            float minX;
+            float minY;
+            float minZ;
+            float maxX;
+            float maxY;
+            float maxZ;
+        } BoundingBox;
+
+        typedef struct {
+            float planes[6][4];
+        } Frustum;
+
         void useDefaultShader();
 
         void multMatrix(float* out, const float* m1, const float* m2);
+        void multMatrixAffine(float* out, const float* m1, const float* m2);
         void setIdentityMatrix(float* out);
         void setOrthoMatrix(float* out, float left, float right, float bottom, float top, float near, float far);
         void setPerspectiveMatrix(float* out, float fovy, float aspect, float near, float far);
@@ -15,7 +51,20 @@ namespace ctr {
         void setRotationMatrixX(float* out, float rotation);
         void setRotationMatrixY(float* out, float rotation);
         void setRotationMatrixZ(float* out, float rotation);
+        void setRotationMatrix(float* out, float x, float y, float z);
         void setScaleMatrix(float* out, float x, float y, float z);
+        void setTransformMatrix(float* out, float tx, float ty, float tz, float rx, float ry, float rz, float sx, float sy, float sz);
+        void setLocalTransformMatrix(float* out, float tx, float ty, float tz, float rx, float ry, float rz, float sx, float sy, float sz);
+        void transformPoints(const float* matrix, const float* in, float* out, u32 count);
+
+        void extractFrustum(Frustum* out, const float* matrix);
+        void getFrustum(Frustum* out);
+        bool sphereVisible(const Frustum* frustum, const BoundingSphere* sphere);
+        bool boxVisible(const Frustum* frustum, const BoundingBox* box);
+        u32 cullSpheres(const Frustum* frustum, const BoundingSphere* spheres, u32 count, u8* visible);
+        u32 cullBoxes(const Frustum* frustum, const BoundingBox* boxes, u32 count, u8* visible);
+        void getCullStats(u32* culled, u32* visible);
+        void resetCullStats();
 
         void pushProjection();
         void popProjection();
@@ -35,11 +84,69 @@ namespace ctr {
         void rotate(float x, float y, float z);
         void scale(float x, float y, float z);
 
+        void createNode(u32* node, u32 parent = 0);
+        void freeNode(u32 node);
+        void setNodeTransform(u32 node, float tx, float ty, float tz, float rx = 0, float ry = 0, float rz = 0, float sx = 1, float sy = 1, float sz = 1);
+        void updateNodes();
+        void getNodeMatrix(u32 node, float* out);
+        void useNode(u32 node);
+
+        u64 sortKey(u8 layer, bool translucent, float depth, u32 shader, u32 texture);
+        void queueDraw(u64 key, u32 vbo, u32 shader, u32 texture, u32 pipelineState = 0);
+        void flushQueue();
+
+        void setDamageTracking(gpu::Screen screen, bool enabled);
+        void addDamage(gpu::Screen screen, int x, int y, u32 width, u32 height);
+        bool beginDamage(gpu::Screen screen);
+        void endDamage();
+
+        // Text and shapes are queued, and consecutive calls of one kind are merged into a single draw. The queue is
+        // drawn before any other draw or render state change, so everything reaches the screen in call order with the
+        // state current at the call. Call flushBatches() before writing GPU commands directly.
+        void flushBatches();
+
+        void createFont(u32* font, u32 atlasWidth = 256, u32 atlasHeight = 256);
+        void freeFont(u32 font);
+        bool loadFont(u32 font, const void* data, u32 size);
+        void setFontPage(u32 font, u32 page, const void* image, u32 width, u32 height, gpu::PixelFormat format);
+        void setFontMetrics(u32 font, u32 lineHeight, u32 base, u32 nominalWidth = 0);
+        void setFontGlyph(u32 font, u32 codepoint, u32 page, u32 x, u32 y, u32 width, u32 height, int xOffset, int yOffset, int advance);
+        void setFontKerning(u32 font, u32 first, u32 second, int amount);
+        void setFontDistanceField(u32 font, bool distanceField);
+        void getFontCacheStats(u32 font, u32* cached, u32* capacity, u32* evictions);
+        void useFont(u32 font);
+        u32 getFont();
+
         void setFont(void* image, u32 width, u32 height, u32 charWidth, u32 charHeight, gpu::PixelFormat format);
-        float getStringWidth(const std::string str, float charWidth);
-        float getStringHeight(const std::string str, float charHeight);
-        void drawString(const std::string str, float x, float y, float charWidth, float charHeight, u8 red = 0xFF, u8 green = 0xFF, u8 blue = 0xFF, u8 alpha = 0xFF);
+        float getStringWidth(const std::string& str, float charWidth);
+        float getStringHeight(const std::string& str, float charHeight);
+        void drawString(const std::string& str, float x, float y, float charWidth, float charHeight, u8 red = 0xFF, u8 green = 0xFF, u8 blue = 0xFF, u8 alpha = 0xFF);
+
+        void createTextLayout(u32* layout);
+        void freeTextLayout(u32 layout);
+        void setTextLayout(u32 layout, const std::string& str, float charWidth, float charHeight, float wrapWidth = 0, TextAlign align = TEXT_ALIGN_LEFT, u32 font = 0);
+        void getTextLayoutSize(u32 layout, float* width, float* height);
+        void drawTextLayout(u32 layout, float x, float y, u8 red = 0xFF, u8 green = 0xFF, u8 blue = 0xFF, u8 alpha = 0xFF);
+
+        void drawRect(float x, float y, float width, float height, u8 red, u8 green, u8 blue, u8 alpha = 0xFF);
+        void drawLine(float x1, float y1, float x2, float y2, float thickness, u8 red, u8 green, u8 blue, u8 alpha = 0xFF);
+        void drawCircle(float x, float y, float radius, u8 red, u8 green, u8 blue, u8 alpha = 0xFF, u32 segments = 0);
+        void drawSprite(u32 texture, float x, float y, float width, float height, float u1 = 0, float v1 = 0, float u2 = 1, float v2 = 1, float rotation = 0, u8 red = 0xFF, u8 green = 0xFF, u8 blue = 0xFF, u8 alpha = 0xFF);
+
+        void createTilemap(u32* tilemap, u32 width, u32 height, u32 tileWidth, u32 tileHeight, u32 chunkSize = 16);
+        void freeTilemap(u32 tilemap);
+        void setTilemapTileset(u32 tilemap, u32 texture, u32 textureWidth, u32 textureHeight);
+        void setTiles(u32 tilemap, const u16* tiles);
+        void setTile(u32 tilemap, u32 x, u32 y, u16 tile);
+        u16 getTile(u32 tilemap, u32 x, u32 y);
+        void setTileAnimation(u32 tilemap, u16 tile, u32 frames, u32 frameTime);
+        void drawTilemap(u32 tilemap, float x, float y);
 
         void takeScreenshot(bool top = true, bool bottom = true);
+
+        bool startCapture(gpu::Screen screen = gpu::SCREEN_TOP);
+        void stopCapture();
+        bool capturing();
+        void getCaptureStats(CaptureStats* out);
     }
 }
\ No newline at end of file
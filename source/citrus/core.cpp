@@ -35,14 +35,14 @@ namespace ctr {
     }
 }
 
-bool ctr::core::init(int argc) {
+bool ctr::core::init(int argc, u32 commandBufferSize, u32 vramSize) {
     oldErrTab = devoptab_list[STD_ERR];
     devoptab_list[STD_ERR] = &debugOpTab;
     setvbuf(stderr, NULL, _IOLBF, 0);
 
     hasLauncher = __service_ptr != 0;
 
-    bool ret = err::init() && utf::init() && gpu::init() && gput::init() && hid::init() && fs::init();
+    bool ret = err::init() && utf::init() && gpu::init(commandBufferSize, vramSize) && gput::init() && hid::init() && fs::init();
     if(ret) {
         // Try to acquire kernel access for additional service access.
         if(hasLauncher) {
@@ -1,16 +1,22 @@
 #include "citrus/gpu.hpp"
+#include "citrus/gput.hpp"
 #include "internal.hpp"
 
+#include <cstdio>
 #include <cstring>
+#include <map>
 #include <unordered_map>
+#include <vector>
 
 #include <3ds.h>
 
-#define COMMAND_BUFFER_SIZE 0x80000
+#define COMMAND_BUFFER_MIN_SIZE 0x4000
+#define COMMAND_RESERVE_WORDS 0x1000
 
-#define TEX_ENV_COUNT 6
 #define TEX_UNIT_COUNT 3
 
+#define PIPELINE_STATE_MAX_WORDS 0x80
+
 #define STATE_VIEWPORT (1 << 0)
 #define STATE_DEPTH_MAP (1 << 1)
 #define STATE_CULL (1 << 2)
@@ -24,6 +30,33 @@
 #define STATE_SCISSOR_TEST (1 << 10)
 #define STATE_ACTIVE_SHADER_UNIFORMS (1 << 11)
 #define STATE_ACTIVE_SHADER_UNIFORM_BOOLS (1 << 12)
+#define STATE_UNIFORM_BLOCKS (1 << 13)
+
+#define FLOAT_UNIFORM_COUNT 96
+
+#define TRACE_MAGIC 0x43524743 // "CGRC"
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_END 0
+#define TRACE_CHUNK_COMMANDS 1
+#define TRACE_CHUNK_BUFFER 2
+
+#define DYNAMIC_RES_DOWN_FRAMES 3
+#define DYNAMIC_RES_UP_FRAMES 60
+#define DYNAMIC_RES_UP_HEADROOM 0.4f
+#define DYNAMIC_RES_SCALE_STEP 0.125f
+
+// Sub-native frames render into a texture-shaped target: 512 memory rows along screen x, 256 pixels across.
+#define SCALED_TARGET_WIDTH 512
+#define SCALED_TARGET_HEIGHT 256
+
+#define LINEAR_OLD_START 0x14000000
+#define LINEAR_OLD_END 0x1C000000
+#define LINEAR_START 0x30000000
+#define LINEAR_END 0x40000000
+
+#define VRAM_START 0x1F000000
+#define VRAM_BANK_SIZE 0x300000
+#define VRAM_ALIGNMENT 0x80
 
 extern Handle gspEvents[GSPGPU_EVENT_MAX];
 
@@ -51,6 +84,11 @@ namespace ctr {
             void* indices;
             u32 indicesSize;
 
+            u32 mapOffset;
+            u32 mapSize;
+            u32 indicesMapOffset;
+            u32 indicesMapSize;
+
             u64 attributes;
             u8 attributeCount;
             u16 attributeMask;
@@ -69,14 +107,31 @@ namespace ctr {
         } TextureData;
 
         typedef struct {
-            u16 rgbSources;
-            u16 alphaSources;
-            u16 rgbOperands;
-            u16 alphaOperands;
-            CombineFunc rgbCombine;
-            CombineFunc alphaCombine;
-            u32 constantColor;
-        } TexEnv;
+            ShaderType type;
+            u32 firstRegister;
+            u32 registers;
+            float* data;
+            u32 dirtyFirst;
+            u32 dirtyEnd;
+        } UniformBlockData;
+
+        typedef struct {
+            u32 start;
+            u32 end;
+            u32 used;
+            std::map<u32, u32> freeBlocks;
+        } VramBankData;
+
+        typedef struct {
+            const void* data;
+            u32 size;
+        } TraceBufferData;
+
+        typedef struct {
+            PipelineState state;
+            u32* commands;
+            u32 size;
+        } PipelineStateData;
 
         static const PixelFormat fbFormatToGPU[] = {
                 PIXEL_RGBA8,    // GSP_RGBA8_OES
@@ -86,6 +141,21 @@ namespace ctr {
                 PIXEL_RGBA4     // GSP_RGBA4_OES
         };
 
+        static const u32 gpuToTransferFormat[] = {
+                GX_TRANSFER_FMT_RGBA8,  // PIXEL_RGBA8
+                GX_TRANSFER_FMT_RGB8,   // PIXEL_RGB8
+                GX_TRANSFER_FMT_RGB5A1, // PIXEL_RGBA5551
+                GX_TRANSFER_FMT_RGB565, // PIXEL_RGB565
+                GX_TRANSFER_FMT_RGBA4   // PIXEL_RGBA4
+        };
+
+        static const u32 depthFormatBytes[] = {
+                2, // DEPTH_16
+                0,
+                3, // DEPTH_24
+                4  // DEPTH_24_STENCIL_8
+        };
+
         static aptHookCookie hookCookie;
 
         static u32 dirtyState;
@@ -94,6 +164,10 @@ namespace ctr {
 
         static u32 clearColor;
         static u32 clearDepth;
+        static bool clearPending;
+
+        static PixelFormat colorBufferFormat;
+        static DepthFormat depthBufferFormat;
 
         static Screen viewportScreen;
         static u32 viewportX;
@@ -101,6 +175,22 @@ namespace ctr {
         static u32 viewportWidth;
         static u32 viewportHeight;
 
+        static AntiAliasMode antiAliasModes[2];
+        static AntiAliasMode activeAntiAliasModes[2];
+        static u32 renderTargetScale;
+
+        static bool dynamicResolution;
+        static float dynamicResolutionTarget;
+        static float dynamicResolutionMinScale;
+        static float activeResolutionScales[2];
+        static u32 scaledTexture;
+        static u32* scaledDepthBuffer;
+        static bool resolvingScaledTarget;
+        static u32 dynamicResolutionOverFrames;
+        static u32 dynamicResolutionUnderFrames;
+        static u64 frameGpuTicks;
+        static float gpuTime;
+
         static ScissorMode scissorMode;
         static int scissorX;
         static int scissorY;
@@ -110,44 +200,13 @@ namespace ctr {
         static float depthMapZScale;
         static float depthMapZOffset;
 
-        static CullMode cullMode;
-
-        static bool stencilEnable;
-        static TestFunc stencilFunc;
-        static u8 stencilRef;
-        static u8 stencilInputMask;
-        static u8 stencilWriteMask;
-        static StencilOp stencilFail;
-        static StencilOp stencilZFail;
-        static StencilOp stencilZPass;
-
-        static u8 blendRed;
-        static u8 blendGreen;
-        static u8 blendBlue;
-        static u8 blendAlpha;
-        static BlendEquation blendColorEquation;
-        static BlendEquation blendAlphaEquation;
-        static BlendFactor blendColorSrc;
-        static BlendFactor blendColorDst;
-        static BlendFactor blendAlphaSrc;
-        static BlendFactor blendAlphaDst;
-
-        static bool alphaEnable;
-        static TestFunc alphaFunc;
-        static u8 alphaRef;
-
-        static bool depthEnable;
-        static TestFunc depthFunc;
-
-        static bool colorMaskRed;
-        static bool colorMaskGreen;
-        static bool colorMaskBlue;
-        static bool colorMaskAlpha;
-        static bool depthMask;
+        static PipelineState currState;
+        static PipelineStateData* boundPipelineState;
 
         static ShaderData* activeShader;
 
-        static TexEnv currTexEnv[TEX_ENV_COUNT];
+        static std::vector<UniformBlockData*> uniformBlocks;
+        static u32 uniformBlockMask[SHADER_GEOMETRY + 1][FLOAT_UNIFORM_COUNT / 32];
 
         static TextureData* activeTextures[TEX_UNIT_COUNT];
         static u32 enabledTextures;
@@ -155,23 +214,62 @@ namespace ctr {
         static bool allow3d;
         static ScreenSide screenSide;
 
+        static void* vramRegion;
+        static VramBankData vramBanks[2];
+        static std::unordered_map<u32, u32> vramBlocks;
+
         static u32* gpuCommandBuffer;
+        static u32 gpuCommandBufferSize;
+        static u32 commandHighWater;
+        static u32 commandOverflows;
+        static u32 frameCommandHighWater;
+        static u32 frameCommandOverflows;
+
+        static FrameStats frameStats;
+        static FrameStats lastFrameStats;
+        static u64 frameWaitTicks[GSPGPU_EVENT_MAX];
+
+        static FILE* traceFile;
+        static std::unordered_map<u32, TraceBufferData> traceBuffers;
         static u32* gpuFrameBuffer;
         static u32* gpuDepthBuffer;
 
         void aptHook(APT_HookType hook, void* param);
+        void vramInit(u32 size);
+        void vramExit();
+        void waitClear();
+        bool allocRenderTargets(PixelFormat colorFormat, DepthFormat depthFormat, u32 scale);
+        u32 renderScaleX();
+        u32 renderScaleY();
+        bool allocScaledTarget(PixelFormat colorFormat, DepthFormat depthFormat);
+        void freeScaledTarget();
+        bool renderScaled();
+        u32 scaledWidth();
+        u32 scaledHeight();
+        void resolveScaledTarget();
+        void updateDynamicResolution();
+        void ensureCommandSpace(u32 words);
+        void submitCommands();
+        void traceChunk(u32 type, const void* header, u32 headerSize, const void* data, u32 dataSize);
+        void traceBuffer(const void* data, u32 size);
+        void finishCommandTrace();
+        void writePipelineState(const PipelineState& state, u32 groups, u32 texEnvs);
         void updateState();
         void safeWait(GSPGPU_Event event);
     }
 }
 
-bool ctr::gpu::init()  {
+bool ctr::gpu::init(u32 commandBufferSize, u32 vramSize)  {
     dirtyState = 0xFFFFFFFF;
     dirtyTexEnvs = 0xFFFFFFFF;
     dirtyTextures = 0xFFFFFFFF;
 
     clearColor = 0;
     clearDepth = 0;
+    clearPending = false;
+
+    colorBufferFormat = PIXEL_RGBA8;
+    depthBufferFormat = DEPTH_24_STENCIL_8;
 
     viewportScreen = SCREEN_TOP;
     viewportX = 0;
@@ -179,6 +277,25 @@ bool ctr::gpu::init()  {
     viewportWidth = TOP_WIDTH;
     viewportHeight = TOP_HEIGHT;
 
+    antiAliasModes[SCREEN_TOP] = ANTIALIAS_NONE;
+    antiAliasModes[SCREEN_BOTTOM] = ANTIALIAS_NONE;
+    activeAntiAliasModes[SCREEN_TOP] = ANTIALIAS_NONE;
+    activeAntiAliasModes[SCREEN_BOTTOM] = ANTIALIAS_NONE;
+    renderTargetScale = 1;
+
+    dynamicResolution = false;
+    dynamicResolutionTarget = 14.0f;
+    dynamicResolutionMinScale = 1.0f;
+    activeResolutionScales[SCREEN_TOP] = 1.0f;
+    activeResolutionScales[SCREEN_BOTTOM] = 1.0f;
+    scaledTexture = 0;
+    scaledDepthBuffer = NULL;
+    resolvingScaledTarget = false;
+    dynamicResolutionOverFrames = 0;
+    dynamicResolutionUnderFrames = 0;
+    frameGpuTicks = 0;
+    gpuTime = 0;
+
     scissorMode = SCISSOR_DISABLE;
     scissorX = 0;
     scissorY = 0;
@@ -188,59 +305,63 @@ bool ctr::gpu::init()  {
     depthMapZScale = 0;
     depthMapZOffset = 1;
 
-    cullMode = CULL_NONE;
-
-    stencilEnable = false;
-    stencilFunc = TEST_ALWAYS;
-    stencilRef = 0;
-    stencilInputMask = 0xFF;
-    stencilWriteMask = 0;
-    stencilFail = STENCIL_OP_KEEP;
-    stencilZFail = STENCIL_OP_KEEP;
-    stencilZPass = STENCIL_OP_KEEP;
-
-    blendRed = 0;
-    blendGreen = 0;
-    blendBlue = 0;
-    blendAlpha = 0;
-    blendColorEquation = BLEND_ADD;
-    blendAlphaEquation = BLEND_ADD;
-    blendColorSrc = FACTOR_SRC_ALPHA;
-    blendColorDst = FACTOR_ONE_MINUS_SRC_ALPHA;
-    blendAlphaSrc = FACTOR_SRC_ALPHA;
-    blendAlphaDst = FACTOR_ONE_MINUS_SRC_ALPHA;
-
-    alphaEnable = false;
-    alphaFunc = TEST_ALWAYS;
-    alphaRef = 0;
-
-    depthEnable = false;
-    depthFunc = TEST_GREATER;
-
-    colorMaskRed = true;
-    colorMaskGreen = true;
-    colorMaskBlue = true;
-    colorMaskAlpha = true;
-    depthMask = true;
+    currState.cullMode = CULL_NONE;
+
+    currState.stencilEnable = false;
+    currState.stencilFunc = TEST_ALWAYS;
+    currState.stencilRef = 0;
+    currState.stencilInputMask = 0xFF;
+    currState.stencilWriteMask = 0;
+    currState.stencilFail = STENCIL_OP_KEEP;
+    currState.stencilZFail = STENCIL_OP_KEEP;
+    currState.stencilZPass = STENCIL_OP_KEEP;
+
+    currState.blendRed = 0;
+    currState.blendGreen = 0;
+    currState.blendBlue = 0;
+    currState.blendAlpha = 0;
+    currState.blendColorEquation = BLEND_ADD;
+    currState.blendAlphaEquation = BLEND_ADD;
+    currState.blendColorSrc = FACTOR_SRC_ALPHA;
+    currState.blendColorDst = FACTOR_ONE_MINUS_SRC_ALPHA;
+    currState.blendAlphaSrc = FACTOR_SRC_ALPHA;
+    currState.blendAlphaDst = FACTOR_ONE_MINUS_SRC_ALPHA;
+
+    currState.alphaEnable = false;
+    currState.alphaFunc = TEST_ALWAYS;
+    currState.alphaRef = 0;
+
+    currState.depthEnable = false;
+    currState.depthFunc = TEST_GREATER;
+
+    currState.colorMaskRed = true;
+    currState.colorMaskGreen = true;
+    currState.colorMaskBlue = true;
+    currState.colorMaskAlpha = true;
+    currState.depthMask = true;
+
+    currState.texEnv[0].rgbSources = gpu::texEnvSources(SOURCE_TEXTURE0, SOURCE_PRIMARY_COLOR, SOURCE_PRIMARY_COLOR);
+    currState.texEnv[0].alphaSources = gpu::texEnvSources(SOURCE_TEXTURE0, SOURCE_PRIMARY_COLOR, SOURCE_PRIMARY_COLOR);
+    currState.texEnv[0].rgbOperands = gpu::texEnvOperands(TEXENV_OP_RGB_SRC_COLOR, TEXENV_OP_RGB_SRC_COLOR, TEXENV_OP_RGB_SRC_COLOR);
+    currState.texEnv[0].alphaOperands = gpu::texEnvOperands(TEXENV_OP_A_SRC_ALPHA, TEXENV_OP_A_SRC_ALPHA, TEXENV_OP_A_SRC_ALPHA);
+    currState.texEnv[0].rgbCombine = COMBINE_MODULATE;
+    currState.texEnv[0].alphaCombine = COMBINE_MODULATE;
+    currState.texEnv[0].constantColor = 0xFFFFFFFF;
+    for(u8 env = 1; env < TEX_ENV_COUNT; env++) {
+        currState.texEnv[env].rgbSources = gpu::texEnvSources(SOURCE_PREVIOUS, SOURCE_PRIMARY_COLOR, SOURCE_PRIMARY_COLOR);
+        currState.texEnv[env].alphaSources = gpu::texEnvSources(SOURCE_PREVIOUS, SOURCE_PRIMARY_COLOR, SOURCE_PRIMARY_COLOR);
+        currState.texEnv[env].rgbOperands = gpu::texEnvOperands(TEXENV_OP_RGB_SRC_COLOR, TEXENV_OP_RGB_SRC_COLOR, TEXENV_OP_RGB_SRC_COLOR);
+        currState.texEnv[env].alphaOperands = gpu::texEnvOperands(TEXENV_OP_A_SRC_ALPHA, TEXENV_OP_A_SRC_ALPHA, TEXENV_OP_A_SRC_ALPHA);
+        currState.texEnv[env].rgbCombine = COMBINE_REPLACE;
+        currState.texEnv[env].alphaCombine = COMBINE_REPLACE;
+        currState.texEnv[env].constantColor = 0xFFFFFFFF;
+    }
+
+    boundPipelineState = NULL;
 
     activeShader = NULL;
 
-    currTexEnv[0].rgbSources = gpu::texEnvSources(SOURCE_TEXTURE0, SOURCE_PRIMARY_COLOR, SOURCE_PRIMARY_COLOR);
-    currTexEnv[0].alphaSources = gpu::texEnvSources(SOURCE_TEXTURE0, SOURCE_PRIMARY_COLOR, SOURCE_PRIMARY_COLOR);
-    currTexEnv[0].rgbOperands = gpu::texEnvOperands(TEXENV_OP_RGB_SRC_COLOR, TEXENV_OP_RGB_SRC_COLOR, TEXENV_OP_RGB_SRC_COLOR);
-    currTexEnv[0].alphaOperands = gpu::texEnvOperands(TEXENV_OP_A_SRC_ALPHA, TEXENV_OP_A_SRC_ALPHA, TEXENV_OP_A_SRC_ALPHA);
-    currTexEnv[0].rgbCombine = COMBINE_MODULATE;
-    currTexEnv[0].alphaCombine = COMBINE_MODULATE;
-    currTexEnv[0].constantColor = 0xFFFFFFFF;
-    for(u8 env = 1; env < TEX_ENV_COUNT; env++) {
-        currTexEnv[env].rgbSources = gpu::texEnvSources(SOURCE_PREVIOUS, SOURCE_PRIMARY_COLOR, SOURCE_PRIMARY_COLOR);
-        currTexEnv[env].alphaSources = gpu::texEnvSources(SOURCE_PREVIOUS, SOURCE_PRIMARY_COLOR, SOURCE_PRIMARY_COLOR);
-        currTexEnv[env].rgbOperands = gpu::texEnvOperands(TEXENV_OP_RGB_SRC_COLOR, TEXENV_OP_RGB_SRC_COLOR, TEXENV_OP_RGB_SRC_COLOR);
-        currTexEnv[env].alphaOperands = gpu::texEnvOperands(TEXENV_OP_A_SRC_ALPHA, TEXENV_OP_A_SRC_ALPHA, TEXENV_OP_A_SRC_ALPHA);
-        currTexEnv[env].rgbCombine = COMBINE_REPLACE;
-        currTexEnv[env].alphaCombine = COMBINE_REPLACE;
-        currTexEnv[env].constantColor = 0xFFFFFFFF;
-    }
+    std::memset(uniformBlockMask, 0, sizeof(uniformBlockMask));
 
     for(u8 unit = 0; unit < TEX_UNIT_COUNT; unit++) {
         activeTextures[unit] = NULL;
@@ -251,34 +372,39 @@ bool ctr::gpu::init()  {
     allow3d = false;
     screenSide = SIDE_LEFT;
 
-    gpuCommandBuffer = (u32*) linearAlloc(COMMAND_BUFFER_SIZE * sizeof(u32));
-    if(gpuCommandBuffer == NULL) {
-        return false;
-    }
+    std::memset(&frameStats, 0, sizeof(frameStats));
+    std::memset(&lastFrameStats, 0, sizeof(lastFrameStats));
+    std::memset(frameWaitTicks, 0, sizeof(frameWaitTicks));
 
-    gpuFrameBuffer = (u32*) vramAlloc(TOP_WIDTH * TOP_HEIGHT * sizeof(u32));
-    if(gpuFrameBuffer == NULL) {
-        linearFree(gpuCommandBuffer);
-        gpuCommandBuffer = NULL;
+    traceFile = NULL;
+
+    gpuCommandBufferSize = commandBufferSize < COMMAND_BUFFER_MIN_SIZE ? COMMAND_BUFFER_MIN_SIZE : commandBufferSize;
+    commandHighWater = 0;
+    commandOverflows = 0;
+    frameCommandHighWater = 0;
+    frameCommandOverflows = 0;
 
+    gpuCommandBuffer = (u32*) linearAlloc(gpuCommandBufferSize * sizeof(u32));
+    if(gpuCommandBuffer == NULL) {
         return false;
     }
 
-    gpuDepthBuffer = (u32*) vramAlloc(TOP_WIDTH * TOP_HEIGHT * sizeof(u32));
-    if(gpuDepthBuffer == NULL) {
+    vramInit(vramSize);
+
+    gpuFrameBuffer = NULL;
+    gpuDepthBuffer = NULL;
+    if(!allocRenderTargets(colorBufferFormat, depthBufferFormat, renderTargetScale)) {
         linearFree(gpuCommandBuffer);
         gpuCommandBuffer = NULL;
 
-        vramFree(gpuFrameBuffer);
-        gpuFrameBuffer = NULL;
-
+        vramExit();
         return false;
     }
 
     gfxInitDefault();
     gfxSet3D(true);
 
-    GPUCMD_SetBuffer(gpuCommandBuffer, COMMAND_BUFFER_SIZE, 0);
+    GPUCMD_SetBuffer(gpuCommandBuffer, gpuCommandBufferSize, 0);
 
     aptHook(&hookCookie, aptHook, NULL);
 
@@ -288,6 +414,9 @@ bool ctr::gpu::init()  {
 }
 
 void ctr::gpu::exit()  {
+    waitClear();
+    finishCommandTrace();
+
     aptUnhook(&hookCookie);
 
     gfxExit();
@@ -298,14 +427,18 @@ void ctr::gpu::exit()  {
     }
 
     if(gpuFrameBuffer != NULL) {
-        vramFree(gpuFrameBuffer);
+        vfree(gpuFrameBuffer);
         gpuFrameBuffer = NULL;
     }
 
     if(gpuDepthBuffer != NULL) {
-        vramFree(gpuDepthBuffer);
+        vfree(gpuDepthBuffer);
         gpuDepthBuffer = NULL;
     }
+
+    freeScaledTarget();
+
+    vramExit();
 }
 
 void ctr::gpu::aptHook(APT_HookType hook, void* param) {
@@ -313,44 +446,437 @@ void ctr::gpu::aptHook(APT_HookType hook, void* param) {
         dirtyState = 0xFFFFFFFF;
         dirtyTexEnvs = 0xFFFFFFFF;
         dirtyTextures = 0xFFFFFFFF;
+
+        boundPipelineState = NULL;
+
+        for(std::vector<UniformBlockData*>::iterator it = uniformBlocks.begin(); it != uniformBlocks.end(); it++) {
+            (*it)->dirtyFirst = 0;
+            (*it)->dirtyEnd = (*it)->registers;
+        }
+    }
+}
+
+void ctr::gpu::vramInit(u32 size) {
+    // Reserve a bounded region from libctru so that placement within each bank is under our control,
+    // leaving the rest for code that calls vramAlloc() directly.
+    u32 free = vramSpaceFree();
+    size = (size < free ? size : free) & ~(VRAM_ALIGNMENT - 1);
+
+    // Pad the front so the region straddles the bank boundary and gets a share of both banks.
+    void* pad = NULL;
+    u32 padSize = VRAM_BANK_SIZE > size / 2 ? VRAM_BANK_SIZE - size / 2 : 0;
+    if(size > 0 && padSize > 0 && padSize + size <= free) {
+        pad = ::vramAlloc(padSize);
+    }
+
+    vramRegion = size > 0 ? ::vramAlloc(size) : NULL;
+    if(pad != NULL) {
+        ::vramFree(pad);
+    }
+
+    vramBlocks.clear();
+
+    for(u32 bank = 0; bank < 2; bank++) {
+        VramBankData* bankData = &vramBanks[bank];
+        bankData->used = 0;
+        bankData->freeBlocks.clear();
+
+        if(vramRegion == NULL) {
+            bankData->start = 0;
+            bankData->end = 0;
+            continue;
+        }
+
+        u32 bankStart = VRAM_START + bank * VRAM_BANK_SIZE;
+        u32 bankEnd = bankStart + VRAM_BANK_SIZE;
+        u32 regionStart = (u32) vramRegion;
+        u32 regionEnd = regionStart + size;
+
+        bankData->start = regionStart > bankStart ? regionStart : bankStart;
+        bankData->end = regionEnd < bankEnd ? regionEnd : bankEnd;
+        if(bankData->start < bankData->end) {
+            bankData->freeBlocks[bankData->start] = bankData->end - bankData->start;
+        } else {
+            bankData->start = 0;
+            bankData->end = 0;
+        }
+    }
+}
+
+void ctr::gpu::vramExit() {
+    vramBlocks.clear();
+    for(u32 bank = 0; bank < 2; bank++) {
+        vramBanks[bank].freeBlocks.clear();
+        vramBanks[bank].used = 0;
+    }
+
+    if(vramRegion != NULL) {
+        ::vramFree(vramRegion);
+        vramRegion = NULL;
+    }
+}
+
+void* ctr::gpu::valloc(u32 size, VramBank bank) {
+    if(size == 0) {
+        return NULL;
+    }
+
+    if(vramRegion == NULL) {
+        return vramMemAlign(size, VRAM_ALIGNMENT);
+    }
+
+    size = (size + VRAM_ALIGNMENT - 1) & ~(VRAM_ALIGNMENT - 1);
+
+    // Without a preference, try the emptier bank first.
+    u32 order[2] = {0, 1};
+    if(bank == VRAM_BANK_B || (bank == VRAM_BANK_ANY && vramBanks[1].end - vramBanks[1].start - vramBanks[1].used > vramBanks[0].end - vramBanks[0].start - vramBanks[0].used)) {
+        order[0] = 1;
+        order[1] = 0;
+    }
+
+    u32 attempts = bank == VRAM_BANK_ANY ? 2 : 1;
+    for(u32 i = 0; i < attempts; i++) {
+        VramBankData* bankData = &vramBanks[order[i]];
+        for(std::map<u32, u32>::iterator it = bankData->freeBlocks.begin(); it != bankData->freeBlocks.end(); it++) {
+            if((*it).second >= size) {
+                u32 addr = (*it).first;
+                u32 remaining = (*it).second - size;
+
+                bankData->freeBlocks.erase(it);
+                if(remaining > 0) {
+                    bankData->freeBlocks[addr + size] = remaining;
+                }
+
+                bankData->used += size;
+                vramBlocks[addr] = size;
+                return (void*) addr;
+            }
+        }
+    }
+
+    // Once the reserved region is full, requests without a bank preference fall back to libctru's heap.
+    return bank == VRAM_BANK_ANY ? vramMemAlign(size, VRAM_ALIGNMENT) : NULL;
+}
+
+void ctr::gpu::vfree(void* mem) {
+    if(mem == NULL) {
+        return;
+    }
+
+    if(vramRegion == NULL) {
+        vramFree(mem);
+        return;
+    }
+
+    std::unordered_map<u32, u32>::iterator block = vramBlocks.find((u32) mem);
+    if(block == vramBlocks.end()) {
+        vramFree(mem);
+        return;
+    }
+
+    u32 addr = (*block).first;
+    u32 size = (*block).second;
+    vramBlocks.erase(block);
+
+    VramBankData* bankData = &vramBanks[addr >= VRAM_START + VRAM_BANK_SIZE ? 1 : 0];
+    bankData->used -= size;
+
+    // Coalesce with the neighbouring free blocks.
+    std::map<u32, u32>::iterator next = bankData->freeBlocks.lower_bound(addr);
+    if(next != bankData->freeBlocks.end() && addr + size == (*next).first) {
+        size += (*next).second;
+        next = bankData->freeBlocks.erase(next);
+    }
+
+    if(next != bankData->freeBlocks.begin()) {
+        std::map<u32, u32>::iterator prev = next;
+        prev--;
+        if((*prev).first + (*prev).second == addr) {
+            (*prev).second += size;
+            return;
+        }
+    }
+
+    bankData->freeBlocks[addr] = size;
+}
+
+void ctr::gpu::getVramUsage(VramBank bank, u32* used, u32* total) {
+    u32 usedBytes = 0;
+    u32 totalBytes = 0;
+    for(u32 i = 0; i < 2; i++) {
+        if(bank == VRAM_BANK_ANY || (u32) bank == i + 1) {
+            usedBytes += vramBanks[i].used;
+            totalBytes += vramBanks[i].end - vramBanks[i].start;
+        }
+    }
+
+    if(used != NULL) {
+        *used = usedBytes;
+    }
+
+    if(total != NULL) {
+        *total = totalBytes;
+    }
+}
+
+bool ctr::gpu::allocRenderTargets(PixelFormat colorFormat, DepthFormat depthFormat, u32 scale) {
+    waitClear();
+
+    u32 pixels = TOP_WIDTH * TOP_HEIGHT * scale;
+
+    // Color and depth on opposite banks let the PICA read and write them in parallel.
+    u32* frameBuffer = (u32*) valloc(pixels * bitsPerPixel(colorFormat) / 8, VRAM_BANK_A);
+    if(frameBuffer == NULL) {
+        frameBuffer = (u32*) valloc(pixels * bitsPerPixel(colorFormat) / 8, VRAM_BANK_ANY);
+        if(frameBuffer == NULL) {
+            return false;
+        }
+    }
+
+    u32* depthBuffer = (u32*) valloc(pixels * depthFormatBytes[depthFormat], VRAM_BANK_B);
+    if(depthBuffer == NULL) {
+        depthBuffer = (u32*) valloc(pixels * depthFormatBytes[depthFormat], VRAM_BANK_ANY);
+        if(depthBuffer == NULL) {
+            vfree(frameBuffer);
+            return false;
+        }
+    }
+
+    if(gpuFrameBuffer != NULL) {
+        vfree(gpuFrameBuffer);
+    }
+
+    if(gpuDepthBuffer != NULL) {
+        vfree(gpuDepthBuffer);
+    }
+
+    gpuFrameBuffer = frameBuffer;
+    gpuDepthBuffer = depthBuffer;
+    return true;
+}
+
+u32 ctr::gpu::renderScaleX() {
+    // Screen x runs along the transfer engine's vertical axis, which is only scaled in 2x2 mode.
+    return activeAntiAliasModes[viewportScreen] == ANTIALIAS_4X ? 2 : 1;
+}
+
+u32 ctr::gpu::renderScaleY() {
+    return activeAntiAliasModes[viewportScreen] != ANTIALIAS_NONE ? 2 : 1;
+}
+
+bool ctr::gpu::allocScaledTarget(PixelFormat colorFormat, DepthFormat depthFormat) {
+    freeScaledTarget();
+
+    // The color buffer doubles as a texture, so the present pass can sample it with bilinear filtering.
+    createTexture(&scaledTexture);
+    setTextureInfo(scaledTexture, SCALED_TARGET_HEIGHT, SCALED_TARGET_WIDTH, colorFormat, textureMinFilter(FILTER_LINEAR) | textureMagFilter(FILTER_LINEAR), TEXTURE_PLACE_VRAM_A);
+
+    void* colorBuffer = NULL;
+    getTextureData(scaledTexture, &colorBuffer);
+
+    u32 depthSize = SCALED_TARGET_WIDTH * SCALED_TARGET_HEIGHT * depthFormatBytes[depthFormat];
+    scaledDepthBuffer = (u32*) valloc(depthSize, VRAM_BANK_B);
+    if(scaledDepthBuffer == NULL) {
+        scaledDepthBuffer = (u32*) valloc(depthSize, VRAM_BANK_ANY);
+    }
+
+    if(colorBuffer == NULL || scaledDepthBuffer == NULL) {
+        freeScaledTarget();
+        return false;
+    }
+
+    return true;
+}
+
+void ctr::gpu::freeScaledTarget() {
+    if(scaledTexture != 0) {
+        freeTexture(scaledTexture);
+        scaledTexture = 0;
+    }
+
+    if(scaledDepthBuffer != NULL) {
+        vfree(scaledDepthBuffer);
+        scaledDepthBuffer = NULL;
+    }
+}
+
+bool ctr::gpu::renderScaled() {
+    return scaledTexture != 0 && !resolvingScaledTarget && activeResolutionScales[viewportScreen] < 1.0f;
+}
+
+u32 ctr::gpu::scaledWidth() {
+    // Render buffer dimensions have to stay whole tiles.
+    u32 width = ((u32) (viewportWidth * activeResolutionScales[viewportScreen])) & ~7;
+    return width < 8 ? 8 : width > SCALED_TARGET_WIDTH ? SCALED_TARGET_WIDTH : width;
+}
+
+u32 ctr::gpu::scaledHeight() {
+    u32 height = ((u32) (viewportHeight * activeResolutionScales[viewportScreen])) & ~7;
+    return height < 8 ? 8 : height > SCALED_TARGET_HEIGHT ? SCALED_TARGET_HEIGHT : height;
+}
+
+void ctr::gpu::resolveScaledTarget() {
+    if(!renderScaled()) {
+        return;
+    }
+
+    u32 width = scaledWidth();
+    u32 height = scaledHeight();
+
+    // Everything drawn so far has to land in the scaled target before it is sampled.
+    flushCommands();
+
+    PipelineState oldState = currState;
+    ScissorMode oldScissorMode = scissorMode;
+
+    PipelineState state = currState;
+    state.cullMode = CULL_NONE;
+    state.stencilEnable = false;
+    state.alphaEnable = false;
+    state.depthEnable = false;
+    state.depthMask = false;
+    state.colorMaskRed = true;
+    state.colorMaskGreen = true;
+    state.colorMaskBlue = true;
+    state.colorMaskAlpha = true;
+    state.blendColorEquation = BLEND_ADD;
+    state.blendAlphaEquation = BLEND_ADD;
+    state.blendColorSrc = FACTOR_ONE;
+    state.blendColorDst = FACTOR_ZERO;
+    state.blendAlphaSrc = FACTOR_ONE;
+    state.blendAlphaDst = FACTOR_ZERO;
+    for(u8 env = 0; env < TEX_ENV_COUNT; env++) {
+        TexEnvSource source = env == 0 ? SOURCE_TEXTURE0 : SOURCE_PREVIOUS;
+        state.texEnv[env].rgbSources = texEnvSources(source, SOURCE_PRIMARY_COLOR, SOURCE_PRIMARY_COLOR);
+        state.texEnv[env].alphaSources = texEnvSources(source, SOURCE_PRIMARY_COLOR, SOURCE_PRIMARY_COLOR);
+        state.texEnv[env].rgbOperands = texEnvOperands(TEXENV_OP_RGB_SRC_COLOR, TEXENV_OP_RGB_SRC_COLOR, TEXENV_OP_RGB_SRC_COLOR);
+        state.texEnv[env].alphaOperands = texEnvOperands(TEXENV_OP_A_SRC_ALPHA, TEXENV_OP_A_SRC_ALPHA, TEXENV_OP_A_SRC_ALPHA);
+        state.texEnv[env].rgbCombine = COMBINE_REPLACE;
+        state.texEnv[env].alphaCombine = COMBINE_REPLACE;
+    }
+
+    // Stretch the rendered corner of the scaled target over the full-resolution viewport.
+    resolvingScaledTarget = true;
+    scissorMode = SCISSOR_DISABLE;
+    dirtyState |= STATE_VIEWPORT | STATE_SCISSOR_TEST;
+
+    setPipelineState(&state);
+    gput::drawScaledFrame(scaledTexture, (float) height / SCALED_TARGET_HEIGHT, (float) width / SCALED_TARGET_WIDTH);
+    flushCommands();
+
+    resolvingScaledTarget = false;
+    scissorMode = oldScissorMode;
+    dirtyState |= STATE_VIEWPORT | STATE_SCISSOR_TEST;
+
+    setPipelineState(&oldState);
+}
+
+void ctr::gpu::writePipelineState(const PipelineState& state, u32 groups, u32 texEnvs) {
+    if(groups & STATE_CULL) {
+        GPUCMD_AddWrite(GPUREG_FACECULLING_CONFIG, state.cullMode & 0x3);
+    }
+
+    if(groups & STATE_STENCIL_TEST) {
+        GPUCMD_AddWrite(GPUREG_STENCIL_TEST, (state.stencilEnable & 1) | ((state.stencilFunc & 7) << 4) | (state.stencilWriteMask << 8) | (state.stencilRef << 16) | (state.stencilInputMask << 24));
+        GPUCMD_AddWrite(GPUREG_STENCIL_OP, state.stencilFail | (state.stencilZFail << 4) | (state.stencilZPass << 8));
+    }
+
+    if(groups & STATE_BLEND) {
+        GPUCMD_AddWrite(GPUREG_BLEND_COLOR, state.blendRed | (state.blendGreen << 8) | (state.blendBlue << 16) | (state.blendAlpha << 24));
+
+        GPUCMD_AddWrite(GPUREG_BLEND_FUNC, state.blendColorEquation | (state.blendAlphaEquation << 8) | (state.blendColorSrc << 16) | (state.blendColorDst << 20) | (state.blendAlphaSrc << 24) | (state.blendAlphaDst << 28));
+        GPUCMD_AddMaskedWrite(GPUREG_COLOR_OPERATION, 0x2, 0x00000100);
+    }
+
+    if(groups & STATE_ALPHA_TEST) {
+        GPUCMD_AddWrite(GPUREG_FRAGOP_ALPHA_TEST, (state.alphaEnable & 1) | ((state.alphaFunc & 7) << 4) | (state.alphaRef << 8));
+    }
+
+    if(groups & STATE_DEPTH_TEST_AND_MASK) {
+        u32 componentMask = ((u32) state.colorMaskRed * GPU_WRITE_RED) | ((u32) state.colorMaskGreen * GPU_WRITE_GREEN) | ((u32) state.colorMaskBlue * GPU_WRITE_BLUE) | ((u32) state.colorMaskAlpha * GPU_WRITE_ALPHA) | ((u32) state.depthMask * GPU_WRITE_DEPTH);
+        GPUCMD_AddWrite(GPUREG_DEPTH_COLOR_MASK, (state.depthEnable & 1) | ((state.depthFunc & 7) << 4) | (componentMask << 8));
+    }
+
+    if((groups & STATE_TEX_ENV) && texEnvs != 0) {
+        for(u8 env = 0; env < TEX_ENV_COUNT; env++) {
+            if(texEnvs & (1 << env)) {
+                u32 param[0x5] = {0};
+
+                param[0x0] = (state.texEnv[env].alphaSources << 16) | (state.texEnv[env].rgbSources);
+                param[0x1] = (state.texEnv[env].alphaOperands << 12) | (state.texEnv[env].rgbOperands);
+                param[0x2] = (state.texEnv[env].alphaCombine << 16) | (state.texEnv[env].rgbCombine);
+                param[0x3] = state.texEnv[env].constantColor;
+                param[0x4] = 0x00000000;
+
+                int tevBase = GPUREG_TEXENV0_SOURCE + (env * 0x8);
+                if(env >= 4) {
+                    tevBase += 0x10;
+                }
+
+                GPUCMD_AddIncrementalWrites(tevBase, param, 0x00000005);
+            }
+        }
     }
 }
 
 void ctr::gpu::updateState()  {
     if(dirtyState & STATE_VIEWPORT) {
+        frameStats.stateGroups++;
+
         u32 param[0x4] = {0};
 
         GPUCMD_AddWrite(GPUREG_FRAMEBUFFER_FLUSH, 0x00000001);
         GPUCMD_AddWrite(GPUREG_FRAMEBUFFER_INVALIDATE, 0x00000001);
 
-        u32 dim2 = 0x01000000 | (((viewportWidth - 1) & 0xFFF) << 12) | (viewportHeight & 0xFFF);
+        void* colorTarget = gpuFrameBuffer;
+        void* depthTarget = gpuDepthBuffer;
+        u32 renderWidth = viewportWidth * renderScaleX();
+        u32 renderHeight = viewportHeight * renderScaleY();
+        u32 bufferWidth = renderWidth;
+        u32 bufferHeight = renderHeight;
+        u32 renderX = viewportY * renderScaleX();
+        u32 renderY = viewportX * renderScaleY();
+        if(renderScaled()) {
+            getTextureData(scaledTexture, &colorTarget);
+            depthTarget = scaledDepthBuffer;
+            renderWidth = scaledWidth();
+            renderHeight = scaledHeight();
+            bufferWidth = SCALED_TARGET_WIDTH;
+            bufferHeight = SCALED_TARGET_HEIGHT;
+            renderX = viewportY * renderWidth / viewportWidth;
+            renderY = viewportX * renderHeight / viewportHeight;
+        }
+
+        u32 dim2 = 0x01000000 | (((bufferWidth - 1) & 0xFFF) << 12) | (bufferHeight & 0xFFF);
 
-        param[0x0] = osConvertVirtToPhys(gpuDepthBuffer) >> 3;
-        param[0x1] = osConvertVirtToPhys(gpuFrameBuffer) >> 3;
+        param[0x0] = osConvertVirtToPhys(depthTarget) >> 3;
+        param[0x1] = osConvertVirtToPhys(colorTarget) >> 3;
         param[0x2] = dim2;
         GPUCMD_AddIncrementalWrites(GPUREG_DEPTHBUFFER_LOC, param, 0x00000003);
 
         GPUCMD_AddWrite(GPUREG_RENDERBUF_DIM, dim2);
-        GPUCMD_AddWrite(GPUREG_DEPTHBUFFER_FORMAT, 0x00000003);
-        GPUCMD_AddWrite(GPUREG_COLORBUFFER_FORMAT, 0x00000002);
+        GPUCMD_AddWrite(GPUREG_DEPTHBUFFER_FORMAT, depthBufferFormat);
+        GPUCMD_AddWrite(GPUREG_COLORBUFFER_FORMAT, (colorBufferFormat << 16) | (bitsPerPixel(colorBufferFormat) == 32 ? 2 : 0));
         GPUCMD_AddWrite(GPUREG_FRAMEBUFFER_BLOCK32, 0x00000000);
 
-        param[0x0] = f32tof24((float) viewportHeight / 2.0f);
-        param[0x1] = f32tof31(2.0f / (float) viewportHeight) << 1;
-        param[0x2] = f32tof24((float) viewportWidth / 2.0f);
-        param[0x3] = f32tof31(2.0f / (float) viewportWidth) << 1;
+        param[0x0] = f32tof24((float) renderHeight / 2.0f);
+        param[0x1] = f32tof31(2.0f / (float) renderHeight) << 1;
+        param[0x2] = f32tof24((float) renderWidth / 2.0f);
+        param[0x3] = f32tof31(2.0f / (float) renderWidth) << 1;
         GPUCMD_AddIncrementalWrites(GPUREG_VIEWPORT_WIDTH, param, 0x00000004);
 
-        GPUCMD_AddWrite(GPUREG_VIEWPORT_XY, (viewportY << 16) | (viewportX & 0xFFFF));
+        GPUCMD_AddWrite(GPUREG_VIEWPORT_XY, (renderX << 16) | (renderY & 0xFFFF));
 
         param[0x0] = 0x0000000F;
         param[0x1] = 0x0000000F;
-        param[0x2] = 0x00000002;
-        param[0x3] = 0x00000002;
+        param[0x2] = depthBufferFormat == DEPTH_24_STENCIL_8 ? 0x00000003 : 0x00000002;
+        param[0x3] = depthBufferFormat == DEPTH_24_STENCIL_8 ? 0x00000003 : 0x00000002;
         GPUCMD_AddIncrementalWrites(GPUREG_COLORBUFFER_READ, param, 0x00000004);
     }
 
     if(dirtyState & STATE_SCISSOR_TEST) {
+        frameStats.stateGroups++;
+
         u32 screenWidth = viewportScreen == SCREEN_TOP ? TOP_WIDTH : BOTTOM_WIDTH;
         u32 screenHeight = viewportScreen == SCREEN_TOP ? TOP_HEIGHT : BOTTOM_HEIGHT;
 
@@ -362,65 +888,87 @@ void ctr::gpu::updateState()  {
         #undef clamp
 
         u32 param[0x3] = {0};
+        float scaleX = (float) renderScaleX();
+        float scaleY = (float) renderScaleY();
+        if(renderScaled()) {
+            scaleX = (float) scaledWidth() / viewportWidth;
+            scaleY = (float) scaledHeight() / viewportHeight;
+        }
+
         param[0x0] = scissorMode;
-        param[0x1] = ((screenWidth - right) << 16) | (bottom & 0xFFFF);
-        param[0x2] = (((screenWidth - left) - 1) << 16) | ((top - 1) & 0xFFFF);
+        param[0x1] = (((u32) ((screenWidth - right) * scaleX)) << 16) | (((u32) (bottom * scaleY)) & 0xFFFF);
+        param[0x2] = (((u32) ((screenWidth - left) * scaleX) - 1) << 16) | (((u32) (top * scaleY) - 1) & 0xFFFF);
         GPUCMD_AddIncrementalWrites(GPUREG_SCISSORTEST_MODE, param, 0x00000003);
     }
 
     if(dirtyState & STATE_DEPTH_MAP) {
+        frameStats.stateGroups++;
+
         GPUCMD_AddWrite(GPUREG_DEPTHMAP_ENABLE, 0x00000001);
         GPUCMD_AddWrite(GPUREG_DEPTHMAP_SCALE, f32tof24(depthMapZScale));
         GPUCMD_AddWrite(GPUREG_DEPTHMAP_OFFSET, f32tof24(depthMapZOffset));
     }
 
-    if(dirtyState & STATE_CULL) {
-        GPUCMD_AddWrite(GPUREG_FACECULLING_CONFIG, cullMode & 0x3);
-    }
-
-    if(dirtyState & STATE_STENCIL_TEST) {
-        GPUCMD_AddWrite(GPUREG_STENCIL_TEST, (stencilEnable & 1) | ((stencilFunc & 7) << 4) | (stencilWriteMask << 8) | (stencilRef << 16) | (stencilInputMask << 24));
-        GPUCMD_AddWrite(GPUREG_STENCIL_OP, stencilFail | (stencilZFail << 4) | (stencilZPass << 8));
-    }
-
-    if(dirtyState & STATE_BLEND) {
-        GPUCMD_AddWrite(GPUREG_BLEND_COLOR, blendRed | (blendGreen << 8) | (blendBlue << 16) | (blendAlpha << 24));
-
-        GPUCMD_AddWrite(GPUREG_BLEND_FUNC, blendColorEquation | (blendAlphaEquation << 8) | (blendColorSrc << 16) | (blendColorDst << 20) | (blendAlphaSrc << 24) | (blendAlphaDst << 28));
-        GPUCMD_AddMaskedWrite(GPUREG_COLOR_OPERATION, 0x2, 0x00000100);
-    }
-
-    if(dirtyState & STATE_ALPHA_TEST) {
-        GPUCMD_AddWrite(GPUREG_FRAGOP_ALPHA_TEST, (alphaEnable & 1) | ((alphaFunc & 7) << 4) | (alphaRef << 8));
+    // Texture combiners only emit commands for the stages that changed.
+    frameStats.stateGroups += __builtin_popcount(dirtyState & (STATE_CULL | STATE_STENCIL_TEST | STATE_BLEND | STATE_ALPHA_TEST | STATE_DEPTH_TEST_AND_MASK));
+    if((dirtyState & STATE_TEX_ENV) && dirtyTexEnvs != 0) {
+        frameStats.stateGroups++;
     }
 
-    if(dirtyState & STATE_DEPTH_TEST_AND_MASK) {
-        u32 componentMask = ((u32) colorMaskRed * GPU_WRITE_RED) | ((u32) colorMaskGreen * GPU_WRITE_GREEN) | ((u32) colorMaskBlue * GPU_WRITE_BLUE) | ((u32) colorMaskAlpha * GPU_WRITE_ALPHA) | ((u32) depthMask * GPU_WRITE_DEPTH);
-        GPUCMD_AddWrite(GPUREG_DEPTH_COLOR_MASK, (depthEnable & 1) | ((depthFunc & 7) << 4) | (componentMask << 8));
+    writePipelineState(currState, dirtyState, dirtyTexEnvs);
+    if(dirtyState & STATE_TEX_ENV) {
+        dirtyTexEnvs = 0;
     }
 
     if((dirtyState & STATE_ACTIVE_SHADER) && activeShader != NULL && activeShader->dvlb != NULL) {
+        frameStats.stateGroups++;
         shaderProgramUse(&activeShader->program);
     }
 
     if((dirtyState & STATE_ACTIVE_SHADER_UNIFORMS) && activeShader != NULL && activeShader->dvlb != NULL) {
+        frameStats.stateGroups++;
         for(ShaderType type = SHADER_VERTEX; type <= SHADER_GEOMETRY; type = (ShaderType) (type + 1)) {
             shaderInstance_s* instance = type == SHADER_VERTEX ? activeShader->program.vertexShader : activeShader->program.geometryShader;
             if(instance != NULL) {
                 for(std::unordered_map<std::string, Uniform>::iterator it = activeShader->uniforms[type].begin(); it != activeShader->uniforms[type].end(); it++) {
                     Result res = shaderInstanceGetUniformLocation(instance, (*it).first.c_str());
-                    if(res >= 0) {
+                    // Registers owned by a uniform block are shared by every shader and uploaded separately.
+                    if(res >= 0 && res < FLOAT_UNIFORM_COUNT && !(uniformBlockMask[type][res / 32] & (1 << (res % 32)))) {
                         int regOffset = type == SHADER_GEOMETRY ? -0x30 : 0x0;
 
                         GPUCMD_AddWrite(GPUREG_VSH_FLOATUNIFORM_CONFIG + regOffset, 0x80000000 | res);
                         GPUCMD_AddWrites(GPUREG_VSH_FLOATUNIFORM_DATA + regOffset, (u32*) (*it).second.data, (*it).second.elements * 4);
+                        frameStats.uniformVectors += (*it).second.elements;
                     }
                 }
             }
         }
     }
 
+    if(dirtyState & STATE_UNIFORM_BLOCKS) {
+        bool written = false;
+        for(std::vector<UniformBlockData*>::iterator it = uniformBlocks.begin(); it != uniformBlocks.end(); it++) {
+            UniformBlockData* block = *it;
+            if(block->dirtyFirst < block->dirtyEnd) {
+                written = true;
+                int regOffset = block->type == SHADER_GEOMETRY ? -0x30 : 0x0;
+
+                GPUCMD_AddWrite(GPUREG_VSH_FLOATUNIFORM_CONFIG + regOffset, 0x80000000 | (block->firstRegister + block->dirtyFirst));
+                GPUCMD_AddWrites(GPUREG_VSH_FLOATUNIFORM_DATA + regOffset, (u32*) &block->data[block->dirtyFirst * 4], (block->dirtyEnd - block->dirtyFirst) * 4);
+                frameStats.uniformVectors += block->dirtyEnd - block->dirtyFirst;
+
+                block->dirtyFirst = block->registers;
+                block->dirtyEnd = 0;
+            }
+        }
+
+        if(written) {
+            frameStats.stateGroups++;
+        }
+    }
+
     if((dirtyState & STATE_ACTIVE_SHADER_UNIFORM_BOOLS) && activeShader != NULL && activeShader->dvlb != NULL) {
+        frameStats.stateGroups++;
         for(ShaderType type = SHADER_VERTEX; type <= SHADER_GEOMETRY; type = (ShaderType) (type + 1)) {
             shaderInstance_s* instance = type == SHADER_VERTEX ? activeShader->program.vertexShader : activeShader->program.geometryShader;
             if(instance != NULL) {
@@ -431,30 +979,8 @@ void ctr::gpu::updateState()  {
         }
     }
 
-    if((dirtyState & STATE_TEX_ENV) && dirtyTexEnvs != 0) {
-        for(u8 env = 0; env < TEX_ENV_COUNT; env++) {
-            if(dirtyTexEnvs & (1 << env)) {
-                u32 param[0x5] = {0};
-
-                param[0x0] = (currTexEnv[env].alphaSources << 16) | (currTexEnv[env].rgbSources);
-                param[0x1] = (currTexEnv[env].alphaOperands << 12) | (currTexEnv[env].rgbOperands);
-                param[0x2] = (currTexEnv[env].alphaCombine << 16) | (currTexEnv[env].rgbCombine);
-                param[0x3] = currTexEnv[env].constantColor;
-                param[0x4] = 0x00000000;
-
-                int tevBase = GPUREG_TEXENV0_SOURCE + (env * 0x8);
-                if(env >= 4) {
-                    tevBase += 0x10;
-                }
-
-                GPUCMD_AddIncrementalWrites(tevBase, param, 0x00000005);
-            }
-        }
-
-        dirtyTexEnvs = 0;
-    }
-
     if((dirtyState & STATE_TEXTURES) && dirtyTextures != 0) {
+        frameStats.stateGroups++;
         for(u8 unit = 0; unit < TEX_UNIT_COUNT; unit++) {
             TexUnit texUnit = (TexUnit) (1 << unit);
             if(dirtyTextures & texUnit) {
@@ -494,6 +1020,7 @@ void ctr::gpu::updateState()  {
                     GPUCMD_AddWrite(dimReg, (textureData->width << 16) | textureData->height);
                     GPUCMD_AddWrite(paramReg, textureData->params);
                     GPUCMD_AddWrite(borderColorReg, textureData->borderColor);
+                    frameStats.textureBinds++;
 
                     enabledTextures |= texUnit;
                 } else {
@@ -511,10 +1038,14 @@ void ctr::gpu::updateState()  {
 }
 
 void ctr::gpu::safeWait(GSPGPU_Event event)  {
+    u64 start = svcGetSystemTick();
+
     Handle eventHandle = gspEvents[event];
     if(!svcWaitSynchronization(eventHandle, 40 * 1000 * 1000)) {
         svcClearEvent(eventHandle);
     }
+
+    frameWaitTicks[event] += svcGetSystemTick() - start;
 }
 
 void* ctr::gpu::galloc(u32 size)  {
@@ -525,49 +1056,358 @@ void ctr::gpu::gfree(void* mem)  {
     linearFree(mem);
 }
 
+void ctr::gpu::ensureCommandSpace(u32 words) {
+    u32* buffer = NULL;
+    u32 size = 0;
+    u32 offset = 0;
+    GPUCMD_GetBuffer(&buffer, &size, &offset);
+
+    // Leave room for the words flushCommands appends itself.
+    if(offset + words + 0x10 > size) {
+        frameCommandOverflows++;
+        submitCommands();
+    }
+}
+
 void ctr::gpu::flushCommands()  {
+    // Batched gput geometry has to reach the buffer first, and its memory can be reused once the GPU is done.
+    gput::flushBatches();
+    submitCommands();
+    gput::releaseBatches();
+}
+
+void ctr::gpu::submitCommands()  {
     GPUCMD_AddWrite(GPUREG_FRAMEBUFFER_FLUSH, 0x00000001);
     GPUCMD_AddWrite(GPUREG_FRAMEBUFFER_INVALIDATE, 0x00000001);
     GPUCMD_AddWrite(GPUREG_EARLYDEPTH_CLEAR, 0x00000001);
 
     GPUCMD_Finalize();
+    waitClear();
+
+    u32* buffer = NULL;
+    u32 size = 0;
+    u32 offset = 0;
+    GPUCMD_GetBuffer(&buffer, &size, &offset);
+    if(offset > frameCommandHighWater) {
+        frameCommandHighWater = offset;
+    }
+
+    frameStats.commandWords += offset;
+
+    if(traceFile != NULL) {
+        // Buffers are written as they are at submission, since the CPU may rewrite them in place between submits.
+        for(std::unordered_map<u32, TraceBufferData>::iterator it = traceBuffers.begin(); it != traceBuffers.end(); it++) {
+            u32 addr = (*it).first;
+            traceChunk(TRACE_CHUNK_BUFFER, &addr, sizeof(addr), (*it).second.data, (*it).second.size);
+            if(traceFile == NULL) {
+                break;
+            }
+        }
+
+        traceBuffers.clear();
+
+        if(traceFile != NULL) {
+            traceChunk(TRACE_CHUNK_COMMANDS, NULL, 0, buffer, offset * sizeof(u32));
+        }
+    }
+
+    // The CPU has nothing else to do until the GPU finishes, so the wait approximates GPU execution time.
+    u64 start = svcGetSystemTick();
     GPUCMD_FlushAndRun();
     safeWait(GSPGPU_EVENT_P3D);
+    frameGpuTicks += svcGetSystemTick() - start;
 
     GPUCMD_SetBufferOffset(0);
 }
 
 void ctr::gpu::flushBuffer()  {
+    flushBufferRange(0, viewportWidth);
+    gput::captureFrame(viewportScreen);
+}
+
+void ctr::gpu::flushBufferRange(u32 x, u32 width)  {
+    if(x >= viewportWidth || width == 0) {
+        return;
+    }
+
+    if(x + width > viewportWidth) {
+        width = viewportWidth - x;
+    }
+
+    // Transfers work on whole 8-row tile rows; buffer rows run opposite to screen x.
+    u32 firstRow = ((viewportWidth - (x + width)) / 8) * 8;
+    u32 lastRow = ((viewportWidth - x + 7) / 8) * 8;
+    if(lastRow > viewportWidth) {
+        lastRow = viewportWidth;
+    }
+
+    u32 rows = lastRow - firstRow;
+    if(rows == 0) {
+        return;
+    }
+
+    resolveScaledTarget();
+
     gfx3dSide_t side = allow3d && viewportScreen == SCREEN_TOP && screenSide == SIDE_RIGHT ? GFX_RIGHT : GFX_LEFT;
     PixelFormat screenFormat = fbFormatToGPU[gfxGetScreenFormat((gfxScreen_t) viewportScreen)];
+    u32 transferFlags = GX_TRANSFER_IN_FORMAT(gpuToTransferFormat[colorBufferFormat]) | GX_TRANSFER_OUT_FORMAT(gpuToTransferFormat[screenFormat]) | GX_TRANSFER_SCALING(activeAntiAliasModes[viewportScreen]);
+    u32 colorBytes = bitsPerPixel(colorBufferFormat) / 8;
+    u32 screenBytes = bitsPerPixel(screenFormat) / 8;
+    u32 scaleX = renderScaleX();
+    u32 renderHeight = viewportHeight * renderScaleY();
+    u32* src = (u32*) &((u8*) gpuFrameBuffer)[firstRow * scaleX * renderHeight * colorBytes];
 
     u16 fbWidth;
     u16 fbHeight;
-    u32* fb = (u32*) gfxGetFramebuffer((gfxScreen_t) viewportScreen, side, &fbWidth, &fbHeight);
+    u8* fb = gfxGetFramebuffer((gfxScreen_t) viewportScreen, side, &fbWidth, &fbHeight);
+
+    waitClear();
 
-    GX_DisplayTransfer(gpuFrameBuffer, (viewportWidth << 16) | viewportHeight, fb, (fbHeight << 16) | fbWidth, GX_TRANSFER_OUT_FORMAT(screenFormat));
+    GX_DisplayTransfer(src, ((rows * scaleX) << 16) | renderHeight, (u32*) &fb[firstRow * fbWidth * screenBytes], (rows << 16) | fbWidth, transferFlags);
+    frameStats.transferBytes += rows * scaleX * renderHeight * colorBytes;
     safeWait(GSPGPU_EVENT_PPF);
 
     if(viewportScreen == SCREEN_TOP && !allow3d) {
         u16 fbWidthRight;
         u16 fbHeightRight;
-        u32* fbRight = (u32*) gfxGetFramebuffer((gfxScreen_t) viewportScreen, GFX_RIGHT, &fbWidthRight, &fbHeightRight);
+        u8* fbRight = gfxGetFramebuffer((gfxScreen_t) viewportScreen, GFX_RIGHT, &fbWidthRight, &fbHeightRight);
 
-        GX_DisplayTransfer(gpuFrameBuffer, (viewportWidth << 16) | viewportHeight, fbRight, (fbHeightRight << 16) | fbWidthRight, GX_TRANSFER_OUT_FORMAT(screenFormat));
+        GX_DisplayTransfer(src, ((rows * scaleX) << 16) | renderHeight, (u32*) &fbRight[firstRow * fbWidthRight * screenBytes], (rows << 16) | fbWidthRight, transferFlags);
+        frameStats.transferBytes += rows * scaleX * renderHeight * colorBytes;
         safeWait(GSPGPU_EVENT_PPF);
     }
 }
 
+void ctr::gpu::traceChunk(u32 type, const void* header, u32 headerSize, const void* data, u32 dataSize) {
+    u32 chunk[2] = {type, headerSize + dataSize};
+    bool written = fwrite(chunk, sizeof(chunk), 1, traceFile) == 1;
+    if(written && headerSize > 0) {
+        written = fwrite(header, headerSize, 1, traceFile) == 1;
+    }
+
+    if(written && dataSize > 0) {
+        written = fwrite(data, dataSize, 1, traceFile) == 1;
+    }
+
+    if(!written) {
+        fclose(traceFile);
+        traceFile = NULL;
+        traceBuffers.clear();
+    }
+}
+
+void ctr::gpu::traceBuffer(const void* data, u32 size) {
+    if(data == NULL || size == 0) {
+        return;
+    }
+
+    // Referenced buffers are only recorded here and written out once per submission.
+    u32 addr = osConvertVirtToPhys(data);
+    std::unordered_map<u32, TraceBufferData>::iterator it = traceBuffers.find(addr);
+    if(it != traceBuffers.end() && (*it).second.size >= size) {
+        return;
+    }
+
+    TraceBufferData buffer;
+    buffer.data = data;
+    buffer.size = size;
+    traceBuffers[addr] = buffer;
+}
+
+void ctr::gpu::finishCommandTrace() {
+    if(traceFile == NULL) {
+        return;
+    }
+
+    traceChunk(TRACE_CHUNK_END, NULL, 0, NULL, 0);
+    if(traceFile != NULL) {
+        fclose(traceFile);
+        traceFile = NULL;
+    }
+
+    traceBuffers.clear();
+}
+
+void ctr::gpu::getFrameStats(FrameStats* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    *out = lastFrameStats;
+}
+
+bool ctr::gpu::startCommandTrace(const std::string path) {
+    if(traceFile != NULL) {
+        return false;
+    }
+
+    traceFile = fopen(path.c_str(), "wb");
+    if(traceFile == NULL) {
+        return false;
+    }
+
+    // Commands already queued this frame are part of the trace.
+    u32 header[2] = {TRACE_MAGIC, TRACE_VERSION};
+    if(fwrite(header, sizeof(header), 1, traceFile) != 1) {
+        fclose(traceFile);
+        traceFile = NULL;
+        return false;
+    }
+
+    return true;
+}
+
+bool ctr::gpu::tracingCommands() {
+    return traceFile != NULL;
+}
+
+void ctr::gpu::getCommandBufferUsage(u32* size, u32* highWater, u32* overflows) {
+    if(size != NULL) {
+        *size = gpuCommandBufferSize;
+    }
+
+    if(highWater != NULL) {
+        *highWater = commandHighWater;
+    }
+
+    if(overflows != NULL) {
+        *overflows = commandOverflows;
+    }
+}
+
 void ctr::gpu::swapBuffers(bool vblank)  {
+    gpuTime = (float) frameGpuTicks * 1000.0f / (float) SYSCLOCK_ARM11;
+    frameGpuTicks = 0;
+
+    // The vblank wait below is counted towards the next frame.
+    frameStats.renderWaitUs = (u32) (frameWaitTicks[GSPGPU_EVENT_P3D] * 1000000 / SYSCLOCK_ARM11);
+    frameStats.transferWaitUs = (u32) (frameWaitTicks[GSPGPU_EVENT_PPF] * 1000000 / SYSCLOCK_ARM11);
+    frameStats.fillWaitUs = (u32) ((frameWaitTicks[GSPGPU_EVENT_PSC0] + frameWaitTicks[GSPGPU_EVENT_PSC1]) * 1000000 / SYSCLOCK_ARM11);
+    frameStats.vblankWaitUs = (u32) ((frameWaitTicks[GSPGPU_EVENT_VBlank0] + frameWaitTicks[GSPGPU_EVENT_VBlank1]) * 1000000 / SYSCLOCK_ARM11);
+    lastFrameStats = frameStats;
+    std::memset(&frameStats, 0, sizeof(frameStats));
+    std::memset(frameWaitTicks, 0, sizeof(frameWaitTicks));
+
+    updateDynamicResolution();
+
+    finishCommandTrace();
+
+    commandHighWater = frameCommandHighWater;
+    commandOverflows = frameCommandOverflows;
+    frameCommandHighWater = 0;
+    frameCommandOverflows = 0;
+
     gfxSwapBuffersGpu();
     if(vblank) {
         safeWait(GSPGPU_EVENT_VBlank0);
     }
 }
 
-void ctr::gpu::clear()  {
-    GX_MemoryFill(gpuFrameBuffer, clearColor, &gpuFrameBuffer[viewportWidth * viewportHeight], GX_FILL_32BIT_DEPTH | GX_FILL_TRIGGER, gpuDepthBuffer, clearDepth, &gpuDepthBuffer[viewportWidth * viewportHeight], GX_FILL_32BIT_DEPTH | GX_FILL_TRIGGER);
-    safeWait(GSPGPU_EVENT_PSC0);
+void ctr::gpu::waitClear() {
+    if(clearPending) {
+        safeWait(GSPGPU_EVENT_PSC0);
+        clearPending = false;
+    }
+}
+
+void ctr::gpu::clear(u32 buffers, bool async)  {
+    clearRect(0, 0, viewportWidth, viewportHeight, buffers, async);
+}
+
+void ctr::gpu::clearRect(int x, int y, u32 width, u32 height, u32 buffers, bool async)  {
+    gput::flushBatches();
+
+    static const u16 fillWidths[] = {GX_FILL_16BIT_DEPTH, GX_FILL_16BIT_DEPTH, GX_FILL_24BIT_DEPTH, GX_FILL_32BIT_DEPTH};
+
+    waitClear();
+
+    // The render buffer is stored rotated: each tile row of 8 memory rows covers 8 screen columns, mirrored like the scissor registers.
+    int left = x < 0 ? 0 : x;
+    int bottom = y < 0 ? 0 : y;
+    int right = x + (int) width > (int) viewportWidth ? (int) viewportWidth : x + (int) width;
+    int top = y + (int) height > (int) viewportHeight ? (int) viewportHeight : y + (int) height;
+    if((buffers & CLEAR_ALL) == 0 || left >= right || bottom >= top) {
+        return;
+    }
+
+    u8* colorBuffer = (u8*) gpuFrameBuffer;
+    u8* depthBuffer = (u8*) gpuDepthBuffer;
+    u32 renderWidth = viewportWidth * renderScaleX();
+    u32 renderHeight = viewportHeight * renderScaleY();
+    u32 rowTiles = (renderHeight + 7) / 8;
+    if(renderScaled()) {
+        getTextureData(scaledTexture, (void**) &colorBuffer);
+        depthBuffer = (u8*) scaledDepthBuffer;
+        renderWidth = scaledWidth();
+        renderHeight = scaledHeight();
+        rowTiles = SCALED_TARGET_HEIGHT / 8;
+    }
+
+    u32 firstRow = (renderWidth - right * renderWidth / viewportWidth) / 8;
+    u32 lastRow = (renderWidth - left * renderWidth / viewportWidth + 7) / 8;
+    u32 firstTile = bottom * renderHeight / viewportHeight / 8;
+    u32 lastTile = (top * renderHeight / viewportHeight + 7) / 8;
+    if(lastRow > renderWidth / 8) {
+        lastRow = renderWidth / 8;
+    }
+
+    // Columns past the scaled viewport are never sampled, so full-height rects can clear them too and stay contiguous.
+    if(lastTile >= (renderHeight + 7) / 8) {
+        lastTile = rowTiles;
+    }
+
+    u32 colorBytes = bitsPerPixel(colorBufferFormat) / 8;
+    u32 depthBytes = depthFormatBytes[depthBufferFormat];
+
+    u32 color = clearColor;
+    u8 r = (u8) (clearColor >> 24);
+    u8 g = (u8) (clearColor >> 16);
+    u8 b = (u8) (clearColor >> 8);
+    u8 a = (u8) clearColor;
+    switch(colorBufferFormat) {
+        case PIXEL_RGB565:
+            color = ((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3);
+            break;
+        case PIXEL_RGBA5551:
+            color = ((r >> 3) << 11) | ((g >> 3) << 6) | ((b >> 3) << 1) | (a >> 7);
+            break;
+        case PIXEL_RGBA4:
+            color = ((r >> 4) << 12) | ((g >> 4) << 8) | ((b >> 4) << 4) | (a >> 4);
+            break;
+        default:
+            break;
+    }
+
+    // Rects spanning every tile of a row are contiguous in memory and can be filled in one pass.
+    u32 passes = lastRow - firstRow;
+    u32 tileRange = (lastTile - firstTile) * 64;
+    if(firstTile == 0 && lastTile == rowTiles) {
+        tileRange *= passes;
+        passes = 1;
+    }
+
+    for(u32 pass = 0; pass < passes; pass++) {
+        u32 start = (firstRow + pass) * rowTiles * 64 + firstTile * 64;
+
+        u32* colorStart = (u32*) &colorBuffer[start * colorBytes];
+        u32* colorEnd = (u32*) &colorBuffer[(start + tileRange) * colorBytes];
+        u32* depthStart = (u32*) &depthBuffer[start * depthBytes];
+        u32* depthEnd = (u32*) &depthBuffer[(start + tileRange) * depthBytes];
+
+        if((buffers & CLEAR_ALL) == CLEAR_ALL) {
+            GX_MemoryFill(colorStart, color, colorEnd, fillWidths[colorBytes - 1] | GX_FILL_TRIGGER, depthStart, clearDepth, depthEnd, fillWidths[depthBytes - 1] | GX_FILL_TRIGGER);
+        } else if(buffers & CLEAR_COLOR) {
+            GX_MemoryFill(colorStart, color, colorEnd, fillWidths[colorBytes - 1] | GX_FILL_TRIGGER, NULL, 0, NULL, 0);
+        } else {
+            GX_MemoryFill(depthStart, clearDepth, depthEnd, fillWidths[depthBytes - 1] | GX_FILL_TRIGGER, NULL, 0, NULL, 0);
+        }
+
+        if(pass + 1 < passes || !async) {
+            safeWait(GSPGPU_EVENT_PSC0);
+        }
+    }
+
+    clearPending = async;
 }
 
 void ctr::gpu::dumpScreen(ctr::gpu::Screen screen, ctr::gpu::ScreenSide side, void** pixels, PixelFormat* format, u32* width, u32* height) {
@@ -578,41 +1418,249 @@ void ctr::gpu::dumpScreen(ctr::gpu::Screen screen, ctr::gpu::ScreenSide side, vo
     u16 h = 0;
     u8* fb = gfxGetFramebuffer(gfxScreen, gfxSide, &h, &w);
 
-    if(format != NULL) {
-        *format = fmt;
+    if(format != NULL) {
+        *format = fmt;
+    }
+
+    if(width != NULL) {
+        *width = w;
+    }
+
+    if(height != NULL) {
+        *height = h;
+    }
+
+    if(pixels != NULL) {
+        u32 bpp = bitsPerPixel(fmt);
+        u8* px = new u8[w * h * bpp / 8];
+        for(u32 x = 0; x < w; x++) {
+            for(u32 y = 0; y < h; y++) {
+                u8* src = &fb[((h - 1 - y) + x * h) * bpp / 8];
+                u8* dst = &px[(y * w + x) * bpp / 8];
+
+                *(u16*) dst = *(u16*) src;
+                dst[2] = src[2];
+            }
+        }
+
+        *pixels = px;
+    }
+}
+
+void ctr::gpu::copyFrameBuffer(void* dst, PixelFormat format) {
+    waitClear();
+
+    if(dst == NULL || format > PIXEL_RGBA4) {
+        return;
+    }
+
+    u32 inputDim = ((viewportWidth * renderScaleX()) << 16) | (viewportHeight * renderScaleY());
+    frameStats.transferBytes += (inputDim >> 16) * (inputDim & 0xFFFF) * bitsPerPixel(colorBufferFormat) / 8;
+    GX_DisplayTransfer(gpuFrameBuffer, inputDim, (u32*) dst, (viewportWidth << 16) | viewportHeight, GX_TRANSFER_IN_FORMAT(gpuToTransferFormat[colorBufferFormat]) | GX_TRANSFER_OUT_FORMAT(gpuToTransferFormat[format]) | GX_TRANSFER_SCALING(activeAntiAliasModes[viewportScreen]));
+    safeWait(GSPGPU_EVENT_PPF);
+
+    GSPGPU_InvalidateDataCache((u8*) dst, viewportWidth * viewportHeight * bitsPerPixel(format) / 8);
+}
+
+void ctr::gpu::setClearColor(u8 red, u8 green, u8 blue, u8 alpha)  {
+    clearColor = (u32) (((red & 0xFF) << 24) | ((green & 0xFF) << 16) | ((blue & 0xFF) << 8) | (alpha & 0xFF));
+}
+
+void ctr::gpu::setClearDepth(u32 depth)  {
+    clearDepth = depth;
+}
+
+void ctr::gpu::setRenderTargetFormat(PixelFormat colorFormat, DepthFormat depthFormat) {
+    gput::flushBatches();
+
+    if(colorFormat == colorBufferFormat && depthFormat == depthBufferFormat) {
+        return;
+    }
+
+    if((colorFormat != PIXEL_RGBA8 && colorFormat != PIXEL_RGB565 && colorFormat != PIXEL_RGBA5551 && colorFormat != PIXEL_RGBA4) || (depthFormat != DEPTH_16 && depthFormat != DEPTH_24 && depthFormat != DEPTH_24_STENCIL_8)) {
+        return;
+    }
+
+    // Pending commands still reference the old buffers.
+    flushCommands();
+
+    if(!allocRenderTargets(colorFormat, depthFormat, renderTargetScale)) {
+        return;
+    }
+
+    if(scaledTexture != 0 && !allocScaledTarget(colorFormat, depthFormat)) {
+        activeResolutionScales[SCREEN_TOP] = 1.0f;
+        activeResolutionScales[SCREEN_BOTTOM] = 1.0f;
+    }
+
+    colorBufferFormat = colorFormat;
+    depthBufferFormat = depthFormat;
+
+    dirtyState |= STATE_VIEWPORT;
+}
+
+void ctr::gpu::getRenderTargetFormat(PixelFormat* colorFormat, DepthFormat* depthFormat) {
+    if(colorFormat != NULL) {
+        *colorFormat = colorBufferFormat;
+    }
+
+    if(depthFormat != NULL) {
+        *depthFormat = depthBufferFormat;
+    }
+}
+
+void ctr::gpu::setAntiAlias(Screen screen, AntiAliasMode mode) {
+    gput::flushBatches();
+
+    if(mode > ANTIALIAS_4X || antiAliasModes[screen] == mode) {
+        return;
+    }
+
+    AntiAliasMode other = antiAliasModes[screen == SCREEN_TOP ? SCREEN_BOTTOM : SCREEN_TOP];
+    AntiAliasMode highest = mode > other ? mode : other;
+    u32 scale = highest == ANTIALIAS_4X ? 4 : highest == ANTIALIAS_2X ? 2 : 1;
+    if(scale != renderTargetScale) {
+        // Pending commands still reference the old buffers.
+        flushCommands();
+
+        if(!allocRenderTargets(colorBufferFormat, depthBufferFormat, scale)) {
+            return;
+        }
+
+        renderTargetScale = scale;
+    }
+
+    antiAliasModes[screen] = mode;
+    activeAntiAliasModes[screen] = mode;
+
+    dirtyState |= STATE_VIEWPORT | STATE_SCISSOR_TEST;
+}
+
+void ctr::gpu::getAntiAlias(Screen screen, AntiAliasMode* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    *out = antiAliasModes[screen];
+}
+
+void ctr::gpu::getRenderTargetVram(u32* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    *out = TOP_WIDTH * TOP_HEIGHT * renderTargetScale * (bitsPerPixel(colorBufferFormat) / 8 + depthFormatBytes[depthBufferFormat]);
+}
+
+void ctr::gpu::updateDynamicResolution() {
+    if(!dynamicResolution) {
+        return;
+    }
+
+    // Separate thresholds and frame counts keep the resolution from oscillating around the target.
+    if(gpuTime > dynamicResolutionTarget) {
+        dynamicResolutionUnderFrames = 0;
+        if(++dynamicResolutionOverFrames < DYNAMIC_RES_DOWN_FRAMES) {
+            return;
+        }
+
+        // Supersampling is dropped first; only then does rendering go below native resolution.
+        dynamicResolutionOverFrames = 0;
+        for(u32 screen = 0; screen < 2; screen++) {
+            if(activeAntiAliasModes[screen] > ANTIALIAS_NONE) {
+                activeAntiAliasModes[screen] = (AntiAliasMode) (activeAntiAliasModes[screen] - 1);
+                dirtyState |= STATE_VIEWPORT | STATE_SCISSOR_TEST;
+            } else if(scaledTexture != 0 && activeResolutionScales[screen] > dynamicResolutionMinScale) {
+                float scale = activeResolutionScales[screen] - DYNAMIC_RES_SCALE_STEP;
+                activeResolutionScales[screen] = scale < dynamicResolutionMinScale ? dynamicResolutionMinScale : scale;
+                dirtyState |= STATE_VIEWPORT | STATE_SCISSOR_TEST;
+            }
+        }
+    } else if(gpuTime < dynamicResolutionTarget * DYNAMIC_RES_UP_HEADROOM) {
+        dynamicResolutionOverFrames = 0;
+        if(++dynamicResolutionUnderFrames < DYNAMIC_RES_UP_FRAMES) {
+            return;
+        }
+
+        dynamicResolutionUnderFrames = 0;
+        for(u32 screen = 0; screen < 2; screen++) {
+            if(activeResolutionScales[screen] < 1.0f) {
+                float scale = activeResolutionScales[screen] + DYNAMIC_RES_SCALE_STEP;
+                activeResolutionScales[screen] = scale > 1.0f ? 1.0f : scale;
+                dirtyState |= STATE_VIEWPORT | STATE_SCISSOR_TEST;
+            } else if(activeAntiAliasModes[screen] < antiAliasModes[screen]) {
+                activeAntiAliasModes[screen] = (AntiAliasMode) (activeAntiAliasModes[screen] + 1);
+                dirtyState |= STATE_VIEWPORT | STATE_SCISSOR_TEST;
+            }
+        }
+    } else {
+        dynamicResolutionOverFrames = 0;
+        dynamicResolutionUnderFrames = 0;
     }
+}
 
-    if(width != NULL) {
-        *width = w;
+void ctr::gpu::setDynamicResolution(bool enabled, float targetGpuTime, float minScale) {
+    gput::flushBatches();
+
+    if(minScale > 1.0f) {
+        minScale = 1.0f;
     }
 
-    if(height != NULL) {
-        *height = h;
+    // Render buffers can't be smaller than one tile across.
+    if(minScale < 8.0f / TOP_HEIGHT) {
+        minScale = 8.0f / TOP_HEIGHT;
     }
 
-    if(pixels != NULL) {
-        u32 bpp = bitsPerPixel(fmt);
-        u8* px = new u8[w * h * bpp / 8];
-        for(u32 x = 0; x < w; x++) {
-            for(u32 y = 0; y < h; y++) {
-                u8* src = &fb[((h - 1 - y) + x * h) * bpp / 8];
-                u8* dst = &px[(y * w + x) * bpp / 8];
+    dynamicResolution = enabled;
+    dynamicResolutionTarget = targetGpuTime;
+    dynamicResolutionMinScale = minScale;
+    dynamicResolutionOverFrames = 0;
+    dynamicResolutionUnderFrames = 0;
 
-                *(u16*) dst = *(u16*) src;
-                dst[2] = src[2];
-            }
+    // Pending commands may still render into the scaled target.
+    flushCommands();
+
+    for(u32 screen = 0; screen < 2; screen++) {
+        if(!enabled) {
+            activeAntiAliasModes[screen] = antiAliasModes[screen];
         }
 
-        *pixels = px;
+        activeResolutionScales[screen] = 1.0f;
     }
+
+    if(enabled && minScale < 1.0f) {
+        if(scaledTexture == 0 && !allocScaledTarget(colorBufferFormat, depthBufferFormat)) {
+            dynamicResolutionMinScale = 1.0f;
+        }
+    } else {
+        freeScaledTarget();
+    }
+
+    dirtyState |= STATE_VIEWPORT | STATE_SCISSOR_TEST;
 }
 
-void ctr::gpu::setClearColor(u8 red, u8 green, u8 blue, u8 alpha)  {
-    clearColor = (u32) (((red & 0xFF) << 24) | ((green & 0xFF) << 16) | ((blue & 0xFF) << 8) | (alpha & 0xFF));
+void ctr::gpu::getActiveAntiAlias(Screen screen, AntiAliasMode* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    *out = activeAntiAliasModes[screen];
 }
 
-void ctr::gpu::setClearDepth(u32 depth)  {
-    clearDepth = depth;
+void ctr::gpu::getActiveResolutionScale(Screen screen, float* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    *out = activeResolutionScales[screen];
+}
+
+void ctr::gpu::getGpuTime(float* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    *out = gpuTime;
 }
 
 void ctr::gpu::setAllow3d(bool allow)  {
@@ -620,6 +1668,8 @@ void ctr::gpu::setAllow3d(bool allow)  {
 }
 
 void ctr::gpu::setScreenSide(ScreenSide side)  {
+    gput::flushBatches();
+
     screenSide = side;
 }
 
@@ -640,6 +1690,8 @@ void ctr::gpu::getViewportHeight(u32* out)  {
 }
 
 void ctr::gpu::setViewport(Screen screen, u32 x, u32 y, u32 width, u32 height)  {
+    gput::flushBatches();
+
     viewportScreen = screen;
     viewportX = x;
     viewportY = y;
@@ -650,6 +1702,8 @@ void ctr::gpu::setViewport(Screen screen, u32 x, u32 y, u32 width, u32 height)
 }
 
 void ctr::gpu::setScissorTest(ScissorMode mode, int x, int y, u32 width, u32 height)  {
+    gput::flushBatches();
+
     scissorMode = mode;
     scissorX = x;
     scissorY = y;
@@ -660,6 +1714,8 @@ void ctr::gpu::setScissorTest(ScissorMode mode, int x, int y, u32 width, u32 hei
 }
 
 void ctr::gpu::setDepthMap(float zScale, float zOffset)  {
+    gput::flushBatches();
+
     depthMapZScale = zScale;
     depthMapZOffset = zOffset;
 
@@ -667,77 +1723,196 @@ void ctr::gpu::setDepthMap(float zScale, float zOffset)  {
 }
 
 void ctr::gpu::setCullMode(CullMode mode)  {
-    cullMode = mode;
+    gput::flushBatches();
+
+    currState.cullMode = mode;
 
     dirtyState |= STATE_CULL;
+    boundPipelineState = NULL;
 }
 
 void ctr::gpu::setStencilTest(bool enable, TestFunc func, u8 ref, u8 inputMask, u8 writeMask)  {
-    stencilEnable = enable;
-    stencilFunc = func;
-    stencilRef = ref;
-    stencilInputMask = inputMask;
-    stencilWriteMask = writeMask;
+    gput::flushBatches();
+
+    currState.stencilEnable = enable;
+    currState.stencilFunc = func;
+    currState.stencilRef = ref;
+    currState.stencilInputMask = inputMask;
+    currState.stencilWriteMask = writeMask;
 
     dirtyState |= STATE_STENCIL_TEST;
+    boundPipelineState = NULL;
 }
 
 void ctr::gpu::setStencilOp(StencilOp fail, StencilOp zfail, StencilOp zpass)  {
-    stencilFail = fail;
-    stencilZFail = zfail;
-    stencilZPass = zpass;
+    gput::flushBatches();
+
+    currState.stencilFail = fail;
+    currState.stencilZFail = zfail;
+    currState.stencilZPass = zpass;
 
     dirtyState |= STATE_STENCIL_TEST;
+    boundPipelineState = NULL;
 }
 
 void ctr::gpu::setBlendColor(u8 red, u8 green, u8 blue, u8 alpha)  {
-    blendRed = red;
-    blendGreen = green;
-    blendBlue = blue;
-    blendAlpha = alpha;
+    gput::flushBatches();
+
+    currState.blendRed = red;
+    currState.blendGreen = green;
+    currState.blendBlue = blue;
+    currState.blendAlpha = alpha;
 
     dirtyState |= STATE_BLEND;
+    boundPipelineState = NULL;
 }
 
 void ctr::gpu::setBlendFunc(BlendEquation colorEquation, BlendEquation alphaEquation, BlendFactor colorSrc, BlendFactor colorDst, BlendFactor alphaSrc, BlendFactor alphaDst)  {
-    blendColorEquation = colorEquation;
-    blendAlphaEquation = alphaEquation;
-    blendColorSrc = colorSrc;
-    blendColorDst = colorDst;
-    blendAlphaSrc = alphaSrc;
-    blendAlphaDst = alphaDst;
+    gput::flushBatches();
+
+    currState.blendColorEquation = colorEquation;
+    currState.blendAlphaEquation = alphaEquation;
+    currState.blendColorSrc = colorSrc;
+    currState.blendColorDst = colorDst;
+    currState.blendAlphaSrc = alphaSrc;
+    currState.blendAlphaDst = alphaDst;
 
     dirtyState |= STATE_BLEND;
+    boundPipelineState = NULL;
 }
 
 void ctr::gpu::setAlphaTest(bool enable, TestFunc func, u8 ref)  {
-    alphaEnable = enable;
-    alphaFunc = func;
-    alphaRef = ref;
+    gput::flushBatches();
+
+    currState.alphaEnable = enable;
+    currState.alphaFunc = func;
+    currState.alphaRef = ref;
 
     dirtyState |= STATE_ALPHA_TEST;
+    boundPipelineState = NULL;
 }
 
 void ctr::gpu::setDepthTest(bool enable, TestFunc func)  {
-    depthEnable = enable;
-    depthFunc = func;
+    gput::flushBatches();
+
+    currState.depthEnable = enable;
+    currState.depthFunc = func;
 
     dirtyState |= STATE_DEPTH_TEST_AND_MASK;
+    boundPipelineState = NULL;
 }
 
 void ctr::gpu::setColorMask(bool red, bool green, bool blue, bool alpha)  {
-    colorMaskRed = red;
-    colorMaskGreen = green;
-    colorMaskBlue = blue;
-    colorMaskAlpha = alpha;
+    gput::flushBatches();
+
+    currState.colorMaskRed = red;
+    currState.colorMaskGreen = green;
+    currState.colorMaskBlue = blue;
+    currState.colorMaskAlpha = alpha;
 
     dirtyState |= STATE_DEPTH_TEST_AND_MASK;
+    boundPipelineState = NULL;
 }
 
 void ctr::gpu::setDepthMask(bool depth)  {
-    depthMask = depth;
+    gput::flushBatches();
+
+    currState.depthMask = depth;
 
     dirtyState |= STATE_DEPTH_TEST_AND_MASK;
+    boundPipelineState = NULL;
+}
+
+void ctr::gpu::getPipelineState(PipelineState* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    *out = currState;
+}
+
+void ctr::gpu::setPipelineState(const PipelineState* state) {
+    gput::flushBatches();
+
+    if(state == NULL) {
+        return;
+    }
+
+    currState = *state;
+
+    dirtyState |= STATE_CULL | STATE_STENCIL_TEST | STATE_BLEND | STATE_ALPHA_TEST | STATE_DEPTH_TEST_AND_MASK | STATE_TEX_ENV;
+    dirtyTexEnvs = (1 << TEX_ENV_COUNT) - 1;
+    boundPipelineState = NULL;
+}
+
+void ctr::gpu::createPipelineState(u32* pipelineState, const PipelineState* desc) {
+    if(pipelineState == NULL) {
+        return;
+    }
+
+    PipelineStateData* data = new PipelineStateData();
+    data->state = desc != NULL ? *desc : currState;
+
+    // Record the register writes once through the regular command path, then keep them for binding.
+    u32* prevBuffer = NULL;
+    u32 prevSize = 0;
+    u32 prevOffset = 0;
+    GPUCMD_GetBuffer(&prevBuffer, &prevSize, &prevOffset);
+
+    u32 commands[PIPELINE_STATE_MAX_WORDS];
+    GPUCMD_SetBuffer(commands, PIPELINE_STATE_MAX_WORDS, 0);
+    writePipelineState(data->state, STATE_CULL | STATE_STENCIL_TEST | STATE_BLEND | STATE_ALPHA_TEST | STATE_DEPTH_TEST_AND_MASK | STATE_TEX_ENV, (1 << TEX_ENV_COUNT) - 1);
+
+    u32* recordBuffer = NULL;
+    u32 recordSize = 0;
+    u32 size = 0;
+    GPUCMD_GetBuffer(&recordBuffer, &recordSize, &size);
+    GPUCMD_SetBuffer(prevBuffer, prevSize, prevOffset);
+
+    data->commands = new u32[size];
+    data->size = size;
+    std::memcpy(data->commands, commands, size * sizeof(u32));
+
+    *pipelineState = (u32) data;
+}
+
+void ctr::gpu::freePipelineState(u32 pipelineState) {
+    PipelineStateData* data = (PipelineStateData*) pipelineState;
+    if(data == NULL) {
+        return;
+    }
+
+    if(boundPipelineState == data) {
+        boundPipelineState = NULL;
+    }
+
+    delete[] data->commands;
+    delete data;
+}
+
+void ctr::gpu::bindPipelineState(u32 pipelineState) {
+    gput::flushBatches();
+
+    PipelineStateData* data = (PipelineStateData*) pipelineState;
+    if(data == NULL || data == boundPipelineState) {
+        return;
+    }
+
+    ensureCommandSpace(data->size);
+
+    u32* buffer = NULL;
+    u32 size = 0;
+    u32 offset = 0;
+    GPUCMD_GetBuffer(&buffer, &size, &offset);
+
+    std::memcpy(&buffer[offset], data->commands, data->size * sizeof(u32));
+    GPUCMD_SetBufferOffset(offset + data->size);
+
+    currState = data->state;
+    dirtyState &= ~(STATE_CULL | STATE_STENCIL_TEST | STATE_BLEND | STATE_ALPHA_TEST | STATE_DEPTH_TEST_AND_MASK | STATE_TEX_ENV);
+    dirtyTexEnvs = 0;
+
+    boundPipelineState = data;
 }
 
 void ctr::gpu::createShader(u32* shader)  {
@@ -796,7 +1971,17 @@ void ctr::gpu::loadShader(u32 shader, const void* data, u32 size, u8 geometryStr
     }
 }
 
+void ctr::gpu::getShader(u32* out)  {
+    if(out == NULL) {
+        return;
+    }
+
+    *out = (u32) activeShader;
+}
+
 void ctr::gpu::useShader(u32 shader)  {
+    gput::flushBatches();
+
     ShaderData* shdr = (ShaderData*) shader;
     if(shdr == NULL || shdr->dvlb == NULL) {
         return;
@@ -828,6 +2013,8 @@ void ctr::gpu::getUniform(u32 shader, ShaderType type, const std::string name, f
 }
 
 void ctr::gpu::setUniform(u32 shader, ShaderType type, const std::string name, const float* data, u32 elements)  {
+    gput::flushBatches();
+
     if(data == NULL || elements == 0) {
         return;
     }
@@ -837,7 +2024,14 @@ void ctr::gpu::setUniform(u32 shader, ShaderType type, const std::string name, c
         return;
     }
 
-    float* fixedData = new float[elements * 4];
+    // Reuse the existing storage when a uniform is updated in place.
+    Uniform* existing = NULL;
+    std::unordered_map<std::string, Uniform>::iterator it = shdr->uniforms[type].find(name);
+    if(it != shdr->uniforms[type].end()) {
+        existing = &(*it).second;
+    }
+
+    float* fixedData = existing != NULL && existing->elements == elements ? existing->data : new float[elements * 4];
     for(u32 i = 0; i < elements; i++) {
         fixedData[i * 4 + 0] = data[i * 4 + 3];
         fixedData[i * 4 + 1] = data[i * 4 + 2];
@@ -845,6 +2039,10 @@ void ctr::gpu::setUniform(u32 shader, ShaderType type, const std::string name, c
         fixedData[i * 4 + 3] = data[i * 4 + 0];
     }
 
+    if(existing != NULL && existing->data != fixedData) {
+        delete[] existing->data;
+    }
+
     Uniform uniform;
     uniform.data = fixedData;
     uniform.elements = elements;
@@ -869,6 +2067,8 @@ void ctr::gpu::getUniformBool(u32 shader, ShaderType type, int id, bool* value)
 }
 
 void ctr::gpu::setUniformBool(u32 shader, ShaderType type, int id, bool value)  {
+    gput::flushBatches();
+
     ShaderData* shdr = (ShaderData*) shader;
     if(shdr == NULL || shdr->dvlb == NULL) {
         return;
@@ -881,6 +2081,85 @@ void ctr::gpu::setUniformBool(u32 shader, ShaderType type, int id, bool value)
     }
 }
 
+void ctr::gpu::createUniformBlock(u32* block, ShaderType type, u32 firstRegister, u32 registers) {
+    if(block == NULL) {
+        return;
+    }
+
+    if(registers == 0 || firstRegister + registers > FLOAT_UNIFORM_COUNT) {
+        *block = 0;
+        return;
+    }
+
+    UniformBlockData* blockData = new UniformBlockData();
+    blockData->type = type;
+    blockData->firstRegister = firstRegister;
+    blockData->registers = registers;
+    blockData->data = new float[registers * 4]();
+    blockData->dirtyFirst = 0;
+    blockData->dirtyEnd = registers;
+
+    for(u32 reg = firstRegister; reg < firstRegister + registers; reg++) {
+        uniformBlockMask[type][reg / 32] |= 1 << (reg % 32);
+    }
+
+    uniformBlocks.push_back(blockData);
+
+    dirtyState |= STATE_UNIFORM_BLOCKS;
+    *block = (u32) blockData;
+}
+
+void ctr::gpu::freeUniformBlock(u32 block) {
+    UniformBlockData* blockData = (UniformBlockData*) block;
+    if(blockData == NULL) {
+        return;
+    }
+
+    for(u32 reg = blockData->firstRegister; reg < blockData->firstRegister + blockData->registers; reg++) {
+        uniformBlockMask[blockData->type][reg / 32] &= ~(1 << (reg % 32));
+    }
+
+    for(std::vector<UniformBlockData*>::iterator it = uniformBlocks.begin(); it != uniformBlocks.end(); it++) {
+        if(*it == blockData) {
+            uniformBlocks.erase(it);
+            break;
+        }
+    }
+
+    delete[] blockData->data;
+    delete blockData;
+
+    // Registers the block owned go back to the active shader's own uniforms.
+    dirtyState |= STATE_ACTIVE_SHADER_UNIFORMS;
+}
+
+void ctr::gpu::setUniformBlock(u32 block, const float* data, u32 offset, u32 elements) {
+    gput::flushBatches();
+
+    UniformBlockData* blockData = (UniformBlockData*) block;
+    if(blockData == NULL || data == NULL || elements == 0 || offset + elements > blockData->registers) {
+        return;
+    }
+
+    for(u32 i = 0; i < elements; i++) {
+        float* reg = &blockData->data[(offset + i) * 4];
+        reg[0] = data[i * 4 + 3];
+        reg[1] = data[i * 4 + 2];
+        reg[2] = data[i * 4 + 1];
+        reg[3] = data[i * 4 + 0];
+    }
+
+    if(offset < blockData->dirtyFirst) {
+        blockData->dirtyFirst = offset;
+    }
+
+    if(offset + elements > blockData->dirtyEnd) {
+        blockData->dirtyEnd = offset + elements;
+    }
+
+    dirtyState |= STATE_UNIFORM_BLOCKS;
+}
+
 void ctr::gpu::createVbo(u32* vbo)  {
     if(vbo == NULL) {
         return;
@@ -959,7 +2238,57 @@ void ctr::gpu::setVboData(u32 vbo, const void *data, u32 numVertices, Primitive
     u32 size = numVertices * vboData->bytesPerVertex;
     if(size > 0) {
         std::memcpy(vboData->data, data, size);
+        GSPGPU_FlushDataCache((u8*) vboData->data, size);
+    }
+}
+
+void ctr::gpu::setVboSubData(u32 vbo, u32 offset, const void* data, u32 size)  {
+    VboData* vboData = (VboData*) vbo;
+    if(vboData == NULL || vboData->data == NULL || data == NULL || offset >= vboData->size) {
+        return;
+    }
+
+    if(offset + size > vboData->size) {
+        size = vboData->size - offset;
+    }
+
+    u8* dst = &((u8*) vboData->data)[offset];
+    std::memcpy(dst, data, size);
+    GSPGPU_FlushDataCache(dst, size);
+}
+
+void ctr::gpu::mapVbo(u32 vbo, u32 offset, u32 size, void** out)  {
+    if(out == NULL) {
+        return;
+    }
+
+    VboData* vboData = (VboData*) vbo;
+    if(vboData == NULL || vboData->data == NULL || offset >= vboData->size) {
+        *out = NULL;
+        return;
+    }
+
+    if(offset + size > vboData->size) {
+        size = vboData->size - offset;
+    }
+
+    vboData->mapOffset = offset;
+    vboData->mapSize = size;
+
+    *out = &((u8*) vboData->data)[offset];
+}
+
+void ctr::gpu::unmapVbo(u32 vbo)  {
+    VboData* vboData = (VboData*) vbo;
+    if(vboData == NULL || vboData->data == NULL || vboData->mapSize == 0) {
+        return;
     }
+
+    // Only the mapped range can have been written, so only it needs to reach memory.
+    GSPGPU_FlushDataCache(&((u8*) vboData->data)[vboData->mapOffset], vboData->mapSize);
+
+    vboData->mapOffset = 0;
+    vboData->mapSize = 0;
 }
 
 void ctr::gpu::getVboIndices(u32 vbo, void** out)  {
@@ -1019,6 +2348,40 @@ void ctr::gpu::setVboIndices(u32 vbo, const void *data, u32 size)  {
     }
 
     std::memcpy(vboData->indices, data, size);
+    GSPGPU_FlushDataCache((u8*) vboData->indices, size);
+}
+
+void ctr::gpu::mapVboIndices(u32 vbo, u32 offset, u32 size, void** out)  {
+    if(out == NULL) {
+        return;
+    }
+
+    VboData* vboData = (VboData*) vbo;
+    if(vboData == NULL || vboData->indices == NULL || offset >= vboData->indicesSize) {
+        *out = NULL;
+        return;
+    }
+
+    if(offset + size > vboData->indicesSize) {
+        size = vboData->indicesSize - offset;
+    }
+
+    vboData->indicesMapOffset = offset;
+    vboData->indicesMapSize = size;
+
+    *out = &((u8*) vboData->indices)[offset];
+}
+
+void ctr::gpu::unmapVboIndices(u32 vbo)  {
+    VboData* vboData = (VboData*) vbo;
+    if(vboData == NULL || vboData->indices == NULL || vboData->indicesMapSize == 0) {
+        return;
+    }
+
+    GSPGPU_FlushDataCache(&((u8*) vboData->indices)[vboData->indicesMapOffset], vboData->indicesMapSize);
+
+    vboData->indicesMapOffset = 0;
+    vboData->indicesMapSize = 0;
 }
 
 void ctr::gpu::setVboAttributes(u32 vbo, u64 attributes, u8 attributeCount)  {
@@ -1044,18 +2407,61 @@ void ctr::gpu::setVboAttributes(u32 vbo, u64 attributes, u8 attributeCount)  {
 
 void ctr::gpu::drawVbo(u32 vbo)  {
     VboData* vboData = (VboData*) vbo;
-    if(vboData == NULL || vboData->data == NULL) {
+    if(vboData == NULL) {
+        return;
+    }
+
+    drawVboRange(vbo, 0, vboData->numVertices);
+}
+
+void ctr::gpu::drawVboRange(u32 vbo, u32 first, u32 count)  {
+    VboData* vboData = (VboData*) vbo;
+    if(vboData == NULL || vboData->data == NULL || count == 0) {
         return;
     }
 
+    // Queued gput batches were issued before this draw, so they have to reach the command buffer first.
+    gput::flushBatches();
+    gput::updateMatrices();
+
+    ensureCommandSpace(COMMAND_RESERVE_WORDS);
     updateState();
 
+    frameStats.draws++;
+    frameStats.vertices += count;
+    if(vboData->indices != NULL) {
+        frameStats.indexedDraws++;
+    } else {
+        frameStats.arrayDraws++;
+    }
+
+    if(traceFile != NULL) {
+        traceBuffer(vboData->data, vboData->size);
+        traceBuffer(vboData->indices, vboData->indicesSize);
+        for(u8 unit = 0; unit < TEX_UNIT_COUNT; unit++) {
+            if((enabledTextures & (1 << unit)) && activeTextures[unit] != NULL) {
+                traceBuffer(activeTextures[unit]->data, activeTextures[unit]->size);
+            }
+        }
+    }
+
+    // The index buffer is addressed as an offset from the attribute base, so the base must not lie past it.
+    u32 dataAddr = osConvertVirtToPhys(vboData->data);
+    u32 baseAddr = dataAddr;
+    u32 indexAddr = 0;
+    if(vboData->indices != NULL) {
+        indexAddr = osConvertVirtToPhys(vboData->indices) + first * sizeof(u16);
+        if(indexAddr < baseAddr) {
+            baseAddr = indexAddr & ~7;
+        }
+    }
+
     u32 param[0x28] = {0};
 
-    param[0x0] = osConvertVirtToPhys(vboData->data) >> 3;
+    param[0x0] = baseAddr >> 3;
     param[0x1] = (u32) (vboData->attributes & 0xFFFFFFFF);
     param[0x2] = ((vboData->attributeCount - 1) << 28) | ((vboData->attributeMask & 0xFFF) << 16) | (u32) ((vboData->attributes >> 32) & 0xFFFF);
-    param[0x3] = 0;
+    param[0x3] = dataAddr - baseAddr;
     param[0x4] = (u32) (vboData->attributePermutations & 0xFFFFFFFF);
     param[0x5] = (vboData->attributeCount << 28) | ((vboData->bytesPerVertex & 0xFFF) << 16) | (u32) ((vboData->attributePermutations >> 32) & 0xFFFF);
 
@@ -1071,13 +2477,13 @@ void ctr::gpu::drawVbo(u32 vbo)  {
     GPUCMD_AddMaskedWrite(GPUREG_RESTART_PRIMITIVE, 0x2, 0x00000001);
 
     if(vboData->indices != NULL) {
-        GPUCMD_AddWrite(GPUREG_INDEXBUFFER_CONFIG, 0x80000000 | ((u32) vboData->indices));
+        GPUCMD_AddWrite(GPUREG_INDEXBUFFER_CONFIG, 0x80000000 | (indexAddr - baseAddr));
     } else {
         GPUCMD_AddWrite(GPUREG_INDEXBUFFER_CONFIG, 0x80000000);
     }
 
-    GPUCMD_AddWrite(GPUREG_NUMVERTICES, vboData->numVertices);
-    GPUCMD_AddWrite(GPUREG_VERTEX_OFFSET, 0);
+    GPUCMD_AddWrite(GPUREG_NUMVERTICES, count);
+    GPUCMD_AddWrite(GPUREG_VERTEX_OFFSET, vboData->indices != NULL ? 0 : first);
 
     if(vboData->indices != NULL) {
         GPUCMD_AddMaskedWrite(GPUREG_GEOSTAGE_CONFIG, 0x2, 0x00000100);
@@ -1098,20 +2504,23 @@ void ctr::gpu::drawVbo(u32 vbo)  {
 }
 
 void ctr::gpu::setTexEnv(u32 env, u16 rgbSources, u16 alphaSources, u16 rgbOperands, u16 alphaOperands, CombineFunc rgbCombine, CombineFunc alphaCombine, u32 constantColor)  {
+    gput::flushBatches();
+
     if(env >= TEX_ENV_COUNT) {
         return;
     }
 
-    currTexEnv[env].rgbSources = rgbSources;
-    currTexEnv[env].alphaSources = alphaSources;
-    currTexEnv[env].rgbOperands = rgbOperands;
-    currTexEnv[env].alphaOperands = alphaOperands;
-    currTexEnv[env].rgbCombine = rgbCombine;
-    currTexEnv[env].alphaCombine = alphaCombine;
-    currTexEnv[env].constantColor = constantColor;
+    currState.texEnv[env].rgbSources = rgbSources;
+    currState.texEnv[env].alphaSources = alphaSources;
+    currState.texEnv[env].rgbOperands = rgbOperands;
+    currState.texEnv[env].alphaOperands = alphaOperands;
+    currState.texEnv[env].rgbCombine = rgbCombine;
+    currState.texEnv[env].alphaCombine = alphaCombine;
+    currState.texEnv[env].constantColor = constantColor;
 
     dirtyState |= STATE_TEX_ENV;
     dirtyTexEnvs |= (1 << env);
+    boundPipelineState = NULL;
 }
 
 void ctr::gpu::createTexture(u32* texture)  {
@@ -1131,8 +2540,8 @@ void ctr::gpu::freeTexture(u32 texture)  {
     if(textureData->data != NULL) {
         if(textureData->place == TEXTURE_PLACE_RAM) {
             linearFree(textureData->data);
-        } else if(textureData->place == TEXTURE_PLACE_VRAM) {
-            vramFree(textureData->data);
+        } else {
+            vfree(textureData->data);
         }
     }
 
@@ -1164,15 +2573,15 @@ void ctr::gpu::setTextureInfo(u32 texture, u32 width, u32 height, PixelFormat fo
         if(textureData->data != NULL) {
             if(textureData->place == TEXTURE_PLACE_RAM) {
                 linearFree(textureData->data);
-            } else if(textureData->place == TEXTURE_PLACE_VRAM) {
-                vramFree(textureData->data);
+            } else {
+                vfree(textureData->data);
             }
         }
 
         if(place == TEXTURE_PLACE_RAM) {
             textureData->data = linearMemAlign(size, 0x80);
         } else {
-            textureData->data = vramMemAlign(size, 0x80);
+            textureData->data = valloc(size, place == TEXTURE_PLACE_VRAM_A ? VRAM_BANK_A : place == TEXTURE_PLACE_VRAM_B ? VRAM_BANK_B : VRAM_BANK_ANY);
         }
 
         if(textureData->data == NULL) {
@@ -1211,9 +2620,72 @@ void ctr::gpu::setTextureData(u32 texture, const void *data, u32 width, u32 heig
 
     GSPGPU_FlushDataCache((u8*) data, (u32) (width * height * bitsPerPixel(format) / 8));
     GX_DisplayTransfer((u32*) data, (height << 16) | width, (u32*) textureData->data, (height << 16) | width, (u32) (GX_TRANSFER_OUT_TILED(true) | GX_TRANSFER_IN_FORMAT(format) | GX_TRANSFER_OUT_FORMAT(format)));
+    frameStats.transferBytes += width * height * bitsPerPixel(format) / 8;
     safeWait(GSPGPU_EVENT_PPF);
 }
 
+void ctr::gpu::setTextureSubData(u32 texture, u32 x, u32 y, u32 width, u32 height, const void* data)  {
+    TextureData* textureData = (TextureData*) texture;
+    if(textureData == NULL || textureData->data == NULL || data == NULL || width == 0 || height == 0) {
+        return;
+    }
+
+    if(x + width > textureData->width || y + height > textureData->height) {
+        return;
+    }
+
+    // Compressed formats are stored in 4x4 blocks that can't be patched per pixel.
+    if(textureData->format >= PIXEL_ETC1) {
+        return;
+    }
+
+    u32 bpp = bitsPerPixel(textureData->format);
+    u32 bytes = bpp / 8;
+    u8* dst = (u8*) textureData->data;
+
+    // Full-width bands of whole tile rows are contiguous in the texture and can be tiled by the transfer engine,
+    // provided the source can be reached by DMA.
+    u32 addr = (u32) data;
+    bool linear = (addr >= LINEAR_OLD_START && addr < LINEAR_OLD_END) || (addr >= LINEAR_START && addr < LINEAR_END);
+    if(linear && textureData->format <= PIXEL_RGBA4 && x == 0 && width == textureData->width && (y & 7) == 0 && (height & 7) == 0) {
+        u32 transferFormat = gpuToTransferFormat[textureData->format];
+
+        GSPGPU_FlushDataCache((u8*) data, width * height * bytes);
+        GX_DisplayTransfer((u32*) data, (height << 16) | width, (u32*) &dst[y * width * bytes], (height << 16) | width, (u32) (GX_TRANSFER_OUT_TILED(true) | GX_TRANSFER_IN_FORMAT(transferFormat) | GX_TRANSFER_OUT_FORMAT(transferFormat)));
+        frameStats.transferBytes += width * height * bytes;
+        safeWait(GSPGPU_EVENT_PPF);
+        return;
+    }
+
+    const u8* src = (const u8*) data;
+    u32 tilesX = textureData->width / 8;
+    if(bpp == 4) {
+        // 4-bit texels are packed two to a byte, first texel in the low nibble, on both sides.
+        for(u32 row = 0; row < height; row++) {
+            for(u32 col = 0; col < width; col++) {
+                u32 index = textureIndex(x + col, y + row, textureData->width, textureData->height);
+                u32 srcIndex = row * width + col;
+                u8 texel = (u8) ((src[srcIndex / 2] >> ((srcIndex & 1) * 4)) & 0xF);
+                u8 shift = (u8) ((index & 1) * 4);
+                dst[index / 2] = (u8) ((dst[index / 2] & ~(0xF << shift)) | (texel << shift));
+            }
+        }
+    } else {
+        for(u32 row = 0; row < height; row++) {
+            for(u32 col = 0; col < width; col++) {
+                u32 index = textureIndex(x + col, y + row, textureData->width, textureData->height);
+                std::memcpy(&dst[index * bytes], &src[(row * width + col) * bytes], bytes);
+            }
+        }
+    }
+
+    if(textureData->place == TEXTURE_PLACE_RAM) {
+        u32 start = (y / 8) * tilesX * 64 * bpp / 8;
+        u32 end = ((y + height + 7) / 8) * tilesX * 64 * bpp / 8;
+        GSPGPU_FlushDataCache(&dst[start], end - start);
+    }
+}
+
 void ctr::gpu::setTextureBorderColor(u32 texture, u8 red, u8 green, u8 blue, u8 alpha)  {
     TextureData* textureData = (TextureData*) texture;
     if(textureData == NULL) {
@@ -1234,7 +2706,17 @@ void ctr::gpu::setTextureBorderColor(u32 texture, u8 red, u8 green, u8 blue, u8
     }
 }
 
+void ctr::gpu::getBoundTexture(TexUnit unit, u32* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    *out = (u32) activeTextures[unit >> 1];
+}
+
 void ctr::gpu::bindTexture(TexUnit unit, u32 texture)  {
+    gput::flushBatches();
+
     u32 unitIndex = unit >> 1;
     if(activeTextures[unitIndex] != (TextureData*) texture) {
         activeTextures[unitIndex] = (TextureData*) texture;
@@ -1,4 +1,5 @@
 #include "citrus/gput.hpp"
+#include "citrus/core.hpp"
 #include "citrus/gpu.hpp"
 #include "internal.hpp"
 
@@ -7,47 +8,149 @@
 #include <cstring>
 #include <ctime>
 #include <sstream>
-#include <stack>
+#include <vector>
 
-#include "citrus_default_font_bin.h"
+#include <3ds.h>
+
+#include "citrus_batch_shader_shbin.h"
 #include "citrus_default_shader_shbin.h"
 
+#define CAMERA_BLOCK_REGISTER 0
+#define CAMERA_BLOCK_PROJECTION 0
+#define CAMERA_BLOCK_MODELVIEW 4
+
+#define MATRIX_STACK_DEPTH 32
+
+#define NODE_NONE 0xFFFFFFFF
+
+#define CAPTURE_MAGIC 0x50414343 // "CCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_SLOT_COUNT 4
+#define CAPTURE_KEYFRAME_INTERVAL 60
+#define CAPTURE_MAX_PIXELS (gpu::TOP_WIDTH * gpu::TOP_HEIGHT)
+
 using namespace ctr;
 
 namespace ctr {
     namespace gput {
         static u32 defaultShader = 0;
+        static u32 batchShader = 0;
+        static u32 scaledFrameVbo = 0;
 
-        static u32 stringVbo = 0;
-
-        static u32 fontTexture = 0;
-        static u32 fontWidth = 0;
-        static u32 fontHeight = 0;
-        static u32 fontCharWidth = 0;
-        static u32 fontCharHeight = 0;
+        // Only one batch is open at a time, so queued draws reach the command buffer in call order.
+        static u32 openBatch = 0;
+        static bool flushingBatches = false;
+        static std::vector<u32> retiredVbos;
+        static u32 cameraBlock = 0;
 
         static float projection[16] = {0};
         static float modelview[16] = {0};
-
-        static std::stack<float*> projectionStack;
-        static std::stack<float*> modelviewStack;
+        static bool projectionDirty = false;
+        static bool modelviewDirty = false;
+
+        static float projectionStack[MATRIX_STACK_DEPTH][16];
+        static float modelviewStack[MATRIX_STACK_DEPTH][16];
+        static u32 projectionDepth = 0;
+        static u32 modelviewDepth = 0;
+
+        typedef struct {
+            u32 vbo;
+            u32 shader;
+            u32 texture;
+            u32 pipelineState;
+            float modelview[16];
+        } QueuedDraw;
+
+        typedef struct {
+            u64 key;
+            u32 index;
+        } QueueEntry;
+
+        static std::vector<QueuedDraw> queueDraws;
+        static std::vector<QueueEntry> queueEntries;
+        static std::vector<QueueEntry> queueScratch;
+
+        typedef struct {
+            u16* pixels;
+            u32 width;
+            u32 height;
+            u32 time;
+            volatile bool filled;
+        } CaptureSlot;
+
+        static volatile bool captureRunning = false;
+        static gpu::Screen captureScreen = gpu::SCREEN_TOP;
+        static FILE* captureFile = NULL;
+        static Thread captureThread = NULL;
+        static Handle captureEvent = 0;
+        static LightLock captureLock;
+        static CaptureSlot captureSlots[CAPTURE_SLOT_COUNT];
+        static u32 captureWriteSlot = 0;
+        static u32 captureReadSlot = 0;
+        static u64 captureStartTime = 0;
+        static CaptureStats captureStats = {};
+
+        typedef struct {
+            bool enabled;
+            int left;
+            int right;
+            int prevLeft;
+            int prevRight;
+        } DamageState;
+
+        static DamageState damage[2] = {};
+        static gpu::Screen damageScreen = gpu::SCREEN_TOP;
+        static u32 damageX = 0;
+        static u32 damageWidth = 0;
+
+        // Transform nodes are stored as parallel arrays ordered parent-before-child. Handles are stable ids
+        // that map to the node's current position.
+        static std::vector<u32> nodeIds;
+        static std::vector<u32> nodeParents;
+        static std::vector<float> nodeLocals;
+        static std::vector<float> nodeWorlds;
+        static std::vector<u8> nodeDirty;
+        static std::vector<u32> nodeStamps;
+        static std::vector<u32> nodePositions;
+        static std::vector<u32> freeNodeIds;
+        static u32 nodeStamp = 0;
+
+        void captureThreadFunc(void* arg);
+        void freeCapture();
     }
 }
 
 bool ctr::gput::init() {
+    // Projection and modelview live in fixed registers shared by every vertex shader declaring them first.
+    gpu::createUniformBlock(&cameraBlock, gpu::SHADER_VERTEX, CAMERA_BLOCK_REGISTER, 8);
+
     gpu::createShader(&defaultShader);
     gpu::loadShader(defaultShader, citrus_default_shader_shbin, citrus_default_shader_shbin_size);
     useDefaultShader();
 
-    gpu::createVbo(&stringVbo);
-    gpu::setVboAttributes(stringVbo, gpu::vboAttribute(0, 3, gpu::ATTR_FLOAT) | gpu::vboAttribute(1, 2, gpu::ATTR_FLOAT) | gpu::vboAttribute(2, 4, gpu::ATTR_FLOAT), 3);
-
-    gpu::createTexture(&fontTexture);
-
-    void* gpuFont = gpu::galloc(citrus_default_font_bin_size);
-    std::memcpy(gpuFont, citrus_default_font_bin, citrus_default_font_bin_size);
-    setFont(gpuFont, 128, 128, 8, 8, gpu::PIXEL_RGBA8);
-    gpu::gfree(gpuFont);
+    gpu::createShader(&batchShader);
+    gpu::loadShader(batchShader, citrus_batch_shader_shbin, citrus_batch_shader_shbin_size);
+
+    // A clip-space quad in the batch shader's vertex layout: position, texel coordinates, color.
+    static const struct {
+        float x;
+        float y;
+        float u;
+        float v;
+        u8 color[4];
+    } scaledFrameVertices[] = {
+            {-1, -1, 0, 0, {0xFF, 0xFF, 0xFF, 0xFF}},
+            {1, -1, 1, 0, {0xFF, 0xFF, 0xFF, 0xFF}},
+            {-1, 1, 0, 1, {0xFF, 0xFF, 0xFF, 0xFF}},
+            {1, 1, 1, 1, {0xFF, 0xFF, 0xFF, 0xFF}}
+    };
+
+    gpu::createVbo(&scaledFrameVbo);
+    gpu::setVboAttributes(scaledFrameVbo, gpu::vboAttribute(0, 2, gpu::ATTR_FLOAT) | gpu::vboAttribute(1, 2, gpu::ATTR_FLOAT) | gpu::vboAttribute(2, 4, gpu::ATTR_UNSIGNED_BYTE), 3);
+    gpu::setVboData(scaledFrameVbo, scaledFrameVertices, 4, gpu::PRIM_TRIANGLE_STRIP);
+
+    initFonts();
+    initSprites();
 
     float identity[16];
     setIdentityMatrix(identity);
@@ -58,204 +161,133 @@ bool ctr::gput::init() {
 }
 
 void ctr::gput::exit() {
+    stopCapture();
+
     if(defaultShader != 0) {
         gpu::freeShader(defaultShader);
         defaultShader = 0;
     }
 
-    if(stringVbo != 0) {
-        gpu::freeVbo(stringVbo);
-        stringVbo = 0;
+    if(batchShader != 0) {
+        gpu::freeShader(batchShader);
+        batchShader = 0;
     }
 
-    if(fontTexture != 0) {
-        gpu::freeTexture(fontTexture);
-        fontTexture = 0;
+    if(scaledFrameVbo != 0) {
+        gpu::freeVbo(scaledFrameVbo);
+        scaledFrameVbo = 0;
     }
-}
 
-void ctr::gput::useDefaultShader() {
-    gpu::useShader(defaultShader);
-}
+    exitSprites();
+    exitFonts();
 
-void ctr::gput::multMatrix(float* out, const float* m1, const float* m2) {
-    if(out == NULL || m1 == NULL || m2 == NULL) {
-        return;
+    for(std::vector<u32>::iterator it = retiredVbos.begin(); it != retiredVbos.end(); it++) {
+        gpu::freeVbo(*it);
     }
 
-    for(u32 x1 = 0; x1 < 4; x1++) {
-        for(u32 y2 = 0; y2 < 4; y2++) {
-            out[y2 * 4 + x1] = 0;
-            for(u32 y1 = 0; y1 < 4; y1++) {
-                out[y2 * 4 + x1] += m1[y1 * 4 + x1] * m2[y2 * 4 + y1];
-            }
-        }
-    }
-}
+    retiredVbos.clear();
 
-void ctr::gput::setIdentityMatrix(float* out) {
-    if(out == NULL) {
-        return;
+    if(cameraBlock != 0) {
+        gpu::freeUniformBlock(cameraBlock);
+        cameraBlock = 0;
     }
-
-    memset(out, 0x00, 16 * sizeof(float));
-    out[0] = 1.0f;
-    out[5] = 1.0f;
-    out[10] = 1.0f;
-    out[15] = 1.0f;
 }
 
-void ctr::gput::setOrthoMatrix(float* out, float left, float right, float bottom, float top, float near, float far) {
-    float orthoMatrix[16];
-
-    orthoMatrix[0] = 2.0f / (right - left);
-    orthoMatrix[1] = 0.0f;
-    orthoMatrix[2] = 0.0f;
-    orthoMatrix[3] = -((right + left) / (right - left));
-
-    orthoMatrix[4] = 0.0f;
-    orthoMatrix[5] = 2.0f / (top - bottom);
-    orthoMatrix[6] = 0.0f;
-    orthoMatrix[7] = -((top + bottom) / (top - bottom));
-
-    orthoMatrix[8] = 0.0f;
-    orthoMatrix[9] = 0.0f;
-    orthoMatrix[10] = 2.0f / (far - near);
-    orthoMatrix[11] = -((far + near) / (far - near));
-
-    orthoMatrix[12] = 0.0f;
-    orthoMatrix[13] = 0.0f;
-    orthoMatrix[14] = 0.0f;
-    orthoMatrix[15] = 1.0f;
-
-    float correction[16];
-    setRotationMatrixZ(correction, (float) M_PI / 2.0f);
-
-    multMatrix(out, orthoMatrix, correction);
+void ctr::gput::useDefaultShader() {
+    gpu::useShader(defaultShader);
 }
 
-void ctr::gput::setPerspectiveMatrix(float* out, float fovy, float aspect, float near, float far) {
-    float top = near * std::tan(fovy / 2);
-    float right = top * aspect;
-
-    float projectionMatrix[16];
+void ctr::gput::useBatchShader(float texScaleX, float texScaleY, float texOffsetX, float texOffsetY) {
+    float texScale[4] = {texScaleX, texScaleY, 0, 1};
+    float texOffset[4] = {texOffsetX, texOffsetY, 0, 0};
+    gpu::setUniform(batchShader, gpu::SHADER_VERTEX, "texscale", texScale, 1);
+    gpu::setUniform(batchShader, gpu::SHADER_VERTEX, "texoffset", texOffset, 1);
+    gpu::useShader(batchShader);
+}
 
-    projectionMatrix[0] = near / right;
-    projectionMatrix[1] = 0.0f;
-    projectionMatrix[2] = 0.0f;
-    projectionMatrix[3] = 0.0f;
+void ctr::gput::drawScaledFrame(u32 texture, float u, float v) {
+    if(scaledFrameVbo == 0) {
+        return;
+    }
 
-    projectionMatrix[4] = 0.0f;
-    projectionMatrix[5] = near / top;
-    projectionMatrix[6] = 0.0f;
-    projectionMatrix[7] = 0.0f;
+    u32 oldShader = 0;
+    u32 oldTexture = 0;
+    gpu::getShader(&oldShader);
+    gpu::getBoundTexture(gpu::TEXUNIT0, &oldTexture);
 
-    projectionMatrix[8] = 0.0f;
-    projectionMatrix[9] = 0.0f;
-    projectionMatrix[10] = -(far + near) / (far - near);
-    projectionMatrix[11] = -2.0f * (far * near) / (far - near);
+    float oldProjection[16];
+    float oldModelView[16];
+    std::memcpy(oldProjection, getProjection(), 16 * sizeof(float));
+    std::memcpy(oldModelView, getModelView(), 16 * sizeof(float));
 
-    projectionMatrix[12] = 0.0f;
-    projectionMatrix[13] = 0.0f;
-    projectionMatrix[14] = -1.0f;
-    projectionMatrix[15] = 0.0f;
+    float identity[16];
+    setIdentityMatrix(identity);
+    setProjection(identity);
+    setModelView(identity);
 
-    float correction[16];
-    setIdentityMatrix(correction);
-    correction[10] = 0.5f;
-    correction[11] = -0.5f;
+    // The quad's unit texel coordinates are scaled down to the rendered corner of the texture.
+    useBatchShader(u, v);
+    gpu::bindTexture(gpu::TEXUNIT0, texture);
+    gpu::drawVbo(scaledFrameVbo);
 
-    multMatrix(out, correction, projectionMatrix);
+    setProjection(oldProjection);
+    setModelView(oldModelView);
+    gpu::bindTexture(gpu::TEXUNIT0, oldTexture);
+    gpu::useShader(oldShader);
 }
 
-void ctr::gput::setTranslationMatrix(float* out, float x, float y, float z) {
-    if(out == NULL) {
-        return;
+void ctr::gput::beginBatch(u32 owner) {
+    if(openBatch != owner) {
+        flushBatches();
+        openBatch = owner;
     }
-
-    setIdentityMatrix(out);
-    out[3] = x;
-    out[7] = y;
-    out[11] = z;
 }
 
-void ctr::gput::setRotationMatrixX(float* out, float rotation) {
-    if(out == NULL) {
+void ctr::gput::flushBatches() {
+    // Batch draws go through the same hooked gpu calls, which must not re-enter.
+    if(openBatch == 0 || flushingBatches) {
         return;
     }
 
-    memset(out, 0x00, 16 * sizeof(float));
+    flushingBatches = true;
+    flushSpriteBatch();
+    flushTextBatches();
+    flushingBatches = false;
 
-    out[0] = 1.0f;
-    out[5] = std::cos(rotation);
-    out[6] = std::sin(rotation);
-    out[9] = -std::sin(rotation);
-    out[10] = std::cos(rotation);
-    out[15] = 1.0f;
+    openBatch = 0;
 }
 
-void ctr::gput::setRotationMatrixY(float* out, float rotation) {
-    if(out == NULL) {
-        return;
-    }
-
-    memset(out, 0x00, 16 * sizeof(float));
+void ctr::gput::releaseBatches() {
+    releaseSprites();
+    releaseTextBatches();
+    releaseTilemaps();
 
-    out[0] = std::cos(rotation);
-    out[2] = std::sin(rotation);
-    out[5] = 1.0f;
-    out[8] = -std::sin(rotation);
-    out[10] = std::cos(rotation);
-    out[15] = 1.0f;
-}
-
-void ctr::gput::setRotationMatrixZ(float* out, float rotation) {
-    if(out == NULL) {
-        return;
+    for(std::vector<u32>::iterator it = retiredVbos.begin(); it != retiredVbos.end(); it++) {
+        gpu::freeVbo(*it);
     }
 
-    memset(out, 0x00, 16 * sizeof(float));
-
-    out[0] = std::cos(rotation);
-    out[1] = std::sin(rotation);
-    out[4] = -std::sin(rotation);
-    out[5] = std::cos(rotation);
-    out[10] = 1.0f;
-    out[15] = 1.0f;
+    retiredVbos.clear();
 }
 
-void ctr::gput::setScaleMatrix(float* matrix, float x, float y, float z) {
-    matrix[0] *= x;
-    matrix[4] *= x;
-    matrix[8] *= x;
-    matrix[12] *= x;
-
-    matrix[1] *= y;
-    matrix[5] *= y;
-    matrix[9] *= y;
-    matrix[13] *= y;
-
-    matrix[2] *= z;
-    matrix[6] *= z;
-    matrix[10] *= z;
-    matrix[14] *= z;
+void ctr::gput::retireVbo(u32 vbo) {
+    // Submitted or queued draws may still read the buffer, so it is only freed once the GPU is idle.
+    retiredVbos.push_back(vbo);
 }
 
 void ctr::gput::pushProjection() {
-    float* old = new float[16];
-    std::memcpy(old, projection, 16 * sizeof(float));
-    projectionStack.push(old);
+    if(projectionDepth >= MATRIX_STACK_DEPTH) {
+        return;
+    }
+
+    std::memcpy(projectionStack[projectionDepth++], projection, 16 * sizeof(float));
 }
 
 void ctr::gput::popProjection() {
-    if(projectionStack.empty()) {
+    if(projectionDepth == 0) {
         return;
     }
 
-    float* old = projectionStack.top();
-    projectionStack.pop();
-    setProjection(old);
-    delete old;
+    setProjection(projectionStack[--projectionDepth]);
 }
 
 float* ctr::gput::getProjection() {
@@ -268,7 +300,7 @@ void ctr::gput::setProjection(float* matrix) {
     }
 
     std::memcpy(projection, matrix, 16 * sizeof(float));
-    gpu::setUniform(defaultShader, gpu::SHADER_VERTEX, "projection", projection, 4);
+    projectionDirty = true;
 }
 
 void ctr::gput::setOrtho(float left, float right, float bottom, float top, float near, float far) {
@@ -284,20 +316,19 @@ void ctr::gput::setPerspective(float fovy, float aspect, float near, float far)
 }
 
 void ctr::gput::pushModelView() {
-    float* old = new float[16];
-    memcpy(old, modelview, 16 * sizeof(float));
-    modelviewStack.push(old);
+    if(modelviewDepth >= MATRIX_STACK_DEPTH) {
+        return;
+    }
+
+    std::memcpy(modelviewStack[modelviewDepth++], modelview, 16 * sizeof(float));
 }
 
 void ctr::gput::popModelView() {
-    if(modelviewStack.empty()) {
+    if(modelviewDepth == 0) {
         return;
     }
 
-    float* old = modelviewStack.top();
-    modelviewStack.pop();
-    setModelView(old);
-    delete old;
+    setModelView(modelviewStack[--modelviewDepth]);
 }
 
 float* ctr::gput::getModelView() {
@@ -309,8 +340,36 @@ void ctr::gput::setModelView(float* matrix) {
         return;
     }
 
-    memcpy(modelview, matrix, 16 * sizeof(float));
-    gpu::setUniform(defaultShader, gpu::SHADER_VERTEX, "modelview", modelview, 4);
+    std::memcpy(modelview, matrix, 16 * sizeof(float));
+    modelviewDirty = true;
+}
+
+void ctr::gput::getFrustum(Frustum* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    // Vertices are transformed by projection * modelview.
+    float clip[16];
+    multMatrix(clip, modelview, projection);
+    extractFrustum(out, clip);
+}
+
+void ctr::gput::updateMatrices() {
+    // Transform calls only touch the CPU copies; the camera block is updated once per draw.
+    if(cameraBlock == 0) {
+        return;
+    }
+
+    if(projectionDirty) {
+        gpu::setUniformBlock(cameraBlock, projection, CAMERA_BLOCK_PROJECTION, 4);
+        projectionDirty = false;
+    }
+
+    if(modelviewDirty) {
+        gpu::setUniformBlock(cameraBlock, modelview, CAMERA_BLOCK_MODELVIEW, 4);
+        modelviewDirty = false;
+    }
 }
 
 void ctr::gput::translate(float x, float y, float z) {
@@ -350,133 +409,371 @@ void ctr::gput::rotateZ(float rotation) {
 }
 
 void ctr::gput::rotate(float x, float y, float z) {
-    float tempMatrix[16];
-    float tempMatrix2[16];
-    float tempMatrix3[16];
-
-    setRotationMatrixX(tempMatrix, x);
-    setRotationMatrixY(tempMatrix2, y);
-    multMatrix(tempMatrix3, tempMatrix, tempMatrix2);
-
-    setRotationMatrixZ(tempMatrix2, z);
-    multMatrix(tempMatrix, tempMatrix3, tempMatrix2);
+    float rotationMatrix[16];
+    setRotationMatrix(rotationMatrix, x, y, z);
 
-    multMatrix(tempMatrix2, modelview, tempMatrix);
-    setModelView(tempMatrix2);
+    float resultMatrix[16];
+    multMatrix(resultMatrix, modelview, rotationMatrix);
+    setModelView(resultMatrix);
 }
 
 void ctr::gput::scale(float x, float y, float z) {
     setScaleMatrix(modelview, x, y, z);
-    setModelView(modelview);
+    modelviewDirty = true;
 }
 
-void ctr::gput::setFont(void* image, u32 width, u32 height, u32 charWidth, u32 charHeight, gpu::PixelFormat format) {
-    gpu::setTextureData(fontTexture, image, width, height, format, gpu::textureMinFilter(gpu::FILTER_NEAREST) | gpu::textureMagFilter(gpu::FILTER_NEAREST));
-    fontWidth = width;
-    fontHeight = height;
-    fontCharWidth = charWidth;
-    fontCharHeight = charHeight;
-}
+void ctr::gput::createNode(u32* node, u32 parent) {
+    if(node == NULL) {
+        return;
+    }
 
-float ctr::gput::getStringWidth(const std::string str, float charWidth) {
-    u32 len = str.length();
-    if(len == 0) {
-        return 0;
+    u32 parentPosition = NODE_NONE;
+    if(parent != 0) {
+        if(parent > nodePositions.size() || nodePositions[parent - 1] == NODE_NONE) {
+            *node = 0;
+            return;
+        }
+
+        parentPosition = nodePositions[parent - 1];
     }
 
-    u32 longestLine = 0;
-    u32 currLength = 0;
-    for(u32 i = 0; i < len; i++) {
-        if(str[i] == '\n') {
-            if(currLength > longestLine) {
-                longestLine = currLength;
-            }
+    u32 id;
+    if(!freeNodeIds.empty()) {
+        id = freeNodeIds.back();
+        freeNodeIds.pop_back();
+    } else {
+        nodePositions.push_back(NODE_NONE);
+        id = nodePositions.size() - 1;
+    }
 
-            currLength = 0;
+    // Parents always exist before their children, so appending keeps the order valid.
+    nodePositions[id] = nodeIds.size();
+    nodeIds.push_back(id);
+    nodeParents.push_back(parentPosition);
+
+    static const float identityLocal[9] = {0, 0, 0, 0, 0, 0, 1, 1, 1};
+    nodeLocals.insert(nodeLocals.end(), identityLocal, identityLocal + 9);
+    nodeWorlds.resize(nodeWorlds.size() + 16);
+    nodeDirty.push_back(1);
+    nodeStamps.push_back(0);
+
+    *node = id + 1;
+}
+
+void ctr::gput::freeNode(u32 node) {
+    if(node == 0 || node > nodePositions.size() || nodePositions[node - 1] == NODE_NONE) {
+        return;
+    }
+
+    // Remove the node and its whole subtree; descendants always come after their ancestors.
+    u32 count = nodeIds.size();
+    u32 target = nodePositions[node - 1];
+    std::vector<u32> remap(count, NODE_NONE);
+    u32 kept = 0;
+    for(u32 pos = 0; pos < count; pos++) {
+        u32 parent = nodeParents[pos];
+        bool removed = pos == target || (parent != NODE_NONE && remap[parent] == NODE_NONE && parent >= target);
+        if(removed) {
+            nodePositions[nodeIds[pos]] = NODE_NONE;
+            freeNodeIds.push_back(nodeIds[pos]);
             continue;
         }
 
-        currLength++;
-    }
+        remap[pos] = kept;
+        if(kept != pos) {
+            nodeIds[kept] = nodeIds[pos];
+            nodeDirty[kept] = nodeDirty[pos];
+            nodeStamps[kept] = nodeStamps[pos];
+            std::memcpy(&nodeLocals[kept * 9], &nodeLocals[pos * 9], 9 * sizeof(float));
+            std::memcpy(&nodeWorlds[kept * 16], &nodeWorlds[pos * 16], 16 * sizeof(float));
+        }
 
-    if(currLength > longestLine) {
-        longestLine = currLength;
+        nodeParents[kept] = parent != NODE_NONE ? remap[parent] : NODE_NONE;
+        nodePositions[nodeIds[kept]] = kept;
+        kept++;
     }
 
-    return (int) (longestLine * charWidth);
+    nodeIds.resize(kept);
+    nodeParents.resize(kept);
+    nodeLocals.resize(kept * 9);
+    nodeWorlds.resize(kept * 16);
+    nodeDirty.resize(kept);
+    nodeStamps.resize(kept);
 }
 
-float ctr::gput::getStringHeight(const std::string str, float charHeight) {
-    u32 len = str.length();
-    if(len == 0) {
-        return 0;
+void ctr::gput::setNodeTransform(u32 node, float tx, float ty, float tz, float rx, float ry, float rz, float sx, float sy, float sz) {
+    if(node == 0 || node > nodePositions.size() || nodePositions[node - 1] == NODE_NONE) {
+        return;
     }
 
-    u32 lines = 1;
-    for(u32 i = 0; i < len; i++) {
-        if(str[i] == '\n') {
-            lines++;
+    u32 pos = nodePositions[node - 1];
+    float* local = &nodeLocals[pos * 9];
+    local[0] = tx;
+    local[1] = ty;
+    local[2] = tz;
+    local[3] = rx;
+    local[4] = ry;
+    local[5] = rz;
+    local[6] = sx;
+    local[7] = sy;
+    local[8] = sz;
+
+    nodeDirty[pos] = 1;
+}
+
+void ctr::gput::updateNodes() {
+    // A node is recomputed when it changed or its parent was recomputed during this pass.
+    nodeStamp++;
+
+    u32 count = nodeIds.size();
+    for(u32 pos = 0; pos < count; pos++) {
+        u32 parent = nodeParents[pos];
+        if(!nodeDirty[pos] && (parent == NODE_NONE || nodeStamps[parent] != nodeStamp)) {
+            continue;
+        }
+
+        const float* local = &nodeLocals[pos * 9];
+        float* world = &nodeWorlds[pos * 16];
+        if(parent == NODE_NONE) {
+            setLocalTransformMatrix(world, local[0], local[1], local[2], local[3], local[4], local[5], local[6], local[7], local[8]);
+        } else {
+            // multMatrix(out, a, b) yields b * a, so this is parentWorld * local.
+            float localMatrix[16];
+            setLocalTransformMatrix(localMatrix, local[0], local[1], local[2], local[3], local[4], local[5], local[6], local[7], local[8]);
+            multMatrix(world, localMatrix, &nodeWorlds[parent * 16]);
         }
+
+        nodeDirty[pos] = 0;
+        nodeStamps[pos] = nodeStamp;
+    }
+}
+
+void ctr::gput::getNodeMatrix(u32 node, float* out) {
+    if(out == NULL || node == 0 || node > nodePositions.size() || nodePositions[node - 1] == NODE_NONE) {
+        return;
     }
 
-    return (int) (lines * charHeight);
+    std::memcpy(out, &nodeWorlds[nodePositions[node - 1] * 16], 16 * sizeof(float));
 }
 
-void ctr::gput::drawString(const std::string str, float x, float y, float charWidth, float charHeight, u8 red, u8 green, u8 blue, u8 alpha) {
-    const u32 len = str.length();
-    if(len == 0) {
+void ctr::gput::useNode(u32 node) {
+    if(node == 0 || node > nodePositions.size() || nodePositions[node - 1] == NODE_NONE) {
         return;
     }
 
-    static const float texCharWidth = (float) fontCharWidth / (float) fontWidth;
-    static const float texCharHeight = (float) fontCharHeight / (float) fontHeight;
-    static u32 charsX = fontWidth / fontCharWidth;
-    static u32 charsY = fontHeight / fontCharHeight;
+    setModelView(&nodeWorlds[nodePositions[node - 1] * 16]);
+}
+
+u64 ctr::gput::sortKey(u8 layer, bool translucent, float depth, u32 shader, u32 texture) {
+    if(depth < 0) {
+        depth = 0;
+    } else if(depth > 1) {
+        depth = 1;
+    }
+
+    // Handles are pointers; fold them down to 12 bits. Collisions only cost grouping, not correctness.
+    u64 shaderBits = ((shader >> 4) ^ (shader >> 16)) & 0xFFF;
+    u64 textureBits = ((texture >> 4) ^ (texture >> 16)) & 0xFFF;
+    u64 depthBits = (u64) (depth * 0xFFFFFF) & 0xFFFFFF;
+
+    u64 key = ((u64) layer << 56) | ((u64) translucent << 55);
+    if(translucent) {
+        // Blended draws must go back to front, so depth wins over state and is inverted.
+        key |= ((0xFFFFFF - depthBits) << 31) | (shaderBits << 19) | (textureBits << 7);
+    } else {
+        key |= (shaderBits << 43) | (textureBits << 31) | (depthBits << 7);
+    }
+
+    return key;
+}
+
+void ctr::gput::queueDraw(u64 key, u32 vbo, u32 shader, u32 texture, u32 pipelineState) {
+    QueuedDraw draw;
+    draw.vbo = vbo;
+    draw.shader = shader;
+    draw.texture = texture;
+    draw.pipelineState = pipelineState;
+    std::memcpy(draw.modelview, modelview, 16 * sizeof(float));
+
+    QueueEntry entry;
+    entry.key = key;
+    entry.index = queueDraws.size();
 
-    const float r = (float) red / 255.0f;
-    const float g = (float) green / 255.0f;
-    const float b = (float) blue / 255.0f;
-    const float a = (float) alpha / 255.0f;
+    queueDraws.push_back(draw);
+    queueEntries.push_back(entry);
+}
 
-    float* tempVboData;
-    gpu::setVboDataInfo(stringVbo, len * 6, gpu::PRIM_TRIANGLES);
-    gpu::getVboData(stringVbo, (void**) &tempVboData);
+void ctr::gput::flushQueue() {
+    u32 count = queueEntries.size();
+    if(count == 0) {
+        return;
+    }
 
-    float cx = x;
-    float cy = y + getStringHeight(str, charHeight) - charHeight;
-    for(u32 i = 0; i < len; i++) {
-        char c = str[i];
-        if(c == '\n') {
-            std::memset(tempVboData + (i * 6 * 9), 0, 6 * 9 * sizeof(float));
+    // LSD radix sort on 8-bit digits, skipping digits every key shares.
+    queueScratch.resize(count);
+    QueueEntry* src = &queueEntries[0];
+    QueueEntry* dst = &queueScratch[0];
+    for(u32 shift = 0; shift < 64; shift += 8) {
+        u32 histogram[256] = {0};
+        for(u32 i = 0; i < count; i++) {
+            histogram[(src[i].key >> shift) & 0xFF]++;
+        }
 
-            cx = x;
-            cy -= charHeight;
+        if(histogram[(src[0].key >> shift) & 0xFF] == count) {
             continue;
         }
 
-        const float texX1 = (c % charsX) * texCharWidth;
-        const float texY1 = 1.0f - ((c / charsY + 1) * texCharHeight);
-        const float texX2 = texX1 + texCharWidth;
-        const float texY2 = texY1 + texCharHeight;
+        u32 offset = 0;
+        for(u32 digit = 0; digit < 256; digit++) {
+            u32 digitCount = histogram[digit];
+            histogram[digit] = offset;
+            offset += digitCount;
+        }
+
+        for(u32 i = 0; i < count; i++) {
+            dst[histogram[(src[i].key >> shift) & 0xFF]++] = src[i];
+        }
+
+        QueueEntry* temp = src;
+        src = dst;
+        dst = temp;
+    }
+
+    // Queued draws bind their own shader and state; the caller's are put back afterwards.
+    u32 oldShader = 0;
+    gpu::getShader(&oldShader);
+
+    gpu::PipelineState oldState;
+    gpu::getPipelineState(&oldState);
+
+    float oldModelView[16];
+    std::memcpy(oldModelView, modelview, 16 * sizeof(float));
+
+    u32 lastShader = 0;
+    for(u32 i = 0; i < count; i++) {
+        QueuedDraw* draw = &queueDraws[src[i].index];
+        if(draw->shader != lastShader) {
+            gpu::useShader(draw->shader);
+            lastShader = draw->shader;
+        }
+
+        if(draw->pipelineState != 0) {
+            gpu::bindPipelineState(draw->pipelineState);
+        }
+
+        gpu::bindTexture(gpu::TEXUNIT0, draw->texture);
+        setModelView(draw->modelview);
+        gpu::drawVbo(draw->vbo);
+    }
+
+    setModelView(oldModelView);
+    gpu::setPipelineState(&oldState);
+    gpu::useShader(oldShader);
+
+    queueDraws.clear();
+    queueEntries.clear();
+}
+
+void ctr::gput::setDamageTracking(gpu::Screen screen, bool enabled) {
+    DamageState* state = &damage[screen];
+    state->enabled = enabled;
+
+    // Both framebuffers of the swap chain start out stale.
+    int screenWidth = (int) (screen == gpu::SCREEN_TOP ? gpu::TOP_WIDTH : gpu::BOTTOM_WIDTH);
+    state->left = 0;
+    state->right = screenWidth;
+    state->prevLeft = 0;
+    state->prevRight = screenWidth;
+}
+
+void ctr::gput::addDamage(gpu::Screen screen, int x, int y, u32 width, u32 height) {
+    DamageState* state = &damage[screen];
+    if(!state->enabled || width == 0 || height == 0) {
+        return;
+    }
+
+    // Transfers cover full-height columns of the rotated render buffer, so only the horizontal extent is tracked.
+    if(state->left >= state->right) {
+        state->left = x;
+        state->right = x + (int) width;
+    } else {
+        if(x < state->left) {
+            state->left = x;
+        }
+
+        if(x + (int) width > state->right) {
+            state->right = x + (int) width;
+        }
+    }
+}
+
+bool ctr::gput::beginDamage(gpu::Screen screen) {
+    DamageState* state = &damage[screen];
+    int screenWidth = (int) (screen == gpu::SCREEN_TOP ? gpu::TOP_WIDTH : gpu::BOTTOM_WIDTH);
+    int screenHeight = (int) (screen == gpu::SCREEN_TOP ? gpu::TOP_HEIGHT : gpu::BOTTOM_HEIGHT);
 
-        const float vboData[] = {
-                cx, cy, -0.1f, texX1, texY1, r, g, b, a,
-                cx + charWidth, cy, -0.1f, texX2, texY1, r, g, b, a,
-                cx + charWidth, cy + charHeight, -0.1f, texX2, texY2, r, g, b, a,
-                cx + charWidth, cy + charHeight, -0.1f, texX2, texY2, r, g, b, a,
-                cx, cy + charHeight, -0.1f, texX1, texY2, r, g, b, a,
-                cx, cy, -0.1f, texX1, texY1, r, g, b, a
-        };
+    damageScreen = screen;
+    if(!state->enabled) {
+        damageX = 0;
+        damageWidth = (u32) screenWidth;
 
-        std::memcpy(tempVboData + (i * 6 * 9), vboData, sizeof(vboData));
-        cx += charWidth;
+        gpu::clear();
+        return true;
     }
 
-    gpu::bindTexture(gpu::TEXUNIT0, fontTexture);
-    gpu::drawVbo(stringVbo);
+    // The framebuffer being drawn to was last updated two frames ago, so repaint both frames' damage.
+    int left = state->left;
+    int right = state->right;
+    if(state->prevLeft < state->prevRight) {
+        if(left >= right) {
+            left = state->prevLeft;
+            right = state->prevRight;
+        } else {
+            left = state->prevLeft < left ? state->prevLeft : left;
+            right = state->prevRight > right ? state->prevRight : right;
+        }
+    }
+
+    state->prevLeft = state->left;
+    state->prevRight = state->right;
+    state->left = 0;
+    state->right = 0;
+
+    left = left < 0 ? 0 : left & ~7;
+    right = right > screenWidth ? screenWidth : (right + 7) & ~7;
+    if(left >= right) {
+        damageWidth = 0;
+        return false;
+    }
+
+    damageX = (u32) left;
+    damageWidth = (u32) (right - left);
+
+    gpu::setScissorTest(gpu::SCISSOR_NORMAL, left, 0, damageWidth, (u32) screenHeight);
+    gpu::clearRect(left, 0, damageWidth, (u32) screenHeight, gpu::CLEAR_ALL, true);
+    return true;
+}
+
+void ctr::gput::endDamage() {
+    if(damageWidth == 0) {
+        return;
+    }
 
-    // Flush the GPU command buffer so we can safely reuse the VBO.
     gpu::flushCommands();
+    if(damage[damageScreen].enabled) {
+        gpu::flushBufferRange(damageX, damageWidth);
+
+        // The render target still holds the whole frame, so a capture sees undamaged areas too.
+        captureFrame(damageScreen);
+
+        u32 screenWidth = damageScreen == gpu::SCREEN_TOP ? gpu::TOP_WIDTH : gpu::BOTTOM_WIDTH;
+        u32 screenHeight = damageScreen == gpu::SCREEN_TOP ? gpu::TOP_HEIGHT : gpu::BOTTOM_HEIGHT;
+        gpu::setScissorTest(gpu::SCISSOR_DISABLE, 0, 0, screenWidth, screenHeight);
+    } else {
+        gpu::flushBuffer();
+    }
+
+    damageWidth = 0;
 }
 
 void ctr::gput::takeScreenshot(bool top, bool bottom) {
@@ -563,4 +860,236 @@ void ctr::gput::takeScreenshot(bool top, bool bottom) {
 
     delete header;
     delete image;
+}
+
+static u64 ticksToMicros(u64 ticks) {
+    return ticks * 1000000 / SYSCLOCK_ARM11;
+}
+
+static u32 captureEncode(u16* out, u16* delta, const u16* pixels, u16* prev, u32 count, bool keyframe) {
+    // Delta against the previous frame, so unchanged pixels become zero runs.
+    for(u32 i = 0; i < count; i++) {
+        delta[i] = keyframe ? pixels[i] : (u16) (pixels[i] ^ prev[i]);
+        prev[i] = pixels[i];
+    }
+
+    // Run-length code the deltas: 0x8000 | n is a run of n zeros, n alone is followed by n literal words.
+    u32 pos = 0;
+    u32 i = 0;
+    while(i < count) {
+        u32 run = 0;
+        while(i + run < count && run < 0x7FFF && delta[i + run] == 0) {
+            run++;
+        }
+
+        if(run > 0) {
+            out[pos++] = (u16) (0x8000 | run);
+            i += run;
+            continue;
+        }
+
+        u32 start = i;
+        while(i < count && i - start < 0x7FFF && !(delta[i] == 0 && i + 1 < count && delta[i + 1] == 0)) {
+            i++;
+        }
+
+        out[pos++] = (u16) (i - start);
+        std::memcpy(&out[pos], &delta[start], (i - start) * sizeof(u16));
+        pos += i - start;
+    }
+
+    return pos;
+}
+
+void ctr::gput::captureThreadFunc(void* arg) {
+    u16* prev = new u16[CAPTURE_MAX_PIXELS]();
+    u16* delta = new u16[CAPTURE_MAX_PIXELS];
+    u16* packed = new u16[CAPTURE_MAX_PIXELS * 2];
+
+    u32 frame = 0;
+    u32 lastWidth = 0;
+    u32 lastHeight = 0;
+    while(true) {
+        svcWaitSynchronization(captureEvent, U64_MAX);
+
+        while(captureSlots[captureReadSlot].filled) {
+            CaptureSlot* slot = &captureSlots[captureReadSlot];
+
+            u64 start = svcGetSystemTick();
+
+            bool keyframe = frame % CAPTURE_KEYFRAME_INTERVAL == 0 || slot->width != lastWidth || slot->height != lastHeight;
+            u32 words = captureEncode(packed, delta, slot->pixels, prev, slot->width * slot->height, keyframe);
+
+            u64 end = svcGetSystemTick();
+
+            u32 header[4] = {slot->time, (slot->height << 16) | slot->width, keyframe ? 1u : 0u, words * (u32) sizeof(u16)};
+            fwrite(header, sizeof(u32), 4, captureFile);
+            fwrite(packed, sizeof(u16), words, captureFile);
+
+            lastWidth = slot->width;
+            lastHeight = slot->height;
+            frame++;
+
+            __sync_synchronize();
+            slot->filled = false;
+            captureReadSlot = (captureReadSlot + 1) % CAPTURE_SLOT_COUNT;
+
+            LightLock_Lock(&captureLock);
+            captureStats.writtenFrames++;
+            captureStats.writtenBytes += 4 * sizeof(u32) + words * sizeof(u16);
+            captureStats.compressTimeUs += ticksToMicros(end - start);
+            LightLock_Unlock(&captureLock);
+        }
+
+        if(!captureRunning) {
+            break;
+        }
+    }
+
+    delete[] prev;
+    delete[] delta;
+    delete[] packed;
+}
+
+void ctr::gput::freeCapture() {
+    for(u32 i = 0; i < CAPTURE_SLOT_COUNT; i++) {
+        if(captureSlots[i].pixels != NULL) {
+            gpu::gfree(captureSlots[i].pixels);
+            captureSlots[i].pixels = NULL;
+        }
+
+        captureSlots[i].filled = false;
+    }
+
+    if(captureEvent != 0) {
+        svcCloseHandle(captureEvent);
+        captureEvent = 0;
+    }
+
+    if(captureFile != NULL) {
+        fclose(captureFile);
+        captureFile = NULL;
+    }
+}
+
+bool ctr::gput::startCapture(gpu::Screen screen) {
+    if(captureRunning) {
+        return false;
+    }
+
+    std::stringstream fileStream;
+    fileStream << "/capture_" << time(NULL) << ".ccap";
+
+    captureFile = fopen(fileStream.str().c_str(), "wb");
+    if(captureFile == NULL) {
+        return false;
+    }
+
+    u32 header[4] = {CAPTURE_MAGIC, CAPTURE_VERSION, gpu::PIXEL_RGB565, screen};
+    fwrite(header, sizeof(u32), 4, captureFile);
+
+    for(u32 i = 0; i < CAPTURE_SLOT_COUNT; i++) {
+        captureSlots[i].pixels = (u16*) gpu::galloc(CAPTURE_MAX_PIXELS * sizeof(u16));
+        captureSlots[i].filled = false;
+        if(captureSlots[i].pixels == NULL) {
+            freeCapture();
+            return false;
+        }
+    }
+
+    if(svcCreateEvent(&captureEvent, RESET_ONESHOT) != 0) {
+        captureEvent = 0;
+        freeCapture();
+        return false;
+    }
+
+    LightLock_Init(&captureLock);
+    captureStats = {};
+    captureScreen = screen;
+    captureWriteSlot = 0;
+    captureReadSlot = 0;
+    captureStartTime = core::time();
+    captureRunning = true;
+
+    captureThread = threadCreate(captureThreadFunc, NULL, 0x4000, 0x31, -2, false);
+    if(captureThread == NULL) {
+        captureRunning = false;
+        freeCapture();
+        return false;
+    }
+
+    return true;
+}
+
+void ctr::gput::stopCapture() {
+    if(!captureRunning) {
+        return;
+    }
+
+    captureRunning = false;
+    svcSignalEvent(captureEvent);
+
+    threadJoin(captureThread, U64_MAX);
+    threadFree(captureThread);
+    captureThread = NULL;
+
+    freeCapture();
+}
+
+bool ctr::gput::capturing() {
+    return captureRunning;
+}
+
+void ctr::gput::getCaptureStats(CaptureStats* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    if(!captureRunning) {
+        *out = captureStats;
+        return;
+    }
+
+    LightLock_Lock(&captureLock);
+    *out = captureStats;
+    LightLock_Unlock(&captureLock);
+}
+
+void ctr::gput::captureFrame(gpu::Screen screen) {
+    if(!captureRunning || screen != captureScreen) {
+        return;
+    }
+
+    u32 width = 0;
+    u32 height = 0;
+    gpu::getViewportWidth(&width);
+    gpu::getViewportHeight(&height);
+
+    CaptureSlot* slot = &captureSlots[captureWriteSlot];
+    if(slot->filled || width * height > CAPTURE_MAX_PIXELS) {
+        LightLock_Lock(&captureLock);
+        captureStats.droppedFrames++;
+        LightLock_Unlock(&captureLock);
+        return;
+    }
+
+    u64 start = svcGetSystemTick();
+    gpu::copyFrameBuffer(slot->pixels, gpu::PIXEL_RGB565);
+    u64 end = svcGetSystemTick();
+
+    // The frame buffer is stored rotated, so the transfer's rows run along the screen's height.
+    slot->width = height;
+    slot->height = width;
+    slot->time = (u32) (core::time() - captureStartTime);
+
+    __sync_synchronize();
+    slot->filled = true;
+    captureWriteSlot = (captureWriteSlot + 1) % CAPTURE_SLOT_COUNT;
+
+    LightLock_Lock(&captureLock);
+    captureStats.capturedFrames++;
+    captureStats.copyTimeUs += ticksToMicros(end - start);
+    LightLock_Unlock(&captureLock);
+
+    svcSignalEvent(captureEvent);
 }
\ No newline at end of file
@@ -0,0 +1,1160 @@
+#include "citrus/gput.hpp"
+#include "citrus/gpu.hpp"
+#include "internal.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+
+#include <3ds.h>
+
+#include "citrus_default_font_bin.h"
+
+#define FONT_ATLAS_SIZE 256
+#define FONT_GLYPH_PADDING 1
+#define FONT_ASCII_GLYPHS 128
+
+#define TEXT_BATCH_MIN_QUADS 256
+#define TEXT_BATCH_MAX_QUADS 0x4000
+
+#define DISTANCE_FIELD_ENVS 5
+#define DISTANCE_FIELD_EDGE 0x70
+
+#define GLYPH_NONE 0xFFFFFFFF
+#define CELL_NONE 0xFFFFFFFF
+
+using namespace ctr;
+
+namespace ctr {
+    namespace gput {
+        typedef struct {
+            u32 codepoint;
+            u32 page;
+            u16 x;
+            u16 y;
+            u16 width;
+            u16 height;
+            s16 xOffset;
+            s16 yOffset;
+            s16 advance;
+            u32 cell;
+        } Glyph;
+
+        typedef struct {
+            u32 glyph;
+            u32 prev;
+            u32 next;
+            u32 batch;
+        } AtlasCell;
+
+        typedef struct {
+            s16 x;
+            s16 y;
+            s16 u;
+            s16 v;
+            u8 r;
+            u8 g;
+            u8 b;
+            u8 a;
+        } TextVertex;
+
+        typedef struct {
+            u8* pixels;
+            u32 width;
+            u32 height;
+        } FontPage;
+
+        typedef struct {
+            std::vector<Glyph> glyphs;
+            std::unordered_map<u32, u32> glyphMap;
+            u32 asciiGlyphs[FONT_ASCII_GLYPHS];
+            u32 fallbackGlyph;
+            std::unordered_map<u64, s16> kerning;
+
+            std::vector<FontPage> pages;
+            gpu::PixelFormat format;
+            u32 filter;
+            bool distanceField;
+
+            u32 lineHeight;
+            u32 base;
+            u32 nominalWidth;
+
+            u32 atlasTexture;
+            u32 atlasWidth;
+            u32 atlasHeight;
+            u32 cellWidth;
+            u32 cellHeight;
+            u32 cellsX;
+            std::vector<AtlasCell> cells;
+            std::vector<u8> cellPixels;
+            u32 lruHead;
+            u32 lruTail;
+            u32 batch;
+            bool atlasDirty;
+            bool uploaded;
+
+            u32 batchVbo;
+            u32 batchCapacity;
+            u32 batchQuads;
+            u32 batchDrawn;
+            float batchProjection[16];
+            float batchModelView[16];
+
+            u32 generation;
+            u32 evictions;
+        } FontData;
+
+        typedef struct {
+            u32 glyph;
+            u32 line;
+            float x;
+            float y;
+        } LayoutGlyph;
+
+        typedef struct {
+            std::string text;
+            u32 font;
+            float charWidth;
+            float charHeight;
+            float wrapWidth;
+            TextAlign align;
+
+            FontData* resolvedFont;
+            u32 generation;
+            float scaleX;
+            float scaleY;
+            float width;
+            float height;
+            std::vector<LayoutGlyph> glyphs;
+        } TextLayoutData;
+
+        static std::vector<FontData*> fonts;
+        static std::vector<LayoutGlyph> stringGlyphs;
+        static std::vector<float> lineWidths;
+
+        static u32 defaultFont = 0;
+        static u32 activeFont = 0;
+    }
+}
+
+bool ctr::gput::initFonts() {
+    createFont(&defaultFont);
+    setFont((void*) citrus_default_font_bin, 128, 128, 8, 8, gpu::PIXEL_RGBA8);
+    return true;
+}
+
+void ctr::gput::exitFonts() {
+    if(defaultFont != 0) {
+        freeFont(defaultFont);
+        defaultFont = 0;
+    }
+
+    activeFont = 0;
+}
+
+static void fontClearGlyphs(gput::FontData* fontData) {
+    fontData->glyphs.clear();
+    fontData->glyphMap.clear();
+    fontData->kerning.clear();
+    for(u32 i = 0; i < FONT_ASCII_GLYPHS; i++) {
+        fontData->asciiGlyphs[i] = GLYPH_NONE;
+    }
+
+    fontData->fallbackGlyph = GLYPH_NONE;
+    fontData->atlasDirty = true;
+    fontData->generation++;
+}
+
+static void fontClearPages(gput::FontData* fontData) {
+    for(std::vector<gput::FontPage>::iterator it = fontData->pages.begin(); it != fontData->pages.end(); it++) {
+        delete[] it->pixels;
+    }
+
+    fontData->pages.clear();
+    fontData->atlasDirty = true;
+}
+
+static u32 fontFindGlyph(gput::FontData* fontData, u32 codepoint) {
+    if(codepoint < FONT_ASCII_GLYPHS) {
+        u32 glyph = fontData->asciiGlyphs[codepoint];
+        return glyph != GLYPH_NONE ? glyph : fontData->fallbackGlyph;
+    }
+
+    std::unordered_map<u32, u32>::iterator it = fontData->glyphMap.find(codepoint);
+    return it != fontData->glyphMap.end() ? it->second : fontData->fallbackGlyph;
+}
+
+static int fontKerning(gput::FontData* fontData, u32 first, u32 second) {
+    if(fontData->kerning.empty() || first == 0) {
+        return 0;
+    }
+
+    std::unordered_map<u64, s16>::iterator it = fontData->kerning.find(((u64) first << 32) | second);
+    return it != fontData->kerning.end() ? it->second : 0;
+}
+
+static u32 fontNextCodepoint(const std::string& str, u32* pos) {
+    u32 codepoint = 0;
+    ssize_t units = decode_utf8(&codepoint, (const u8*) &str.c_str()[*pos]);
+    if(units <= 0) {
+        // Malformed sequences are skipped a byte at a time.
+        *pos += 1;
+        return 0xFFFD;
+    }
+
+    *pos += (u32) units;
+    return codepoint;
+}
+
+static bool fontPrepareAtlas(gput::FontData* fontData) {
+    if(!fontData->atlasDirty) {
+        return fontData->cellsX != 0;
+    }
+
+    // Queued quads hold UVs for the old cell layout and sample texels the rebuild will overwrite.
+    if(fontData->batchQuads > 0) {
+        gpu::flushCommands();
+    }
+
+    fontData->atlasDirty = false;
+    fontData->cellsX = 0;
+    fontData->cells.clear();
+
+    fontData->fallbackGlyph = GLYPH_NONE;
+    u32 fallback = fontFindGlyph(fontData, 0xFFFD);
+    fontData->fallbackGlyph = fallback != GLYPH_NONE ? fallback : fontFindGlyph(fontData, '?');
+
+    // Every glyph gets a cell big enough for the largest one, so any glyph can replace any other.
+    u32 maxWidth = 0;
+    u32 maxHeight = 0;
+    for(std::vector<gput::Glyph>::iterator it = fontData->glyphs.begin(); it != fontData->glyphs.end(); it++) {
+        it->cell = CELL_NONE;
+        if(it->width > maxWidth) {
+            maxWidth = it->width;
+        }
+
+        if(it->height > maxHeight) {
+            maxHeight = it->height;
+        }
+    }
+
+    if(fontData->pages.empty() || maxWidth == 0 || maxHeight == 0) {
+        return false;
+    }
+
+    fontData->cellWidth = maxWidth + FONT_GLYPH_PADDING;
+    fontData->cellHeight = maxHeight + FONT_GLYPH_PADDING;
+    fontData->cellsX = fontData->atlasWidth / fontData->cellWidth;
+
+    u32 cellCount = fontData->cellsX * (fontData->atlasHeight / fontData->cellHeight);
+    if(cellCount == 0) {
+        fontData->cellsX = 0;
+        return false;
+    }
+
+    gpu::setTextureInfo(fontData->atlasTexture, fontData->atlasWidth, fontData->atlasHeight, fontData->format, gpu::textureMinFilter((gpu::TextureFilter) fontData->filter) | gpu::textureMagFilter((gpu::TextureFilter) fontData->filter));
+
+    fontData->cells.resize(cellCount);
+    for(u32 i = 0; i < cellCount; i++) {
+        fontData->cells[i].glyph = GLYPH_NONE;
+        fontData->cells[i].prev = i > 0 ? i - 1 : CELL_NONE;
+        fontData->cells[i].next = i < cellCount - 1 ? i + 1 : CELL_NONE;
+        fontData->cells[i].batch = 0;
+    }
+
+    fontData->lruHead = 0;
+    fontData->lruTail = cellCount - 1;
+    fontData->cellPixels.resize(fontData->cellWidth * fontData->cellHeight * (gpu::bitsPerPixel(fontData->format) / 8));
+    return true;
+}
+
+static void fontTouchCell(gput::FontData* fontData, u32 cell) {
+    if(fontData->lruHead == cell) {
+        return;
+    }
+
+    gput::AtlasCell* atlasCell = &fontData->cells[cell];
+    fontData->cells[atlasCell->prev].next = atlasCell->next;
+    if(atlasCell->next != CELL_NONE) {
+        fontData->cells[atlasCell->next].prev = atlasCell->prev;
+    } else {
+        fontData->lruTail = atlasCell->prev;
+    }
+
+    atlasCell->prev = CELL_NONE;
+    atlasCell->next = fontData->lruHead;
+    fontData->cells[fontData->lruHead].prev = cell;
+    fontData->lruHead = cell;
+}
+
+static void fontUploadGlyph(gput::FontData* fontData, gput::Glyph* glyph, u32 cell) {
+    u32 bytes = gpu::bitsPerPixel(fontData->format) / 8;
+    u32 rowSize = fontData->cellWidth * bytes;
+    u8* pixels = &fontData->cellPixels[0];
+    std::memset(pixels, 0, fontData->cellPixels.size());
+
+    // The padding is uploaded along with the glyph so filtering never picks up a previous occupant.
+    if(glyph->page < fontData->pages.size()) {
+        const gput::FontPage* page = &fontData->pages[glyph->page];
+        if(page->pixels != NULL && glyph->x + glyph->width <= page->width && glyph->y + glyph->height <= page->height) {
+            for(u32 row = 0; row < glyph->height; row++) {
+                std::memcpy(&pixels[row * rowSize], &page->pixels[((glyph->y + row) * page->width + glyph->x) * bytes], glyph->width * bytes);
+            }
+        }
+    }
+
+    u32 cellX = (cell % fontData->cellsX) * fontData->cellWidth;
+    u32 cellY = (cell / fontData->cellsX) * fontData->cellHeight;
+    gpu::setTextureSubData(fontData->atlasTexture, cellX, cellY, fontData->cellWidth, fontData->cellHeight, pixels);
+    fontData->uploaded = true;
+}
+
+static u32 fontAcquireCell(gput::FontData* fontData, u32 glyphIndex) {
+    gput::Glyph* glyph = &fontData->glyphs[glyphIndex];
+    if(glyph->cell != CELL_NONE) {
+        fontTouchCell(fontData, glyph->cell);
+        fontData->cells[glyph->cell].batch = fontData->batch;
+        return glyph->cell;
+    }
+
+    // The least recently used cell can't be replaced while a pending draw still samples it, even if its glyph was dropped.
+    u32 cell = fontData->lruTail;
+    gput::AtlasCell* atlasCell = &fontData->cells[cell];
+    if(atlasCell->batch == fontData->batch) {
+        return CELL_NONE;
+    }
+
+    if(atlasCell->glyph != GLYPH_NONE) {
+        fontData->glyphs[atlasCell->glyph].cell = CELL_NONE;
+        fontData->evictions++;
+    }
+
+    atlasCell->glyph = glyphIndex;
+    atlasCell->batch = fontData->batch;
+    glyph->cell = cell;
+
+    fontUploadGlyph(fontData, glyph, cell);
+    fontTouchCell(fontData, cell);
+    return cell;
+}
+
+void ctr::gput::createFont(u32* font, u32 atlasWidth, u32 atlasHeight) {
+    if(font == NULL) {
+        return;
+    }
+
+    FontData* fontData = new FontData();
+    fontClearGlyphs(fontData);
+    fontData->format = gpu::PIXEL_RGBA8;
+    fontData->filter = gpu::FILTER_LINEAR;
+    fontData->distanceField = false;
+    fontData->lineHeight = 0;
+    fontData->base = 0;
+    fontData->nominalWidth = 0;
+    fontData->cellWidth = 0;
+    fontData->cellHeight = 0;
+    fontData->atlasWidth = atlasWidth != 0 ? atlasWidth : FONT_ATLAS_SIZE;
+    fontData->atlasHeight = atlasHeight != 0 ? atlasHeight : FONT_ATLAS_SIZE;
+    fontData->cellsX = 0;
+    fontData->batch = 1;
+    fontData->uploaded = false;
+    fontData->batchVbo = 0;
+    fontData->batchCapacity = 0;
+    fontData->batchQuads = 0;
+    fontData->batchDrawn = 0;
+    fontData->generation = 0;
+    fontData->evictions = 0;
+
+    gpu::createTexture(&fontData->atlasTexture);
+
+    fonts.push_back(fontData);
+
+    *font = (u32) fontData;
+}
+
+void ctr::gput::freeFont(u32 font) {
+    FontData* fontData = (FontData*) font;
+    if(fontData == NULL) {
+        return;
+    }
+
+    if(activeFont == font) {
+        activeFont = 0;
+    }
+
+    // Queued text may still reference the buffer and atlas.
+    if(fontData->batchQuads > 0) {
+        gpu::flushCommands();
+    }
+
+    for(std::vector<FontData*>::iterator it = fonts.begin(); it != fonts.end(); it++) {
+        if(*it == fontData) {
+            fonts.erase(it);
+            break;
+        }
+    }
+
+    fontClearPages(fontData);
+    gpu::freeTexture(fontData->atlasTexture);
+    gpu::freeVbo(fontData->batchVbo);
+    delete fontData;
+}
+
+bool ctr::gput::loadFont(u32 font, const void* data, u32 size) {
+    FontData* fontData = (FontData*) font;
+    if(fontData == NULL || data == NULL || size == 0) {
+        return false;
+    }
+
+    // BMFont text descriptors: one tag per line followed by key=value pairs.
+    std::istringstream stream(std::string((const char*) data, size));
+    std::string line;
+
+    bool common = false;
+    fontClearGlyphs(fontData);
+    fontData->filter = gpu::FILTER_LINEAR;
+    while(std::getline(stream, line)) {
+        std::istringstream lineStream(line);
+        std::string tag;
+        lineStream >> tag;
+
+        int values[10] = {0};
+        std::string pair;
+        while(lineStream >> pair) {
+            std::string::size_type split = pair.find('=');
+            if(split == std::string::npos) {
+                continue;
+            }
+
+            std::string key = pair.substr(0, split);
+            int value = (int) strtol(pair.c_str() + split + 1, NULL, 10);
+            if(tag == "common") {
+                if(key == "lineHeight") {
+                    values[0] = value;
+                } else if(key == "base") {
+                    values[1] = value;
+                }
+            } else if(tag == "char") {
+                static const char* charKeys[] = {"id", "x", "y", "width", "height", "xoffset", "yoffset", "xadvance", "page"};
+                for(u32 i = 0; i < sizeof(charKeys) / sizeof(charKeys[0]); i++) {
+                    if(key == charKeys[i]) {
+                        values[i] = value;
+                        break;
+                    }
+                }
+            } else if(tag == "kerning") {
+                if(key == "first") {
+                    values[0] = value;
+                } else if(key == "second") {
+                    values[1] = value;
+                } else if(key == "amount") {
+                    values[2] = value;
+                }
+            }
+        }
+
+        if(tag == "common") {
+            setFontMetrics(font, (u32) values[0], (u32) values[1]);
+            common = true;
+        } else if(tag == "char") {
+            setFontGlyph(font, (u32) values[0], (u32) values[8], (u32) values[1], (u32) values[2], (u32) values[3], (u32) values[4], values[5], values[6], values[7]);
+        } else if(tag == "kerning") {
+            setFontKerning(font, (u32) values[0], (u32) values[1], values[2]);
+        }
+    }
+
+    return common && !fontData->glyphs.empty();
+}
+
+void ctr::gput::setFontPage(u32 font, u32 page, const void* image, u32 width, u32 height, gpu::PixelFormat format) {
+    FontData* fontData = (FontData*) font;
+    if(fontData == NULL || image == NULL || width == 0 || height == 0 || gpu::bitsPerPixel(format) < 8) {
+        return;
+    }
+
+    // All pages share the atlas, so they must share its format.
+    bool otherPages = false;
+    for(u32 i = 0; i < fontData->pages.size(); i++) {
+        if(i != page && fontData->pages[i].pixels != NULL) {
+            otherPages = true;
+        }
+    }
+
+    if(otherPages && format != fontData->format) {
+        return;
+    }
+
+    if(page >= fontData->pages.size()) {
+        FontPage empty = {NULL, 0, 0};
+        fontData->pages.resize(page + 1, empty);
+    }
+
+    // Pages are kept in regular heap memory; only glyphs in use occupy linear memory in the atlas.
+    u32 size = width * height * gpu::bitsPerPixel(format) / 8;
+    FontPage* fontPage = &fontData->pages[page];
+    delete[] fontPage->pixels;
+    fontPage->pixels = new u8[size];
+    fontPage->width = width;
+    fontPage->height = height;
+    std::memcpy(fontPage->pixels, image, size);
+
+    fontData->format = format;
+    fontData->atlasDirty = true;
+}
+
+void ctr::gput::setFontMetrics(u32 font, u32 lineHeight, u32 base, u32 nominalWidth) {
+    FontData* fontData = (FontData*) font;
+    if(fontData == NULL) {
+        return;
+    }
+
+    fontData->lineHeight = lineHeight;
+    fontData->base = base;
+    fontData->nominalWidth = nominalWidth != 0 ? nominalWidth : lineHeight;
+    fontData->generation++;
+}
+
+void ctr::gput::setFontGlyph(u32 font, u32 codepoint, u32 page, u32 x, u32 y, u32 width, u32 height, int xOffset, int yOffset, int advance) {
+    FontData* fontData = (FontData*) font;
+    if(fontData == NULL) {
+        return;
+    }
+
+    Glyph glyph;
+    glyph.codepoint = codepoint;
+    glyph.page = page;
+    glyph.x = (u16) x;
+    glyph.y = (u16) y;
+    glyph.width = (u16) width;
+    glyph.height = (u16) height;
+    glyph.xOffset = (s16) xOffset;
+    glyph.yOffset = (s16) yOffset;
+    glyph.advance = (s16) advance;
+    glyph.cell = CELL_NONE;
+
+    u32 index = fontFindGlyph(fontData, codepoint);
+    if(index == GLYPH_NONE || index == fontData->fallbackGlyph || fontData->glyphs[index].codepoint != codepoint) {
+        index = fontData->glyphs.size();
+        fontData->glyphs.push_back(glyph);
+        if(codepoint < FONT_ASCII_GLYPHS) {
+            fontData->asciiGlyphs[codepoint] = index;
+        } else {
+            fontData->glyphMap[codepoint] = index;
+        }
+    } else {
+        // Drop the stale copy from the atlas; the replacement is uploaded on next use. The cell keeps its batch pin.
+        u32 cell = fontData->glyphs[index].cell;
+        if(cell != CELL_NONE) {
+            fontData->cells[cell].glyph = GLYPH_NONE;
+        }
+
+        fontData->glyphs[index] = glyph;
+    }
+
+    fontData->generation++;
+    if(codepoint == 0xFFFD || codepoint == '?' || width + FONT_GLYPH_PADDING > fontData->cellWidth || height + FONT_GLYPH_PADDING > fontData->cellHeight) {
+        fontData->atlasDirty = true;
+    }
+}
+
+void ctr::gput::setFontKerning(u32 font, u32 first, u32 second, int amount) {
+    FontData* fontData = (FontData*) font;
+    if(fontData == NULL) {
+        return;
+    }
+
+    u64 key = ((u64) first << 32) | second;
+    if(amount == 0) {
+        fontData->kerning.erase(key);
+    } else {
+        fontData->kerning[key] = (s16) amount;
+    }
+
+    fontData->generation++;
+}
+
+void ctr::gput::setFontDistanceField(u32 font, bool distanceField) {
+    FontData* fontData = (FontData*) font;
+    if(fontData == NULL || fontData->distanceField == distanceField) {
+        return;
+    }
+
+    // Queued text was generated for the old mode.
+    if(fontData->batchQuads > 0) {
+        gpu::flushCommands();
+    }
+
+    // Distances have to be interpolated between texels for the edge to stay smooth when scaled.
+    fontData->distanceField = distanceField;
+    if(distanceField) {
+        fontData->filter = gpu::FILTER_LINEAR;
+    }
+
+    fontData->atlasDirty = true;
+}
+
+void ctr::gput::getFontCacheStats(u32 font, u32* cached, u32* capacity, u32* evictions) {
+    FontData* fontData = (FontData*) (font != 0 ? font : defaultFont);
+    if(fontData == NULL) {
+        return;
+    }
+
+    if(cached != NULL) {
+        u32 count = 0;
+        for(std::vector<AtlasCell>::iterator it = fontData->cells.begin(); it != fontData->cells.end(); it++) {
+            if(it->glyph != GLYPH_NONE) {
+                count++;
+            }
+        }
+
+        *cached = count;
+    }
+
+    if(capacity != NULL) {
+        *capacity = fontData->cells.size();
+    }
+
+    if(evictions != NULL) {
+        *evictions = fontData->evictions;
+    }
+}
+
+void ctr::gput::useFont(u32 font) {
+    activeFont = font;
+}
+
+u32 ctr::gput::getFont() {
+    return activeFont != 0 ? activeFont : defaultFont;
+}
+
+void ctr::gput::setFont(void* image, u32 width, u32 height, u32 charWidth, u32 charHeight, gpu::PixelFormat format) {
+    FontData* fontData = (FontData*) defaultFont;
+    if(fontData == NULL || image == NULL || charWidth == 0 || charHeight == 0) {
+        return;
+    }
+
+    // Fixed grids become a font whose cells are glyphs indexed by codepoint.
+    fontClearPages(fontData);
+    fontClearGlyphs(fontData);
+    setFontPage(defaultFont, 0, image, width, height, format);
+    setFontMetrics(defaultFont, charHeight, charHeight, charWidth);
+
+    u32 charsX = width / charWidth;
+    u32 charsY = height / charHeight;
+    for(u32 i = 0; i < charsX * charsY; i++) {
+        setFontGlyph(defaultFont, i, 0, (i % charsX) * charWidth, (i / charsX) * charHeight, charWidth, charHeight, 0, 0, (int) charWidth);
+    }
+
+    fontData->filter = gpu::FILTER_NEAREST;
+    activeFont = 0;
+}
+
+float ctr::gput::getStringWidth(const std::string& str, float charWidth) {
+    FontData* fontData = (FontData*) getFont();
+    u32 len = str.length();
+    if(fontData == NULL || len == 0 || fontData->nominalWidth == 0) {
+        return 0;
+    }
+
+    int longestLine = 0;
+    int currLength = 0;
+    u32 prev = 0;
+    u32 pos = 0;
+    while(pos < len) {
+        u32 codepoint = fontNextCodepoint(str, &pos);
+        if(codepoint == '\n') {
+            if(currLength > longestLine) {
+                longestLine = currLength;
+            }
+
+            currLength = 0;
+            prev = 0;
+            continue;
+        }
+
+        u32 glyph = fontFindGlyph(fontData, codepoint);
+        if(glyph != GLYPH_NONE) {
+            currLength += fontKerning(fontData, prev, codepoint) + fontData->glyphs[glyph].advance;
+        }
+
+        prev = codepoint;
+    }
+
+    if(currLength > longestLine) {
+        longestLine = currLength;
+    }
+
+    return longestLine * charWidth / fontData->nominalWidth;
+}
+
+float ctr::gput::getStringHeight(const std::string& str, float charHeight) {
+    u32 len = str.length();
+    if(len == 0) {
+        return 0;
+    }
+
+    u32 lines = 1;
+    for(u32 i = 0; i < len; i++) {
+        if(str[i] == '\n') {
+            lines++;
+        }
+    }
+
+    return (int) (lines * charHeight);
+}
+
+static void fontBeginDistanceField(gpu::PipelineState* oldState) {
+    gpu::getPipelineState(oldState);
+
+    // Coverage is (distance - edge) * 8, which ramps from 0 to 1 across the 0.5 contour, times the vertex alpha.
+    // Color comes from the vertex alone, since distance atlases carry no color.
+    u16 previous = gpu::texEnvSources(gpu::SOURCE_PREVIOUS, gpu::SOURCE_PREVIOUS, gpu::SOURCE_PRIMARY_COLOR);
+    u16 rgbOperands = gpu::texEnvOperands(gpu::TEXENV_OP_RGB_SRC_COLOR, gpu::TEXENV_OP_RGB_SRC_COLOR, gpu::TEXENV_OP_RGB_SRC_COLOR);
+    u16 alphaOperands = gpu::texEnvOperands(gpu::TEXENV_OP_A_SRC_ALPHA, gpu::TEXENV_OP_A_SRC_ALPHA, gpu::TEXENV_OP_A_SRC_ALPHA);
+
+    gpu::setTexEnv(0, gpu::texEnvSources(gpu::SOURCE_PRIMARY_COLOR, gpu::SOURCE_PRIMARY_COLOR, gpu::SOURCE_PRIMARY_COLOR), gpu::texEnvSources(gpu::SOURCE_TEXTURE0, gpu::SOURCE_CONSTANT, gpu::SOURCE_PRIMARY_COLOR), rgbOperands, alphaOperands, gpu::COMBINE_REPLACE, gpu::COMBINE_SUBTRACT, (u32) DISTANCE_FIELD_EDGE << 24);
+    for(u32 env = 1; env < DISTANCE_FIELD_ENVS - 1; env++) {
+        gpu::setTexEnv(env, previous, previous, rgbOperands, alphaOperands, gpu::COMBINE_REPLACE, gpu::COMBINE_ADD, 0xFFFFFFFF);
+    }
+
+    gpu::setTexEnv(DISTANCE_FIELD_ENVS - 1, previous, gpu::texEnvSources(gpu::SOURCE_PREVIOUS, gpu::SOURCE_PRIMARY_COLOR, gpu::SOURCE_PRIMARY_COLOR), rgbOperands, alphaOperands, gpu::COMBINE_REPLACE, gpu::COMBINE_MODULATE, 0xFFFFFFFF);
+
+    // Fragments outside the glyph are rejected before blending.
+    gpu::setAlphaTest(true, gpu::TEST_GREATER, 0);
+}
+
+static void fontEndDistanceField(const gpu::PipelineState* oldState) {
+    for(u32 env = 0; env < DISTANCE_FIELD_ENVS; env++) {
+        const gpu::TexEnv* texEnv = &oldState->texEnv[env];
+        gpu::setTexEnv(env, texEnv->rgbSources, texEnv->alphaSources, texEnv->rgbOperands, texEnv->alphaOperands, texEnv->rgbCombine, texEnv->alphaCombine, texEnv->constantColor);
+    }
+
+    gpu::setAlphaTest(oldState->alphaEnable, oldState->alphaFunc, oldState->alphaRef);
+}
+
+static void fontFlushBatch(gput::FontData* fontData) {
+    if(fontData->batchDrawn == fontData->batchQuads) {
+        return;
+    }
+
+    // Text is drawn with the matrices it was queued under, then the caller's state is put back.
+    u32 oldShader = 0;
+    u32 oldTexture = 0;
+    gpu::getShader(&oldShader);
+    gpu::getBoundTexture(gpu::TEXUNIT0, &oldTexture);
+
+    float oldProjection[16];
+    float oldModelView[16];
+    std::memcpy(oldProjection, gput::getProjection(), 16 * sizeof(float));
+    std::memcpy(oldModelView, gput::getModelView(), 16 * sizeof(float));
+    gput::setProjection(fontData->batchProjection);
+    gput::setModelView(fontData->batchModelView);
+
+    gput::useBatchShader(1.0f / fontData->atlasWidth, 1.0f / fontData->atlasHeight);
+
+    // Rebinding forces a texture cache flush after glyph uploads.
+    if(fontData->uploaded) {
+        gpu::bindTexture(gpu::TEXUNIT0, 0);
+        fontData->uploaded = false;
+    }
+
+    gpu::bindTexture(gpu::TEXUNIT0, fontData->atlasTexture);
+
+    gpu::PipelineState oldState;
+    if(fontData->distanceField) {
+        fontBeginDistanceField(&oldState);
+    }
+
+    gpu::drawVboRange(fontData->batchVbo, fontData->batchDrawn * 6, (fontData->batchQuads - fontData->batchDrawn) * 6);
+    fontData->batchDrawn = fontData->batchQuads;
+
+    if(fontData->distanceField) {
+        fontEndDistanceField(&oldState);
+    }
+
+    gput::setProjection(oldProjection);
+    gput::setModelView(oldModelView);
+    gpu::bindTexture(gpu::TEXUNIT0, oldTexture);
+    gpu::useShader(oldShader);
+}
+
+void ctr::gput::flushTextBatches() {
+    for(std::vector<FontData*>::iterator it = fonts.begin(); it != fonts.end(); it++) {
+        fontFlushBatch(*it);
+    }
+}
+
+void ctr::gput::releaseTextBatches() {
+    // The GPU is idle, so queued vertices and the glyphs they sample may be overwritten.
+    for(std::vector<FontData*>::iterator it = fonts.begin(); it != fonts.end(); it++) {
+        (*it)->batchQuads = 0;
+        (*it)->batchDrawn = 0;
+        (*it)->batch++;
+    }
+}
+
+static bool fontGrowBatch(gput::FontData* fontData, u32 capacity) {
+    std::vector<u16> indices(capacity * 6);
+    for(u32 i = 0; i < capacity; i++) {
+        u16 base = (u16) (i * 4);
+        u16 quad[6] = {base, (u16) (base + 1), (u16) (base + 2), (u16) (base + 2), (u16) (base + 3), base};
+        std::memcpy(&indices[i * 6], quad, sizeof(quad));
+    }
+
+    u32 vbo = 0;
+    gpu::createVbo(&vbo);
+    gpu::setVboAttributes(vbo, gpu::vboAttribute(0, 2, gpu::ATTR_SHORT) | gpu::vboAttribute(1, 2, gpu::ATTR_SHORT) | gpu::vboAttribute(2, 4, gpu::ATTR_UNSIGNED_BYTE), 3);
+    gpu::setVboDataInfo(vbo, capacity * 4, gpu::PRIM_TRIANGLES);
+    gpu::setVboIndices(vbo, &indices[0], indices.size() * sizeof(u16));
+
+    void* data = NULL;
+    void* indexData = NULL;
+    gpu::getVboData(vbo, &data);
+    gpu::getVboIndices(vbo, &indexData);
+    if(data == NULL || indexData == NULL) {
+        gpu::freeVbo(vbo);
+        return false;
+    }
+
+    // Queued draws keep reading the old buffer until the GPU is idle; quads not yet drawn move to the new one at the same offsets.
+    if(fontData->batchVbo != 0) {
+        u32 offset = fontData->batchDrawn * 4 * sizeof(gput::TextVertex);
+        u32 size = (fontData->batchQuads - fontData->batchDrawn) * 4 * sizeof(gput::TextVertex);
+        if(size > 0) {
+            void* oldData = NULL;
+            void* newData = NULL;
+            gpu::getVboData(fontData->batchVbo, &oldData);
+            gpu::mapVbo(vbo, offset, size, &newData);
+            std::memcpy(newData, (u8*) oldData + offset, size);
+            gpu::unmapVbo(vbo);
+        }
+
+        gput::retireVbo(fontData->batchVbo);
+    }
+
+    fontData->batchVbo = vbo;
+    fontData->batchCapacity = capacity;
+    return true;
+}
+
+static gput::TextVertex* fontMapBatch(gput::FontData* fontData, u32 quads, u32* mapped) {
+    if(quads > TEXT_BATCH_MAX_QUADS) {
+        quads = TEXT_BATCH_MAX_QUADS;
+    }
+
+    u32 required = fontData->batchQuads + quads;
+    if(required > fontData->batchCapacity) {
+        // Grow to hold everything queued so far, so later frames of the same size fit without a flush.
+        u32 capacity = fontData->batchCapacity > 0 ? fontData->batchCapacity : TEXT_BATCH_MIN_QUADS;
+        while(capacity < required && capacity < TEXT_BATCH_MAX_QUADS) {
+            capacity *= 2;
+        }
+
+        if(capacity > TEXT_BATCH_MAX_QUADS) {
+            capacity = TEXT_BATCH_MAX_QUADS;
+        }
+
+        // Only a full-size buffer is rewound, once the draws queued from it have run.
+        if(required > capacity) {
+            gpu::flushCommands();
+        }
+
+        if(capacity > fontData->batchCapacity && !fontGrowBatch(fontData, capacity)) {
+            *mapped = 0;
+            return NULL;
+        }
+    }
+
+    // Anything else still queued was issued before this text.
+    gput::beginBatch((u32) fontData);
+
+    if(fontData->batchQuads == fontData->batchDrawn) {
+        std::memcpy(fontData->batchProjection, gput::getProjection(), 16 * sizeof(float));
+        std::memcpy(fontData->batchModelView, gput::getModelView(), 16 * sizeof(float));
+    }
+
+    void* data = NULL;
+    *mapped = quads;
+    gpu::mapVbo(fontData->batchVbo, fontData->batchQuads * 4 * sizeof(gput::TextVertex), quads * 4 * sizeof(gput::TextVertex), &data);
+    return (gput::TextVertex*) data;
+}
+
+static void fontUnmapBatch(gput::FontData* fontData, u32 written) {
+    gpu::unmapVbo(fontData->batchVbo);
+    fontData->batchQuads += written;
+}
+
+static void fontLayout(gput::FontData* fontData, const std::string& str, float charWidth, float charHeight, float wrapWidth, gput::TextAlign align, std::vector<gput::LayoutGlyph>* out, float* width, float* height) {
+    out->clear();
+    gput::lineWidths.clear();
+
+    const float scaleX = charWidth / fontData->nominalWidth;
+    const float scaleY = charHeight / fontData->lineHeight;
+
+    // Glyphs are placed left to right per line first; lines are stacked and aligned once their count is known.
+    u32 line = 0;
+    float penX = 0;
+    u32 breakGlyph = GLYPH_NONE;
+    float breakWidth = 0;
+    float breakX = 0;
+    u32 prev = 0;
+
+    const u32 len = str.length();
+    u32 pos = 0;
+    while(pos < len) {
+        u32 codepoint = fontNextCodepoint(str, &pos);
+        if(codepoint == '\n') {
+            gput::lineWidths.push_back(penX);
+            line++;
+            penX = 0;
+            breakGlyph = GLYPH_NONE;
+            prev = 0;
+            continue;
+        }
+
+        u32 glyphIndex = fontFindGlyph(fontData, codepoint);
+        if(glyphIndex == GLYPH_NONE) {
+            prev = codepoint;
+            continue;
+        }
+
+        const gput::Glyph* glyph = &fontData->glyphs[glyphIndex];
+        float kerning = fontKerning(fontData, prev, codepoint) * scaleX;
+        prev = codepoint;
+
+        if(wrapWidth > 0 && codepoint != ' ' && penX > 0 && penX + kerning + (glyph->xOffset + glyph->width) * scaleX > wrapWidth) {
+            if(breakGlyph != GLYPH_NONE) {
+                // Move the word after the last space down to a new line.
+                for(u32 i = breakGlyph; i < out->size(); i++) {
+                    (*out)[i].x -= breakX;
+                    (*out)[i].line = line + 1;
+                }
+
+                gput::lineWidths.push_back(breakWidth);
+                penX -= breakX;
+            } else {
+                // A single word wider than the line is broken where it overflows.
+                gput::lineWidths.push_back(penX);
+                penX = 0;
+            }
+
+            line++;
+            breakGlyph = GLYPH_NONE;
+        }
+
+        if(glyph->width != 0 && glyph->height != 0) {
+            gput::LayoutGlyph layoutGlyph;
+            layoutGlyph.glyph = glyphIndex;
+            layoutGlyph.line = line;
+            layoutGlyph.x = penX + kerning + glyph->xOffset * scaleX;
+            layoutGlyph.y = (glyph->yOffset + glyph->height) * scaleY;
+            out->push_back(layoutGlyph);
+        }
+
+        if(codepoint == ' ') {
+            breakGlyph = out->size();
+            breakWidth = penX;
+            breakX = penX + kerning + glyph->advance * scaleX;
+        }
+
+        penX += kerning + glyph->advance * scaleX;
+    }
+
+    gput::lineWidths.push_back(penX);
+
+    float maxWidth = 0;
+    for(std::vector<float>::iterator it = gput::lineWidths.begin(); it != gput::lineWidths.end(); it++) {
+        if(*it > maxWidth) {
+            maxWidth = *it;
+        }
+    }
+
+    float boxWidth = wrapWidth > 0 ? wrapWidth : maxWidth;
+    float alignFactor = align == gput::TEXT_ALIGN_CENTER ? 0.5f : align == gput::TEXT_ALIGN_RIGHT ? 1.0f : 0.0f;
+    u32 lines = gput::lineWidths.size();
+    for(std::vector<gput::LayoutGlyph>::iterator it = out->begin(); it != out->end(); it++) {
+        it->x += (boxWidth - gput::lineWidths[it->line]) * alignFactor;
+        it->y = (lines - it->line) * charHeight - it->y;
+    }
+
+    if(width != NULL) {
+        *width = maxWidth;
+    }
+
+    if(height != NULL) {
+        *height = lines * charHeight;
+    }
+}
+
+static void fontDrawGlyphs(gput::FontData* fontData, const gput::LayoutGlyph* glyphs, u32 count, float x, float y, float scaleX, float scaleY, u8 red, u8 green, u8 blue, u8 alpha) {
+    if(count == 0 || !fontPrepareAtlas(fontData)) {
+        return;
+    }
+
+    // Strings queued under other matrices have to be drawn before this one joins the batch.
+    if(fontData->batchQuads > fontData->batchDrawn && (std::memcmp(fontData->batchProjection, gput::getProjection(), 16 * sizeof(float)) != 0 || std::memcmp(fontData->batchModelView, gput::getModelView(), 16 * sizeof(float)) != 0)) {
+        gput::flushBatches();
+    }
+
+    const s16 atlasHeight = (s16) fontData->atlasHeight;
+
+    u32 mapped = 0;
+    u32 written = 0;
+    gput::TextVertex* vertices = fontMapBatch(fontData, count, &mapped);
+    if(vertices == NULL) {
+        return;
+    }
+
+    for(u32 i = 0; i < count; i++) {
+        const gput::LayoutGlyph* layoutGlyph = &glyphs[i];
+        const gput::Glyph* glyph = &fontData->glyphs[layoutGlyph->glyph];
+
+        u32 cell = written < mapped ? fontAcquireCell(fontData, layoutGlyph->glyph) : CELL_NONE;
+        if(cell == CELL_NONE) {
+            // Out of batch space, or the atlas is full of queued glyphs: run what we have and start over.
+            fontUnmapBatch(fontData, written);
+            gpu::flushCommands();
+
+            written = 0;
+            vertices = fontMapBatch(fontData, count - i, &mapped);
+            if(vertices == NULL) {
+                return;
+            }
+
+            cell = fontAcquireCell(fontData, layoutGlyph->glyph);
+        }
+
+        const s16 u1 = (s16) ((cell % fontData->cellsX) * fontData->cellWidth);
+        const s16 v2 = (s16) (atlasHeight - (cell / fontData->cellsX) * fontData->cellHeight);
+        const s16 u2 = (s16) (u1 + glyph->width);
+        const s16 v1 = (s16) (v2 - glyph->height);
+
+        const s16 x1 = (s16) (x + layoutGlyph->x);
+        const s16 y1 = (s16) (y + layoutGlyph->y);
+        const s16 x2 = (s16) (x1 + glyph->width * scaleX);
+        const s16 y2 = (s16) (y1 + glyph->height * scaleY);
+
+        const gput::TextVertex quad[4] = {
+                {x1, y1, u1, v1, red, green, blue, alpha},
+                {x2, y1, u2, v1, red, green, blue, alpha},
+                {x2, y2, u2, v2, red, green, blue, alpha},
+                {x1, y2, u1, v2, red, green, blue, alpha}
+        };
+
+        std::memcpy(&vertices[written * 4], quad, sizeof(quad));
+        written++;
+    }
+
+    fontUnmapBatch(fontData, written);
+}
+
+void ctr::gput::drawString(const std::string& str, float x, float y, float charWidth, float charHeight, u8 red, u8 green, u8 blue, u8 alpha) {
+    FontData* fontData = (FontData*) getFont();
+    if(fontData == NULL || str.empty() || fontData->lineHeight == 0 || fontData->nominalWidth == 0) {
+        return;
+    }
+
+    fontLayout(fontData, str, charWidth, charHeight, 0, TEXT_ALIGN_LEFT, &stringGlyphs, NULL, NULL);
+    fontDrawGlyphs(fontData, stringGlyphs.empty() ? NULL : &stringGlyphs[0], stringGlyphs.size(), x, y, charWidth / fontData->nominalWidth, charHeight / fontData->lineHeight, red, green, blue, alpha);
+}
+
+void ctr::gput::createTextLayout(u32* layout) {
+    if(layout == NULL) {
+        return;
+    }
+
+    TextLayoutData* layoutData = new TextLayoutData();
+    layoutData->font = 0;
+    layoutData->charWidth = 0;
+    layoutData->charHeight = 0;
+    layoutData->wrapWidth = 0;
+    layoutData->align = TEXT_ALIGN_LEFT;
+    layoutData->resolvedFont = NULL;
+    layoutData->generation = 0;
+    layoutData->scaleX = 0;
+    layoutData->scaleY = 0;
+    layoutData->width = 0;
+    layoutData->height = 0;
+
+    *layout = (u32) layoutData;
+}
+
+void ctr::gput::freeTextLayout(u32 layout) {
+    TextLayoutData* layoutData = (TextLayoutData*) layout;
+    if(layoutData == NULL) {
+        return;
+    }
+
+    delete layoutData;
+}
+
+static gput::FontData* layoutFont(gput::TextLayoutData* layoutData) {
+    gput::FontData* fontData = (gput::FontData*) (layoutData->font != 0 ? layoutData->font : gput::getFont());
+    if(fontData == NULL || fontData->lineHeight == 0 || fontData->nominalWidth == 0) {
+        return NULL;
+    }
+
+    // Only redo the layout when it was computed for another font, or the font's glyphs or metrics changed since.
+    if(layoutData->resolvedFont != fontData || layoutData->generation != fontData->generation) {
+        fontLayout(fontData, layoutData->text, layoutData->charWidth, layoutData->charHeight, layoutData->wrapWidth, layoutData->align, &layoutData->glyphs, &layoutData->width, &layoutData->height);
+        layoutData->resolvedFont = fontData;
+        layoutData->generation = fontData->generation;
+        layoutData->scaleX = layoutData->charWidth / fontData->nominalWidth;
+        layoutData->scaleY = layoutData->charHeight / fontData->lineHeight;
+    }
+
+    return fontData;
+}
+
+void ctr::gput::setTextLayout(u32 layout, const std::string& str, float charWidth, float charHeight, float wrapWidth, TextAlign align, u32 font) {
+    TextLayoutData* layoutData = (TextLayoutData*) layout;
+    if(layoutData == NULL) {
+        return;
+    }
+
+    layoutData->text = str;
+    layoutData->font = font;
+    layoutData->charWidth = charWidth;
+    layoutData->charHeight = charHeight;
+    layoutData->wrapWidth = wrapWidth;
+    layoutData->align = align;
+    layoutData->width = 0;
+    layoutData->height = 0;
+    layoutData->glyphs.clear();
+    layoutData->resolvedFont = NULL;
+    layoutFont(layoutData);
+}
+
+void ctr::gput::getTextLayoutSize(u32 layout, float* width, float* height) {
+    TextLayoutData* layoutData = (TextLayoutData*) layout;
+    if(layoutData == NULL) {
+        return;
+    }
+
+    layoutFont(layoutData);
+
+    if(width != NULL) {
+        *width = layoutData->width;
+    }
+
+    if(height != NULL) {
+        *height = layoutData->height;
+    }
+}
+
+void ctr::gput::drawTextLayout(u32 layout, float x, float y, u8 red, u8 green, u8 blue, u8 alpha) {
+    TextLayoutData* layoutData = (TextLayoutData*) layout;
+    if(layoutData == NULL) {
+        return;
+    }
+
+    FontData* fontData = layoutFont(layoutData);
+    if(fontData == NULL || layoutData->glyphs.empty()) {
+        return;
+    }
+
+    fontDrawGlyphs(fontData, &layoutData->glyphs[0], layoutData->glyphs.size(), x, y, layoutData->scaleX, layoutData->scaleY, red, green, blue, alpha);
+}
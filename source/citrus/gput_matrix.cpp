@@ -0,0 +1,502 @@
+#include "citrus/gput.hpp"
+
+#include <cmath>
+#include <cstring>
+
+#if defined(__SSE__) && !defined(_3DS) && !defined(CITRUS_NO_SIMD)
+#define MATRIX_SSE
+#include <xmmintrin.h>
+#endif
+
+// Matrices are row-major with column vectors; multMatrix(out, m1, m2) computes m2 * m1.
+// This file has no console dependencies so it can be built on the host for benchmarking.
+
+namespace ctr {
+    namespace gput {
+        static u32 culledObjects = 0;
+        static u32 visibleObjects = 0;
+
+        static inline bool isAffine(const float* m) {
+            return m[12] == 0.0f && m[13] == 0.0f && m[14] == 0.0f && m[15] == 1.0f;
+        }
+    }
+}
+
+void ctr::gput::multMatrix(float* out, const float* m1, const float* m2) {
+    if(out == NULL || m1 == NULL || m2 == NULL) {
+        return;
+    }
+
+#ifdef MATRIX_SSE
+    __m128 row0 = _mm_loadu_ps(&m1[0]);
+    __m128 row1 = _mm_loadu_ps(&m1[4]);
+    __m128 row2 = _mm_loadu_ps(&m1[8]);
+    __m128 row3 = _mm_loadu_ps(&m1[12]);
+
+    __m128 result[4];
+    for(u32 r = 0; r < 4; r++) {
+        const float* m = &m2[r * 4];
+        result[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[0]), row0), _mm_mul_ps(_mm_set1_ps(m[1]), row1)), _mm_add_ps(_mm_mul_ps(_mm_set1_ps(m[2]), row2), _mm_mul_ps(_mm_set1_ps(m[3]), row3)));
+    }
+
+    for(u32 r = 0; r < 4; r++) {
+        _mm_storeu_ps(&out[r * 4], result[r]);
+    }
+#else
+    if(isAffine(m1) && isAffine(m2)) {
+        multMatrixAffine(out, m1, m2);
+        return;
+    }
+
+    // Accumulate into locals first so out may alias either input.
+    float result[16];
+    for(u32 r = 0; r < 4; r++) {
+        const float a0 = m2[r * 4 + 0];
+        const float a1 = m2[r * 4 + 1];
+        const float a2 = m2[r * 4 + 2];
+        const float a3 = m2[r * 4 + 3];
+
+        result[r * 4 + 0] = a0 * m1[0] + a1 * m1[4] + a2 * m1[8] + a3 * m1[12];
+        result[r * 4 + 1] = a0 * m1[1] + a1 * m1[5] + a2 * m1[9] + a3 * m1[13];
+        result[r * 4 + 2] = a0 * m1[2] + a1 * m1[6] + a2 * m1[10] + a3 * m1[14];
+        result[r * 4 + 3] = a0 * m1[3] + a1 * m1[7] + a2 * m1[11] + a3 * m1[15];
+    }
+
+    std::memcpy(out, result, sizeof(result));
+#endif
+}
+
+void ctr::gput::multMatrixAffine(float* out, const float* m1, const float* m2) {
+    if(out == NULL || m1 == NULL || m2 == NULL) {
+        return;
+    }
+
+    // Both bottom rows are (0, 0, 0, 1), so only the upper 3x4 block needs computing.
+    float result[12];
+    for(u32 r = 0; r < 3; r++) {
+        const float a0 = m2[r * 4 + 0];
+        const float a1 = m2[r * 4 + 1];
+        const float a2 = m2[r * 4 + 2];
+
+        result[r * 4 + 0] = a0 * m1[0] + a1 * m1[4] + a2 * m1[8];
+        result[r * 4 + 1] = a0 * m1[1] + a1 * m1[5] + a2 * m1[9];
+        result[r * 4 + 2] = a0 * m1[2] + a1 * m1[6] + a2 * m1[10];
+        result[r * 4 + 3] = a0 * m1[3] + a1 * m1[7] + a2 * m1[11] + m2[r * 4 + 3];
+    }
+
+    std::memcpy(out, result, sizeof(result));
+    out[12] = 0.0f;
+    out[13] = 0.0f;
+    out[14] = 0.0f;
+    out[15] = 1.0f;
+}
+
+void ctr::gput::setIdentityMatrix(float* out) {
+    if(out == NULL) {
+        return;
+    }
+
+    memset(out, 0x00, 16 * sizeof(float));
+    out[0] = 1.0f;
+    out[5] = 1.0f;
+    out[10] = 1.0f;
+    out[15] = 1.0f;
+}
+
+void ctr::gput::setOrthoMatrix(float* out, float left, float right, float bottom, float top, float near, float far) {
+    float orthoMatrix[16];
+
+    orthoMatrix[0] = 2.0f / (right - left);
+    orthoMatrix[1] = 0.0f;
+    orthoMatrix[2] = 0.0f;
+    orthoMatrix[3] = -((right + left) / (right - left));
+
+    orthoMatrix[4] = 0.0f;
+    orthoMatrix[5] = 2.0f / (top - bottom);
+    orthoMatrix[6] = 0.0f;
+    orthoMatrix[7] = -((top + bottom) / (top - bottom));
+
+    orthoMatrix[8] = 0.0f;
+    orthoMatrix[9] = 0.0f;
+    orthoMatrix[10] = 2.0f / (far - near);
+    orthoMatrix[11] = -((far + near) / (far - near));
+
+    orthoMatrix[12] = 0.0f;
+    orthoMatrix[13] = 0.0f;
+    orthoMatrix[14] = 0.0f;
+    orthoMatrix[15] = 1.0f;
+
+    float correction[16];
+    setRotationMatrixZ(correction, (float) M_PI / 2.0f);
+
+    multMatrix(out, orthoMatrix, correction);
+}
+
+void ctr::gput::setPerspectiveMatrix(float* out, float fovy, float aspect, float near, float far) {
+    float top = near * std::tan(fovy / 2);
+    float right = top * aspect;
+
+    float projectionMatrix[16];
+
+    projectionMatrix[0] = near / right;
+    projectionMatrix[1] = 0.0f;
+    projectionMatrix[2] = 0.0f;
+    projectionMatrix[3] = 0.0f;
+
+    projectionMatrix[4] = 0.0f;
+    projectionMatrix[5] = near / top;
+    projectionMatrix[6] = 0.0f;
+    projectionMatrix[7] = 0.0f;
+
+    projectionMatrix[8] = 0.0f;
+    projectionMatrix[9] = 0.0f;
+    projectionMatrix[10] = -(far + near) / (far - near);
+    projectionMatrix[11] = -2.0f * (far * near) / (far - near);
+
+    projectionMatrix[12] = 0.0f;
+    projectionMatrix[13] = 0.0f;
+    projectionMatrix[14] = -1.0f;
+    projectionMatrix[15] = 0.0f;
+
+    float correction[16];
+    setIdentityMatrix(correction);
+    correction[10] = 0.5f;
+    correction[11] = -0.5f;
+
+    multMatrix(out, correction, projectionMatrix);
+}
+
+void ctr::gput::setTranslationMatrix(float* out, float x, float y, float z) {
+    if(out == NULL) {
+        return;
+    }
+
+    setIdentityMatrix(out);
+    out[3] = x;
+    out[7] = y;
+    out[11] = z;
+}
+
+void ctr::gput::setRotationMatrixX(float* out, float rotation) {
+    if(out == NULL) {
+        return;
+    }
+
+    const float c = std::cos(rotation);
+    const float s = std::sin(rotation);
+
+    memset(out, 0x00, 16 * sizeof(float));
+
+    out[0] = 1.0f;
+    out[5] = c;
+    out[6] = s;
+    out[9] = -s;
+    out[10] = c;
+    out[15] = 1.0f;
+}
+
+void ctr::gput::setRotationMatrixY(float* out, float rotation) {
+    if(out == NULL) {
+        return;
+    }
+
+    const float c = std::cos(rotation);
+    const float s = std::sin(rotation);
+
+    memset(out, 0x00, 16 * sizeof(float));
+
+    out[0] = c;
+    out[2] = s;
+    out[5] = 1.0f;
+    out[8] = -s;
+    out[10] = c;
+    out[15] = 1.0f;
+}
+
+void ctr::gput::setRotationMatrixZ(float* out, float rotation) {
+    if(out == NULL) {
+        return;
+    }
+
+    const float c = std::cos(rotation);
+    const float s = std::sin(rotation);
+
+    memset(out, 0x00, 16 * sizeof(float));
+
+    out[0] = c;
+    out[1] = s;
+    out[4] = -s;
+    out[5] = c;
+    out[10] = 1.0f;
+    out[15] = 1.0f;
+}
+
+void ctr::gput::setRotationMatrix(float* out, float x, float y, float z) {
+    if(out == NULL) {
+        return;
+    }
+
+    // Closed form of Z * Y * X using the single-axis matrices above.
+    const float cx = std::cos(x);
+    const float sx = std::sin(x);
+    const float cy = std::cos(y);
+    const float sy = std::sin(y);
+    const float cz = std::cos(z);
+    const float sz = std::sin(z);
+
+    out[0] = cz * cy;
+    out[1] = sz * cx - cz * sy * sx;
+    out[2] = sz * sx + cz * sy * cx;
+    out[3] = 0.0f;
+
+    out[4] = -sz * cy;
+    out[5] = cz * cx + sz * sy * sx;
+    out[6] = cz * sx - sz * sy * cx;
+    out[7] = 0.0f;
+
+    out[8] = -sy;
+    out[9] = -cy * sx;
+    out[10] = cy * cx;
+    out[11] = 0.0f;
+
+    out[12] = 0.0f;
+    out[13] = 0.0f;
+    out[14] = 0.0f;
+    out[15] = 1.0f;
+}
+
+void ctr::gput::setScaleMatrix(float* matrix, float x, float y, float z) {
+    matrix[0] *= x;
+    matrix[4] *= x;
+    matrix[8] *= x;
+    matrix[12] *= x;
+
+    matrix[1] *= y;
+    matrix[5] *= y;
+    matrix[9] *= y;
+    matrix[13] *= y;
+
+    matrix[2] *= z;
+    matrix[6] *= z;
+    matrix[10] *= z;
+    matrix[14] *= z;
+}
+
+void ctr::gput::setTransformMatrix(float* out, float tx, float ty, float tz, float rx, float ry, float rz, float sx, float sy, float sz) {
+    if(out == NULL) {
+        return;
+    }
+
+    // Same result as translate, rotate and scale applied in that order to an identity modelview.
+    float rotation[16];
+    setRotationMatrix(rotation, rx, ry, rz);
+
+    out[0] = rotation[0] * sx;
+    out[1] = rotation[1] * sy;
+    out[2] = rotation[2] * sz;
+    out[3] = rotation[0] * tx + rotation[1] * ty + rotation[2] * tz;
+
+    out[4] = rotation[4] * sx;
+    out[5] = rotation[5] * sy;
+    out[6] = rotation[6] * sz;
+    out[7] = rotation[4] * tx + rotation[5] * ty + rotation[6] * tz;
+
+    out[8] = rotation[8] * sx;
+    out[9] = rotation[9] * sy;
+    out[10] = rotation[10] * sz;
+    out[11] = rotation[8] * tx + rotation[9] * ty + rotation[10] * tz;
+
+    out[12] = 0.0f;
+    out[13] = 0.0f;
+    out[14] = 0.0f;
+    out[15] = 1.0f;
+}
+
+void ctr::gput::setLocalTransformMatrix(float* out, float tx, float ty, float tz, float rx, float ry, float rz, float sx, float sy, float sz) {
+    if(out == NULL) {
+        return;
+    }
+
+    // Scale, then rotate, then translate in the parent's space: T * R * S, so the translation is not rotated.
+    float rotation[16];
+    setRotationMatrix(rotation, rx, ry, rz);
+
+    out[0] = rotation[0] * sx;
+    out[1] = rotation[1] * sy;
+    out[2] = rotation[2] * sz;
+    out[3] = tx;
+
+    out[4] = rotation[4] * sx;
+    out[5] = rotation[5] * sy;
+    out[6] = rotation[6] * sz;
+    out[7] = ty;
+
+    out[8] = rotation[8] * sx;
+    out[9] = rotation[9] * sy;
+    out[10] = rotation[10] * sz;
+    out[11] = tz;
+
+    out[12] = 0.0f;
+    out[13] = 0.0f;
+    out[14] = 0.0f;
+    out[15] = 1.0f;
+}
+
+void ctr::gput::transformPoints(const float* matrix, const float* in, float* out, u32 count) {
+    if(matrix == NULL || in == NULL || out == NULL) {
+        return;
+    }
+
+    // Points are packed xyz triples with an implied w of 1; the projective row is ignored.
+    const float m0 = matrix[0], m1 = matrix[1], m2 = matrix[2], m3 = matrix[3];
+    const float m4 = matrix[4], m5 = matrix[5], m6 = matrix[6], m7 = matrix[7];
+    const float m8 = matrix[8], m9 = matrix[9], m10 = matrix[10], m11 = matrix[11];
+    for(u32 i = 0; i < count; i++) {
+        const float x = in[i * 3 + 0];
+        const float y = in[i * 3 + 1];
+        const float z = in[i * 3 + 2];
+
+        out[i * 3 + 0] = m0 * x + m1 * y + m2 * z + m3;
+        out[i * 3 + 1] = m4 * x + m5 * y + m6 * z + m7;
+        out[i * 3 + 2] = m8 * x + m9 * y + m10 * z + m11;
+    }
+}
+
+void ctr::gput::extractFrustum(Frustum* out, const float* matrix) {
+    if(out == NULL || matrix == NULL) {
+        return;
+    }
+
+    // The PICA clips to -w <= x, y <= w and -w <= z <= 0.
+    const float* r0 = &matrix[0];
+    const float* r1 = &matrix[4];
+    const float* r2 = &matrix[8];
+    const float* r3 = &matrix[12];
+    for(u32 i = 0; i < 4; i++) {
+        out->planes[0][i] = r3[i] + r0[i];
+        out->planes[1][i] = r3[i] - r0[i];
+        out->planes[2][i] = r3[i] + r1[i];
+        out->planes[3][i] = r3[i] - r1[i];
+        out->planes[4][i] = r3[i] + r2[i];
+        out->planes[5][i] = -r2[i];
+    }
+
+    for(u32 p = 0; p < 6; p++) {
+        float* plane = out->planes[p];
+        float length = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        if(length > 0.0f) {
+            float inv = 1.0f / length;
+            plane[0] *= inv;
+            plane[1] *= inv;
+            plane[2] *= inv;
+            plane[3] *= inv;
+        }
+    }
+}
+
+bool ctr::gput::sphereVisible(const Frustum* frustum, const BoundingSphere* sphere) {
+    if(frustum == NULL || sphere == NULL) {
+        return true;
+    }
+
+    for(u32 p = 0; p < 6; p++) {
+        const float* plane = frustum->planes[p];
+        if(plane[0] * sphere->x + plane[1] * sphere->y + plane[2] * sphere->z + plane[3] < -sphere->radius) {
+            culledObjects++;
+            return false;
+        }
+    }
+
+    visibleObjects++;
+    return true;
+}
+
+bool ctr::gput::boxVisible(const Frustum* frustum, const BoundingBox* box) {
+    if(frustum == NULL || box == NULL) {
+        return true;
+    }
+
+    // Test the corner furthest along each plane normal.
+    for(u32 p = 0; p < 6; p++) {
+        const float* plane = frustum->planes[p];
+        float x = plane[0] >= 0 ? box->maxX : box->minX;
+        float y = plane[1] >= 0 ? box->maxY : box->minY;
+        float z = plane[2] >= 0 ? box->maxZ : box->minZ;
+        if(plane[0] * x + plane[1] * y + plane[2] * z + plane[3] < 0) {
+            culledObjects++;
+            return false;
+        }
+    }
+
+    visibleObjects++;
+    return true;
+}
+
+u32 ctr::gput::cullSpheres(const Frustum* frustum, const BoundingSphere* spheres, u32 count, u8* visible) {
+    if(frustum == NULL || spheres == NULL || visible == NULL) {
+        return 0;
+    }
+
+    // Keep the planes in locals so the loop only streams the sphere array.
+    float planes[6][4];
+    std::memcpy(planes, frustum->planes, sizeof(planes));
+
+    u32 visibleCount = 0;
+    for(u32 i = 0; i < count; i++) {
+        const BoundingSphere& sphere = spheres[i];
+        bool inside = true;
+        for(u32 p = 0; p < 6 && inside; p++) {
+            inside = planes[p][0] * sphere.x + planes[p][1] * sphere.y + planes[p][2] * sphere.z + planes[p][3] >= -sphere.radius;
+        }
+
+        visible[i] = inside;
+        visibleCount += inside;
+    }
+
+    culledObjects += count - visibleCount;
+    visibleObjects += visibleCount;
+    return visibleCount;
+}
+
+u32 ctr::gput::cullBoxes(const Frustum* frustum, const BoundingBox* boxes, u32 count, u8* visible) {
+    if(frustum == NULL || boxes == NULL || visible == NULL) {
+        return 0;
+    }
+
+    float planes[6][4];
+    std::memcpy(planes, frustum->planes, sizeof(planes));
+
+    u32 visibleCount = 0;
+    for(u32 i = 0; i < count; i++) {
+        const BoundingBox& box = boxes[i];
+        bool inside = true;
+        for(u32 p = 0; p < 6 && inside; p++) {
+            float x = planes[p][0] >= 0 ? box.maxX : box.minX;
+            float y = planes[p][1] >= 0 ? box.maxY : box.minY;
+            float z = planes[p][2] >= 0 ? box.maxZ : box.minZ;
+            inside = planes[p][0] * x + planes[p][1] * y + planes[p][2] * z + planes[p][3] >= 0;
+        }
+
+        visible[i] = inside;
+        visibleCount += inside;
+    }
+
+    culledObjects += count - visibleCount;
+    visibleObjects += visibleCount;
+    return visibleCount;
+}
+
+void ctr::gput::getCullStats(u32* culled, u32* visible) {
+    if(culled != NULL) {
+        *culled = culledObjects;
+    }
+
+    if(visible != NULL) {
+        *visible = visibleObjects;
+    }
+}
+
+void ctr::gput::resetCullStats() {
+    culledObjects = 0;
+    visibleObjects = 0;
+}
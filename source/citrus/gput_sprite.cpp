@@ -0,0 +1,338 @@
+#include "citrus/gput.hpp"
+#include "citrus/gpu.hpp"
+#include "internal.hpp"
+
+#include <cmath>
+#include <cstring>
+
+#include <3ds.h>
+
+#define SPRITE_MIN_VERTICES 1024
+#define SPRITE_MAX_VERTICES 0x10000
+
+#define CIRCLE_MIN_SEGMENTS 12
+#define CIRCLE_MAX_SEGMENTS 64
+
+using namespace ctr;
+
+namespace ctr {
+    namespace gput {
+        typedef struct {
+            float x;
+            float y;
+            float u;
+            float v;
+            u8 r;
+            u8 g;
+            u8 b;
+            u8 a;
+        } SpriteVertex;
+
+        static u32 spriteVbo = 0;
+        static u32 whiteTexture = 0;
+
+        static u32 spriteVertexCapacity = 0;
+        static u32 spriteIndexCapacity = 0;
+        static u32 spriteVertices = 0;
+        static u32 spriteIndices = 0;
+
+        // The run is the span of the stream since the last draw, sharing one texture and set of matrices.
+        static u32 runVertexStart = 0;
+        static u32 runIndexStart = 0;
+        static u32 runTexture = 0;
+        static float runProjection[16];
+        static float runModelView[16];
+    }
+}
+
+bool ctr::gput::initSprites() {
+    // Untextured shapes sample a white texture so they can share the batch shader and combiner setup.
+    u32 white[64];
+    std::memset(white, 0xFF, sizeof(white));
+    gpu::createTexture(&whiteTexture);
+    gpu::setTextureInfo(whiteTexture, 8, 8, gpu::PIXEL_RGBA8, gpu::textureMinFilter(gpu::FILTER_NEAREST) | gpu::textureMagFilter(gpu::FILTER_NEAREST));
+    gpu::setTextureSubData(whiteTexture, 0, 0, 8, 8, white);
+    return true;
+}
+
+void ctr::gput::exitSprites() {
+    if(spriteVbo != 0) {
+        gpu::freeVbo(spriteVbo);
+        spriteVbo = 0;
+    }
+
+    if(whiteTexture != 0) {
+        gpu::freeTexture(whiteTexture);
+        whiteTexture = 0;
+    }
+
+    spriteVertexCapacity = 0;
+    spriteIndexCapacity = 0;
+    spriteVertices = 0;
+    spriteIndices = 0;
+    runVertexStart = 0;
+    runIndexStart = 0;
+}
+
+void ctr::gput::flushSpriteBatch() {
+    if(spriteIndices == runIndexStart) {
+        return;
+    }
+
+    gpu::unmapVbo(spriteVbo);
+    gpu::unmapVboIndices(spriteVbo);
+
+    u32 oldShader = 0;
+    u32 oldTexture = 0;
+    gpu::getShader(&oldShader);
+    gpu::getBoundTexture(gpu::TEXUNIT0, &oldTexture);
+
+    float oldProjection[16];
+    float oldModelView[16];
+    std::memcpy(oldProjection, getProjection(), 16 * sizeof(float));
+    std::memcpy(oldModelView, getModelView(), 16 * sizeof(float));
+    setProjection(runProjection);
+    setModelView(runModelView);
+
+    useBatchShader(1, 1);
+    gpu::bindTexture(gpu::TEXUNIT0, runTexture);
+    gpu::drawVboRange(spriteVbo, runIndexStart, spriteIndices - runIndexStart);
+
+    setProjection(oldProjection);
+    setModelView(oldModelView);
+    gpu::bindTexture(gpu::TEXUNIT0, oldTexture);
+    gpu::useShader(oldShader);
+
+    runVertexStart = spriteVertices;
+    runIndexStart = spriteIndices;
+}
+
+void ctr::gput::releaseSprites() {
+    // The GPU is idle, so the whole stream can be rewritten from the start.
+    spriteVertices = 0;
+    spriteIndices = 0;
+    runVertexStart = 0;
+    runIndexStart = 0;
+}
+
+static bool spriteGrowStream(u32 capacity) {
+    u32 vbo = 0;
+    gpu::createVbo(&vbo);
+    gpu::setVboAttributes(vbo, gpu::vboAttribute(0, 2, gpu::ATTR_FLOAT) | gpu::vboAttribute(1, 2, gpu::ATTR_FLOAT) | gpu::vboAttribute(2, 4, gpu::ATTR_UNSIGNED_BYTE), 3);
+    gpu::setVboDataInfo(vbo, capacity, gpu::PRIM_TRIANGLES);
+    gpu::setVboIndicesInfo(vbo, capacity * 2 * sizeof(u16));
+
+    void* data = NULL;
+    void* indexData = NULL;
+    gpu::getVboData(vbo, &data);
+    gpu::getVboIndices(vbo, &indexData);
+    if(data == NULL || indexData == NULL) {
+        gpu::freeVbo(vbo);
+        return false;
+    }
+
+    // Everything in the old stream has been drawn, but those draws may not have run yet.
+    if(gput::spriteVbo != 0) {
+        gput::retireVbo(gput::spriteVbo);
+    }
+
+    gput::spriteVbo = vbo;
+    gput::spriteVertexCapacity = capacity;
+    gput::spriteIndexCapacity = capacity * 2;
+    gput::spriteVertices = 0;
+    gput::spriteIndices = 0;
+    gput::runVertexStart = 0;
+    gput::runIndexStart = 0;
+    return true;
+}
+
+static bool spriteBegin(u32 texture, u32 vertexCount, u32 indexCount, gput::SpriteVertex** vertices, u16** indices, u16* base) {
+    if(vertexCount > SPRITE_MAX_VERTICES || indexCount > SPRITE_MAX_VERTICES * 2) {
+        return false;
+    }
+
+    if(gput::spriteIndices > gput::runIndexStart && (texture != gput::runTexture || std::memcmp(gput::runProjection, gput::getProjection(), 16 * sizeof(float)) != 0 || std::memcmp(gput::runModelView, gput::getModelView(), 16 * sizeof(float)) != 0)) {
+        gput::flushBatches();
+    }
+
+    u32 requiredVertices = gput::spriteVertices + vertexCount;
+    u32 requiredIndices = gput::spriteIndices + indexCount;
+    if(requiredVertices > gput::spriteVertexCapacity || requiredIndices > gput::spriteIndexCapacity) {
+        // Grow to hold everything queued so far, so later frames of the same size fit without a flush.
+        u32 capacity = gput::spriteVertexCapacity > 0 ? gput::spriteVertexCapacity : SPRITE_MIN_VERTICES;
+        while((capacity < requiredVertices || capacity * 2 < requiredIndices) && capacity < SPRITE_MAX_VERTICES) {
+            capacity *= 2;
+        }
+
+        if(capacity > SPRITE_MAX_VERTICES) {
+            capacity = SPRITE_MAX_VERTICES;
+        }
+
+        // The run so far is drawn from the old stream, whether that stream is rewound or replaced.
+        gput::flushBatches();
+
+        // Only a full-size stream is rewound, once the draws queued from it have run.
+        if(requiredVertices > capacity || requiredIndices > capacity * 2) {
+            gpu::flushCommands();
+        }
+
+        if(capacity > gput::spriteVertexCapacity && !spriteGrowStream(capacity)) {
+            return false;
+        }
+    }
+
+    if(gput::spriteIndices == gput::runIndexStart) {
+        // Text queued before this run has to be drawn under it.
+        gput::beginBatch(gput::spriteVbo);
+
+        gput::runTexture = texture;
+        std::memcpy(gput::runProjection, gput::getProjection(), 16 * sizeof(float));
+        std::memcpy(gput::runModelView, gput::getModelView(), 16 * sizeof(float));
+    }
+
+    // The mappings span the whole run, so the flush that draws it writes back exactly what it wrote.
+    void* data = NULL;
+    void* indexData = NULL;
+    gpu::mapVbo(gput::spriteVbo, gput::runVertexStart * sizeof(gput::SpriteVertex), (gput::spriteVertices + vertexCount - gput::runVertexStart) * sizeof(gput::SpriteVertex), &data);
+    gpu::mapVboIndices(gput::spriteVbo, gput::runIndexStart * sizeof(u16), (gput::spriteIndices + indexCount - gput::runIndexStart) * sizeof(u16), &indexData);
+    if(data == NULL || indexData == NULL) {
+        return false;
+    }
+
+    *vertices = (gput::SpriteVertex*) data + (gput::spriteVertices - gput::runVertexStart);
+    *indices = (u16*) indexData + (gput::spriteIndices - gput::runIndexStart);
+    *base = (u16) gput::spriteVertices;
+
+    gput::spriteVertices += vertexCount;
+    gput::spriteIndices += indexCount;
+    return true;
+}
+
+static void spriteQuad(u32 texture, const float* positions, float u1, float v1, float u2, float v2, u8 red, u8 green, u8 blue, u8 alpha) {
+    gput::SpriteVertex* vertices;
+    u16* indices;
+    u16 base;
+    if(!spriteBegin(texture, 4, 6, &vertices, &indices, &base)) {
+        return;
+    }
+
+    // Corners run counter-clockwise from the bottom left.
+    const float texCoords[8] = {u1, v1, u2, v1, u2, v2, u1, v2};
+    for(u32 i = 0; i < 4; i++) {
+        gput::SpriteVertex* vertex = &vertices[i];
+        vertex->x = positions[i * 2 + 0];
+        vertex->y = positions[i * 2 + 1];
+        vertex->u = texCoords[i * 2 + 0];
+        vertex->v = texCoords[i * 2 + 1];
+        vertex->r = red;
+        vertex->g = green;
+        vertex->b = blue;
+        vertex->a = alpha;
+    }
+
+    indices[0] = base;
+    indices[1] = (u16) (base + 1);
+    indices[2] = (u16) (base + 2);
+    indices[3] = (u16) (base + 2);
+    indices[4] = (u16) (base + 3);
+    indices[5] = base;
+}
+
+void ctr::gput::drawRect(float x, float y, float width, float height, u8 red, u8 green, u8 blue, u8 alpha) {
+    const float positions[8] = {x, y, x + width, y, x + width, y + height, x, y + height};
+    spriteQuad(whiteTexture, positions, 0, 0, 1, 1, red, green, blue, alpha);
+}
+
+void ctr::gput::drawLine(float x1, float y1, float x2, float y2, float thickness, u8 red, u8 green, u8 blue, u8 alpha) {
+    float dx = x2 - x1;
+    float dy = y2 - y1;
+    float length = std::sqrt(dx * dx + dy * dy);
+    if(length == 0) {
+        return;
+    }
+
+    // Offset both ends by half the thickness along the line's normal.
+    float nx = -dy / length * thickness * 0.5f;
+    float ny = dx / length * thickness * 0.5f;
+
+    const float positions[8] = {x1 - nx, y1 - ny, x2 - nx, y2 - ny, x2 + nx, y2 + ny, x1 + nx, y1 + ny};
+    spriteQuad(whiteTexture, positions, 0, 0, 1, 1, red, green, blue, alpha);
+}
+
+void ctr::gput::drawCircle(float x, float y, float radius, u8 red, u8 green, u8 blue, u8 alpha, u32 segments) {
+    if(radius <= 0) {
+        return;
+    }
+
+    if(segments == 0) {
+        segments = (u32) (radius * 0.75f);
+    }
+
+    if(segments < CIRCLE_MIN_SEGMENTS) {
+        segments = CIRCLE_MIN_SEGMENTS;
+    } else if(segments > CIRCLE_MAX_SEGMENTS) {
+        segments = CIRCLE_MAX_SEGMENTS;
+    }
+
+    SpriteVertex* vertices;
+    u16* indices;
+    u16 base;
+    if(!spriteBegin(whiteTexture, segments + 1, segments * 3, &vertices, &indices, &base)) {
+        return;
+    }
+
+    // A fan around the center, written as a triangle list so it can share the stream.
+    const float step = 2.0f * (float) M_PI / segments;
+    for(u32 i = 0; i <= segments; i++) {
+        SpriteVertex* vertex = &vertices[i];
+        if(i == 0) {
+            vertex->x = x;
+            vertex->y = y;
+        } else {
+            vertex->x = x + std::cos(step * (i - 1)) * radius;
+            vertex->y = y + std::sin(step * (i - 1)) * radius;
+        }
+
+        vertex->u = 0;
+        vertex->v = 0;
+        vertex->r = red;
+        vertex->g = green;
+        vertex->b = blue;
+        vertex->a = alpha;
+    }
+
+    for(u32 i = 0; i < segments; i++) {
+        indices[i * 3 + 0] = base;
+        indices[i * 3 + 1] = (u16) (base + 1 + i);
+        indices[i * 3 + 2] = (u16) (base + 1 + (i + 1) % segments);
+    }
+}
+
+void ctr::gput::drawSprite(u32 texture, float x, float y, float width, float height, float u1, float v1, float u2, float v2, float rotation, u8 red, u8 green, u8 blue, u8 alpha) {
+    if(texture == 0) {
+        return;
+    }
+
+    if(rotation == 0) {
+        const float positions[8] = {x, y, x + width, y, x + width, y + height, x, y + height};
+        spriteQuad(texture, positions, u1, v1, u2, v2, red, green, blue, alpha);
+        return;
+    }
+
+    // Rotate the corners around the sprite's center.
+    float c = std::cos(rotation);
+    float s = std::sin(rotation);
+    float cx = x + width * 0.5f;
+    float cy = y + height * 0.5f;
+    float hw = width * 0.5f;
+    float hh = height * 0.5f;
+
+    const float corners[8] = {-hw, -hh, hw, -hh, hw, hh, -hw, hh};
+    float positions[8];
+    for(u32 i = 0; i < 4; i++) {
+        positions[i * 2 + 0] = cx + corners[i * 2 + 0] * c - corners[i * 2 + 1] * s;
+        positions[i * 2 + 1] = cy + corners[i * 2 + 0] * s + corners[i * 2 + 1] * c;
+    }
+
+    spriteQuad(texture, positions, u1, v1, u2, v2, red, green, blue, alpha);
+}
@@ -0,0 +1,387 @@
+#include "citrus/core.hpp"
+#include "citrus/gput.hpp"
+#include "citrus/gpu.hpp"
+#include "internal.hpp"
+
+#include <vector>
+
+#include <3ds.h>
+
+#define TILEMAP_CHUNK_SIZE 16
+#define TILEMAP_MAX_CHUNK_SIZE 128
+
+#define ANIMATION_NONE 0xFFFFFFFF
+
+using namespace ctr;
+
+namespace ctr {
+    namespace gput {
+        typedef struct {
+            float x;
+            float y;
+            s16 u;
+            s16 v;
+            u8 r;
+            u8 g;
+            u8 b;
+            u8 a;
+        } TileVertex;
+
+        typedef struct {
+            u16 tile;
+            u32 frames;
+            u32 frameTime;
+        } TileAnimation;
+
+        typedef struct {
+            u32 animation;
+            u32 firstQuad;
+            u32 quads;
+        } ChunkRange;
+
+        typedef struct {
+            u32 vbo;
+            bool dirty;
+            u32 drawnFrame;
+            std::vector<ChunkRange> ranges;
+        } TilemapChunk;
+
+        typedef struct {
+            u32 width;
+            u32 height;
+            u32 tileWidth;
+            u32 tileHeight;
+            u32 chunkSize;
+            u32 chunksX;
+            u32 chunksY;
+
+            u32 texture;
+            u32 textureWidth;
+            u32 textureHeight;
+
+            std::vector<u16> tiles;
+            std::vector<TilemapChunk> chunks;
+            std::vector<TileAnimation> animations;
+        } TilemapData;
+
+        // Advances every time the GPU finishes a frame; chunks drawn in the current frame may not be rebuilt in place.
+        static u32 tilemapFrame = 1;
+
+        static std::vector<TileVertex> bakeVertices;
+        static std::vector<u16> bakeIndices;
+    }
+}
+
+static void tilemapInvalidate(gput::TilemapData* tilemapData) {
+    for(std::vector<gput::TilemapChunk>::iterator it = tilemapData->chunks.begin(); it != tilemapData->chunks.end(); it++) {
+        (*it).dirty = true;
+    }
+}
+
+static u32 tilemapFindAnimation(gput::TilemapData* tilemapData, u16 tile) {
+    for(u32 i = 0; i < tilemapData->animations.size(); i++) {
+        if(tilemapData->animations[i].tile == tile) {
+            return i;
+        }
+    }
+
+    return ANIMATION_NONE;
+}
+
+static void tilemapBakeChunk(gput::TilemapData* tilemapData, u32 chunkX, u32 chunkY) {
+    gput::TilemapChunk* chunk = &tilemapData->chunks[chunkY * tilemapData->chunksX + chunkX];
+    chunk->dirty = false;
+    chunk->ranges.clear();
+
+    // The GPU may still read a chunk drawn earlier this frame.
+    if(chunk->drawnFrame == gput::tilemapFrame) {
+        gpu::flushCommands();
+    }
+
+    u32 startX = chunkX * tilemapData->chunkSize;
+    u32 startY = chunkY * tilemapData->chunkSize;
+    u32 endX = startX + tilemapData->chunkSize < tilemapData->width ? startX + tilemapData->chunkSize : tilemapData->width;
+    u32 endY = startY + tilemapData->chunkSize < tilemapData->height ? startY + tilemapData->chunkSize : tilemapData->height;
+    u32 columns = tilemapData->textureWidth / tilemapData->tileWidth;
+
+    gput::bakeVertices.clear();
+
+    // Static tiles are written first, then each animation's tiles as their own range so it can be drawn with its frame offset.
+    for(u32 pass = 0; pass <= tilemapData->animations.size(); pass++) {
+        u32 animation = pass == 0 ? ANIMATION_NONE : pass - 1;
+        u32 firstQuad = gput::bakeVertices.size() / 4;
+        for(u32 y = startY; y < endY; y++) {
+            for(u32 x = startX; x < endX; x++) {
+                u16 tile = tilemapData->tiles[y * tilemapData->width + x];
+                if(tile == 0 || (u32) (tile - 1) >= columns * (tilemapData->textureHeight / tilemapData->tileHeight) || tilemapFindAnimation(tilemapData, tile) != animation) {
+                    continue;
+                }
+
+                // Row 0 is the top of the map; positions are relative to its bottom left corner.
+                float left = x * tilemapData->tileWidth;
+                float bottom = (tilemapData->height - 1 - y) * tilemapData->tileHeight;
+                float right = left + tilemapData->tileWidth;
+                float top = bottom + tilemapData->tileHeight;
+
+                s16 u1 = (s16) (((tile - 1) % columns) * tilemapData->tileWidth);
+                s16 u2 = (s16) (u1 + tilemapData->tileWidth);
+                s16 v2 = (s16) (tilemapData->textureHeight - ((tile - 1) / columns) * tilemapData->tileHeight);
+                s16 v1 = (s16) (v2 - tilemapData->tileHeight);
+
+                gput::TileVertex corners[4] = {
+                    {left, bottom, u1, v1, 0xFF, 0xFF, 0xFF, 0xFF},
+                    {right, bottom, u2, v1, 0xFF, 0xFF, 0xFF, 0xFF},
+                    {right, top, u2, v2, 0xFF, 0xFF, 0xFF, 0xFF},
+                    {left, top, u1, v2, 0xFF, 0xFF, 0xFF, 0xFF}
+                };
+
+                gput::bakeVertices.insert(gput::bakeVertices.end(), corners, corners + 4);
+            }
+        }
+
+        u32 quads = gput::bakeVertices.size() / 4 - firstQuad;
+        if(quads > 0) {
+            gput::ChunkRange range;
+            range.animation = animation;
+            range.firstQuad = firstQuad;
+            range.quads = quads;
+            chunk->ranges.push_back(range);
+        }
+    }
+
+    u32 quads = gput::bakeVertices.size() / 4;
+    if(quads == 0) {
+        return;
+    }
+
+    if(chunk->vbo == 0) {
+        gpu::createVbo(&chunk->vbo);
+        gpu::setVboAttributes(chunk->vbo, gpu::vboAttribute(0, 2, gpu::ATTR_FLOAT) | gpu::vboAttribute(1, 2, gpu::ATTR_SHORT) | gpu::vboAttribute(2, 4, gpu::ATTR_UNSIGNED_BYTE), 3);
+    }
+
+    gput::bakeIndices.resize(quads * 6);
+    for(u32 i = 0; i < quads; i++) {
+        u16* quad = &gput::bakeIndices[i * 6];
+        quad[0] = (u16) (i * 4 + 0);
+        quad[1] = (u16) (i * 4 + 1);
+        quad[2] = (u16) (i * 4 + 2);
+        quad[3] = (u16) (i * 4 + 2);
+        quad[4] = (u16) (i * 4 + 3);
+        quad[5] = (u16) (i * 4 + 0);
+    }
+
+    gpu::setVboData(chunk->vbo, &gput::bakeVertices[0], quads * 4, gpu::PRIM_TRIANGLES);
+    gpu::setVboIndices(chunk->vbo, &gput::bakeIndices[0], quads * 6 * sizeof(u16));
+}
+
+void ctr::gput::releaseTilemaps() {
+    tilemapFrame++;
+}
+
+void ctr::gput::createTilemap(u32* tilemap, u32 width, u32 height, u32 tileWidth, u32 tileHeight, u32 chunkSize) {
+    if(tilemap == NULL) {
+        return;
+    }
+
+    if(width == 0 || height == 0 || tileWidth == 0 || tileHeight == 0) {
+        *tilemap = 0;
+        return;
+    }
+
+    // Chunks are indexed with 16-bit indices, four vertices per tile.
+    if(chunkSize == 0) {
+        chunkSize = TILEMAP_CHUNK_SIZE;
+    } else if(chunkSize > TILEMAP_MAX_CHUNK_SIZE) {
+        chunkSize = TILEMAP_MAX_CHUNK_SIZE;
+    }
+
+    TilemapData* tilemapData = new TilemapData();
+    tilemapData->width = width;
+    tilemapData->height = height;
+    tilemapData->tileWidth = tileWidth;
+    tilemapData->tileHeight = tileHeight;
+    tilemapData->chunkSize = chunkSize;
+    tilemapData->chunksX = (width + chunkSize - 1) / chunkSize;
+    tilemapData->chunksY = (height + chunkSize - 1) / chunkSize;
+    tilemapData->texture = 0;
+    tilemapData->textureWidth = 0;
+    tilemapData->textureHeight = 0;
+    tilemapData->tiles.resize(width * height, 0);
+
+    TilemapChunk chunk;
+    chunk.vbo = 0;
+    chunk.dirty = true;
+    chunk.drawnFrame = 0;
+    tilemapData->chunks.resize(tilemapData->chunksX * tilemapData->chunksY, chunk);
+
+    *tilemap = (u32) tilemapData;
+}
+
+void ctr::gput::freeTilemap(u32 tilemap) {
+    TilemapData* tilemapData = (TilemapData*) tilemap;
+    if(tilemapData == NULL) {
+        return;
+    }
+
+    for(std::vector<TilemapChunk>::iterator it = tilemapData->chunks.begin(); it != tilemapData->chunks.end(); it++) {
+        if((*it).drawnFrame == tilemapFrame) {
+            gpu::flushCommands();
+            break;
+        }
+    }
+
+    for(std::vector<TilemapChunk>::iterator it = tilemapData->chunks.begin(); it != tilemapData->chunks.end(); it++) {
+        if((*it).vbo != 0) {
+            gpu::freeVbo((*it).vbo);
+        }
+    }
+
+    delete tilemapData;
+}
+
+void ctr::gput::setTilemapTileset(u32 tilemap, u32 texture, u32 textureWidth, u32 textureHeight) {
+    TilemapData* tilemapData = (TilemapData*) tilemap;
+    if(tilemapData == NULL) {
+        return;
+    }
+
+    tilemapData->texture = texture;
+    if(tilemapData->textureWidth != textureWidth || tilemapData->textureHeight != textureHeight) {
+        tilemapData->textureWidth = textureWidth;
+        tilemapData->textureHeight = textureHeight;
+        tilemapInvalidate(tilemapData);
+    }
+}
+
+void ctr::gput::setTiles(u32 tilemap, const u16* tiles) {
+    TilemapData* tilemapData = (TilemapData*) tilemap;
+    if(tilemapData == NULL || tiles == NULL) {
+        return;
+    }
+
+    tilemapData->tiles.assign(tiles, tiles + tilemapData->width * tilemapData->height);
+    tilemapInvalidate(tilemapData);
+}
+
+void ctr::gput::setTile(u32 tilemap, u32 x, u32 y, u16 tile) {
+    TilemapData* tilemapData = (TilemapData*) tilemap;
+    if(tilemapData == NULL || x >= tilemapData->width || y >= tilemapData->height) {
+        return;
+    }
+
+    u16* current = &tilemapData->tiles[y * tilemapData->width + x];
+    if(*current == tile) {
+        return;
+    }
+
+    *current = tile;
+    tilemapData->chunks[(y / tilemapData->chunkSize) * tilemapData->chunksX + x / tilemapData->chunkSize].dirty = true;
+}
+
+u16 ctr::gput::getTile(u32 tilemap, u32 x, u32 y) {
+    TilemapData* tilemapData = (TilemapData*) tilemap;
+    if(tilemapData == NULL || x >= tilemapData->width || y >= tilemapData->height) {
+        return 0;
+    }
+
+    return tilemapData->tiles[y * tilemapData->width + x];
+}
+
+void ctr::gput::setTileAnimation(u32 tilemap, u16 tile, u32 frames, u32 frameTime) {
+    TilemapData* tilemapData = (TilemapData*) tilemap;
+    if(tilemapData == NULL || tile == 0) {
+        return;
+    }
+
+    u32 index = tilemapFindAnimation(tilemapData, tile);
+    if(frames <= 1 || frameTime == 0) {
+        if(index != ANIMATION_NONE) {
+            tilemapData->animations.erase(tilemapData->animations.begin() + index);
+            tilemapInvalidate(tilemapData);
+        }
+
+        return;
+    }
+
+    if(index != ANIMATION_NONE) {
+        // Only the grouping of tiles into ranges is baked, so timing changes need no rebuild.
+        tilemapData->animations[index].frames = frames;
+        tilemapData->animations[index].frameTime = frameTime;
+        return;
+    }
+
+    TileAnimation animation;
+    animation.tile = tile;
+    animation.frames = frames;
+    animation.frameTime = frameTime;
+    tilemapData->animations.push_back(animation);
+    tilemapInvalidate(tilemapData);
+}
+
+void ctr::gput::drawTilemap(u32 tilemap, float x, float y) {
+    TilemapData* tilemapData = (TilemapData*) tilemap;
+    if(tilemapData == NULL || tilemapData->texture == 0 || tilemapData->textureWidth < tilemapData->tileWidth || tilemapData->textureHeight < tilemapData->tileHeight) {
+        return;
+    }
+
+    // Chunks are drawn immediately, so queued sprites and text have to go out first to keep draw order.
+    flushBatches();
+
+    pushModelView();
+    translate(x, y, 0);
+
+    Frustum frustum;
+    getFrustum(&frustum);
+
+    u32 oldShader = 0;
+    gpu::getShader(&oldShader);
+    gpu::bindTexture(gpu::TEXUNIT0, tilemapData->texture);
+
+    float texScaleX = 1.0f / tilemapData->textureWidth;
+    float texScaleY = 1.0f / tilemapData->textureHeight;
+    u64 now = core::time();
+
+    float chunkWidth = (float) (tilemapData->chunkSize * tilemapData->tileWidth);
+    float chunkHeight = (float) (tilemapData->chunkSize * tilemapData->tileHeight);
+    float mapHeight = (float) (tilemapData->height * tilemapData->tileHeight);
+    for(u32 chunkY = 0; chunkY < tilemapData->chunksY; chunkY++) {
+        for(u32 chunkX = 0; chunkX < tilemapData->chunksX; chunkX++) {
+            TilemapChunk* chunk = &tilemapData->chunks[chunkY * tilemapData->chunksX + chunkX];
+
+            BoundingBox bounds;
+            bounds.minX = chunkX * chunkWidth;
+            bounds.maxX = bounds.minX + chunkWidth;
+            bounds.maxY = mapHeight - chunkY * chunkHeight;
+            bounds.minY = bounds.maxY - chunkHeight;
+            bounds.minZ = -0.1f;
+            bounds.maxZ = -0.1f;
+            if(!boxVisible(&frustum, &bounds)) {
+                continue;
+            }
+
+            if(chunk->dirty) {
+                tilemapBakeChunk(tilemapData, chunkX, chunkY);
+            }
+
+            if(chunk->ranges.empty()) {
+                continue;
+            }
+
+            chunk->drawnFrame = tilemapFrame;
+            for(std::vector<ChunkRange>::iterator it = chunk->ranges.begin(); it != chunk->ranges.end(); it++) {
+                // Animation frames follow the base tile along its tileset row.
+                float offsetX = 0;
+                if((*it).animation != ANIMATION_NONE) {
+                    TileAnimation* animation = &tilemapData->animations[(*it).animation];
+                    offsetX = (float) (((now / animation->frameTime) % animation->frames) * tilemapData->tileWidth) * texScaleX;
+                }
+
+                useBatchShader(texScaleX, texScaleY, offsetX, 0);
+                gpu::drawVboRange(chunk->vbo, (*it).firstQuad * 6, (*it).quads * 6);
+            }
+        }
+    }
+
+    gpu::useShader(oldShader);
+    popModelView();
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "citrus/err.hpp"
+#include "citrus/gpu.hpp"
 #include "citrus/types.hpp"
 
 namespace ctr {
@@ -27,13 +28,34 @@ namespace ctr {
     }
 
     namespace gpu {
-        bool init();
+        bool init(u32 commandBufferSize, u32 vramSize);
         void exit();
     }
 
     namespace gput {
         bool init();
         void exit();
+
+        bool initFonts();
+        void exitFonts();
+        void flushTextBatches();
+        void releaseTextBatches();
+
+        bool initSprites();
+        void exitSprites();
+        void flushSpriteBatch();
+        void releaseSprites();
+
+        void releaseTilemaps();
+
+        void useBatchShader(float texScaleX, float texScaleY, float texOffsetX = 0, float texOffsetY = 0);
+        void drawScaledFrame(u32 texture, float u, float v);
+        void beginBatch(u32 owner);
+        void releaseBatches();
+        void retireVbo(u32 vbo);
+
+        void captureFrame(ctr::gpu::Screen screen);
+        void updateMatrices();
     }
 
     namespace hid {
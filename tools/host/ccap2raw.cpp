@@ -0,0 +1,187 @@
+// Converts a citrus gameplay capture (.ccap, written by ctr::gput::startCapture) into raw
+// RGB24 video that ffmpeg can encode.
+//
+// Build: g++ -O2 -o ccap2raw ccap2raw.cpp
+// Usage: ccap2raw capture.ccap out.rgb [fps]
+//        ffmpeg -f rawvideo -pix_fmt rgb24 -s 400x240 -r 60 -i out.rgb out.mp4
+//
+// Frames are emitted at a constant rate (default 60fps) using the capture timestamps, so frames
+// dropped on the console show up as held frames rather than shortening the video.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#define CAPTURE_MAGIC 0x50414343
+#define CAPTURE_VERSION 1
+
+static bool readWords(FILE* fd, uint32_t* out, size_t count) {
+    return fread(out, sizeof(uint32_t), count, fd) == count;
+}
+
+static bool decodeFrame(const std::vector<uint16_t>& packed, std::vector<uint16_t>& pixels, bool keyframe) {
+    size_t pos = 0;
+    size_t px = 0;
+    while(pos < packed.size()) {
+        uint16_t token = packed[pos++];
+        uint32_t count = token & 0x7FFF;
+        if(px + count > pixels.size()) {
+            return false;
+        }
+
+        if(token & 0x8000) {
+            if(keyframe) {
+                memset(&pixels[px], 0, count * sizeof(uint16_t));
+            }
+        } else {
+            if(pos + count > packed.size()) {
+                return false;
+            }
+
+            for(uint32_t i = 0; i < count; i++) {
+                pixels[px + i] = keyframe ? packed[pos + i] : (uint16_t) (pixels[px + i] ^ packed[pos + i]);
+            }
+
+            pos += count;
+        }
+
+        px += count;
+    }
+
+    return px == pixels.size();
+}
+
+static void toLandscape(const std::vector<uint16_t>& pixels, uint32_t rowLength, uint32_t rows, std::vector<uint8_t>& out) {
+    // Capture rows are screen columns, stored bottom to top.
+    out.resize(rows * rowLength * 3);
+    for(uint32_t x = 0; x < rows; x++) {
+        for(uint32_t y = 0; y < rowLength; y++) {
+            uint16_t c = pixels[x * rowLength + (rowLength - 1 - y)];
+            uint8_t* dst = &out[(y * rows + x) * 3];
+            dst[0] = (uint8_t) (((c >> 11) & 0x1F) * 255 / 31);
+            dst[1] = (uint8_t) (((c >> 5) & 0x3F) * 255 / 63);
+            dst[2] = (uint8_t) ((c & 0x1F) * 255 / 31);
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    if(argc < 3) {
+        fprintf(stderr, "Usage: %s capture.ccap out.rgb [fps]\n", argv[0]);
+        return 1;
+    }
+
+    double fps = argc > 3 ? atof(argv[3]) : 60.0;
+    if(fps <= 0) {
+        fps = 60.0;
+    }
+
+    FILE* in = fopen(argv[1], "rb");
+    if(in == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    uint32_t header[4];
+    if(!readWords(in, header, 4) || header[0] != CAPTURE_MAGIC || header[1] != CAPTURE_VERSION) {
+        fprintf(stderr, "%s: not a citrus capture\n", argv[1]);
+        fclose(in);
+        return 1;
+    }
+
+    FILE* out = fopen(argv[2], "wb");
+    if(out == NULL) {
+        perror(argv[2]);
+        fclose(in);
+        return 1;
+    }
+
+    std::vector<uint16_t> packed;
+    std::vector<uint16_t> pixels;
+    std::vector<uint8_t> rgb;
+    uint32_t rowLength = 0;
+    uint32_t rows = 0;
+    uint32_t outWidth = 0;
+    uint32_t outHeight = 0;
+
+    uint32_t frames = 0;
+    uint32_t keyframes = 0;
+    uint32_t emitted = 0;
+    uint32_t held = 0;
+    uint64_t payload = 0;
+    uint32_t frameHeader[4];
+    while(readWords(in, frameHeader, 4)) {
+        uint32_t time = frameHeader[0];
+        uint32_t width = frameHeader[1] & 0xFFFF;
+        uint32_t height = frameHeader[1] >> 16;
+        bool keyframe = (frameHeader[2] & 1) != 0;
+        uint32_t size = frameHeader[3];
+
+        packed.resize(size / sizeof(uint16_t));
+        if(fread(packed.data(), 1, size, in) != size) {
+            fprintf(stderr, "warning: truncated frame %u\n", frames);
+            break;
+        }
+
+        if(width != rowLength || height != rows) {
+            if(!keyframe) {
+                fprintf(stderr, "warning: frame %u changes size without a keyframe\n", frames);
+                break;
+            }
+
+            rowLength = width;
+            rows = height;
+            pixels.assign(width * height, 0);
+        }
+
+        if(!decodeFrame(packed, pixels, keyframe)) {
+            fprintf(stderr, "warning: corrupt frame %u\n", frames);
+            break;
+        }
+
+        toLandscape(pixels, rowLength, rows, rgb);
+        if(outWidth == 0) {
+            outWidth = rows;
+            outHeight = rowLength;
+        } else if(outWidth != rows || outHeight != rowLength) {
+            fprintf(stderr, "warning: skipping frame %u with different size %ux%u\n", frames, rows, rowLength);
+            frames++;
+            continue;
+        }
+
+        // Repeat this frame until the output clock catches up with its timestamp.
+        uint32_t target = (uint32_t) (time * fps / 1000.0) + 1;
+        if(emitted == 0) {
+            target = 1;
+        }
+
+        while(emitted < target) {
+            fwrite(rgb.data(), 1, rgb.size(), out);
+            if(emitted + 1 < target) {
+                held++;
+            }
+
+            emitted++;
+        }
+
+        frames++;
+        if(keyframe) {
+            keyframes++;
+        }
+
+        payload += size;
+    }
+
+    fclose(out);
+    fclose(in);
+
+    printf("%u frames (%u keyframes), %llu payload bytes, %u output frames (%u held)\n", frames, keyframes, (unsigned long long) payload, emitted, held);
+    if(outWidth != 0) {
+        printf("ffmpeg -f rawvideo -pix_fmt rgb24 -s %ux%u -r %g -i %s out.mp4\n", outWidth, outHeight, fps, argv[2]);
+    }
+
+    return 0;
+}
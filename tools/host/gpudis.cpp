@@ -0,0 +1,414 @@
+// Decodes a GPU command trace (written by ctr::gpu::startCommandTrace) into named register writes.
+//
+// Build: g++ -O2 -o gpudis gpudis.cpp
+// Usage: gpudis trace.bin [-s]
+//
+// Each write is printed with its register name, mask and value, grouped by draw call. Writes that
+// leave a state register unchanged are flagged as redundant. -s prints only the per-draw and
+// per-register summary. Referenced vertex, index and texture buffers are stored in the trace so it
+// can also serve as input for offline replay.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#define TRACE_MAGIC 0x43524743
+#define TRACE_VERSION 1
+#define TRACE_CHUNK_END 0
+#define TRACE_CHUNK_COMMANDS 1
+#define TRACE_CHUNK_BUFFER 2
+
+#define REGISTER_COUNT 0x400
+
+typedef struct {
+    uint32_t id;
+    const char* name;
+} RegisterName;
+
+static const RegisterName registerNames[] = {
+    {0x010, "FINALIZE"},
+    {0x040, "FACECULLING_CONFIG"},
+    {0x041, "VIEWPORT_WIDTH"},
+    {0x042, "VIEWPORT_INVW"},
+    {0x043, "VIEWPORT_HEIGHT"},
+    {0x044, "VIEWPORT_INVH"},
+    {0x047, "FRAGOP_CLIP"},
+    {0x04D, "DEPTHMAP_SCALE"},
+    {0x04E, "DEPTHMAP_OFFSET"},
+    {0x04F, "SH_OUTMAP_TOTAL"},
+    {0x061, "EARLYDEPTH_FUNC"},
+    {0x062, "EARLYDEPTH_TEST1"},
+    {0x063, "EARLYDEPTH_CLEAR"},
+    {0x064, "SH_OUTATTR_MODE"},
+    {0x065, "SCISSORTEST_MODE"},
+    {0x066, "SCISSORTEST_POS"},
+    {0x067, "SCISSORTEST_DIM"},
+    {0x068, "VIEWPORT_XY"},
+    {0x06A, "EARLYDEPTH_DATA"},
+    {0x06D, "DEPTHMAP_ENABLE"},
+    {0x06E, "RENDERBUF_DIM"},
+    {0x06F, "SH_OUTATTR_CLOCK"},
+    {0x080, "TEXUNIT_CONFIG"},
+    {0x081, "TEXUNIT0_BORDER_COLOR"},
+    {0x082, "TEXUNIT0_DIM"},
+    {0x083, "TEXUNIT0_PARAM"},
+    {0x084, "TEXUNIT0_LOD"},
+    {0x085, "TEXUNIT0_ADDR1"},
+    {0x08E, "TEXUNIT0_TYPE"},
+    {0x091, "TEXUNIT1_BORDER_COLOR"},
+    {0x092, "TEXUNIT1_DIM"},
+    {0x093, "TEXUNIT1_PARAM"},
+    {0x094, "TEXUNIT1_LOD"},
+    {0x095, "TEXUNIT1_ADDR"},
+    {0x096, "TEXUNIT1_TYPE"},
+    {0x099, "TEXUNIT2_BORDER_COLOR"},
+    {0x09A, "TEXUNIT2_DIM"},
+    {0x09B, "TEXUNIT2_PARAM"},
+    {0x09C, "TEXUNIT2_LOD"},
+    {0x09D, "TEXUNIT2_ADDR"},
+    {0x09E, "TEXUNIT2_TYPE"},
+    {0x0C0, "TEXENV0_SOURCE"},
+    {0x0C1, "TEXENV0_OPERAND"},
+    {0x0C2, "TEXENV0_COMBINER"},
+    {0x0C3, "TEXENV0_COLOR"},
+    {0x0C4, "TEXENV0_SCALE"},
+    {0x0C8, "TEXENV1_SOURCE"},
+    {0x0C9, "TEXENV1_OPERAND"},
+    {0x0CA, "TEXENV1_COMBINER"},
+    {0x0CB, "TEXENV1_COLOR"},
+    {0x0CC, "TEXENV1_SCALE"},
+    {0x0D0, "TEXENV2_SOURCE"},
+    {0x0D1, "TEXENV2_OPERAND"},
+    {0x0D2, "TEXENV2_COMBINER"},
+    {0x0D3, "TEXENV2_COLOR"},
+    {0x0D4, "TEXENV2_SCALE"},
+    {0x0D8, "TEXENV3_SOURCE"},
+    {0x0D9, "TEXENV3_OPERAND"},
+    {0x0DA, "TEXENV3_COMBINER"},
+    {0x0DB, "TEXENV3_COLOR"},
+    {0x0DC, "TEXENV3_SCALE"},
+    {0x0E0, "TEXENV_UPDATE_BUFFER"},
+    {0x0E1, "FOG_COLOR"},
+    {0x0F0, "TEXENV4_SOURCE"},
+    {0x0F1, "TEXENV4_OPERAND"},
+    {0x0F2, "TEXENV4_COMBINER"},
+    {0x0F3, "TEXENV4_COLOR"},
+    {0x0F4, "TEXENV4_SCALE"},
+    {0x0F8, "TEXENV5_SOURCE"},
+    {0x0F9, "TEXENV5_OPERAND"},
+    {0x0FA, "TEXENV5_COMBINER"},
+    {0x0FB, "TEXENV5_COLOR"},
+    {0x0FC, "TEXENV5_SCALE"},
+    {0x0FD, "TEXENV_BUFFER_COLOR"},
+    {0x100, "COLOR_OPERATION"},
+    {0x101, "BLEND_FUNC"},
+    {0x102, "LOGIC_OP"},
+    {0x103, "BLEND_COLOR"},
+    {0x104, "FRAGOP_ALPHA_TEST"},
+    {0x105, "STENCIL_TEST"},
+    {0x106, "STENCIL_OP"},
+    {0x107, "DEPTH_COLOR_MASK"},
+    {0x110, "FRAMEBUFFER_INVALIDATE"},
+    {0x111, "FRAMEBUFFER_FLUSH"},
+    {0x112, "COLORBUFFER_READ"},
+    {0x113, "COLORBUFFER_WRITE"},
+    {0x114, "DEPTHBUFFER_READ"},
+    {0x115, "DEPTHBUFFER_WRITE"},
+    {0x116, "DEPTHBUFFER_FORMAT"},
+    {0x117, "COLORBUFFER_FORMAT"},
+    {0x118, "EARLYDEPTH_TEST2"},
+    {0x11B, "FRAMEBUFFER_BLOCK32"},
+    {0x11C, "DEPTHBUFFER_LOC"},
+    {0x11D, "COLORBUFFER_LOC"},
+    {0x11E, "FRAMEBUFFER_DIM"},
+    {0x200, "ATTRIBBUFFERS_LOC"},
+    {0x201, "ATTRIBBUFFERS_FORMAT_LOW"},
+    {0x202, "ATTRIBBUFFERS_FORMAT_HIGH"},
+    {0x227, "INDEXBUFFER_CONFIG"},
+    {0x228, "NUMVERTICES"},
+    {0x229, "GEOSTAGE_CONFIG"},
+    {0x22A, "VERTEX_OFFSET"},
+    {0x22D, "POST_VERTEX_CACHE_NUM"},
+    {0x22E, "DRAWARRAYS"},
+    {0x22F, "DRAWELEMENTS"},
+    {0x231, "VTX_FUNC"},
+    {0x232, "FIXEDATTRIB_INDEX"},
+    {0x233, "FIXEDATTRIB_DATA0"},
+    {0x234, "FIXEDATTRIB_DATA1"},
+    {0x235, "FIXEDATTRIB_DATA2"},
+    {0x238, "CMDBUF_SIZE0"},
+    {0x239, "CMDBUF_SIZE1"},
+    {0x23A, "CMDBUF_ADDR0"},
+    {0x23B, "CMDBUF_ADDR1"},
+    {0x23C, "CMDBUF_JUMP0"},
+    {0x23D, "CMDBUF_JUMP1"},
+    {0x242, "VSH_NUM_ATTR"},
+    {0x244, "VSH_COM_MODE"},
+    {0x245, "START_DRAW_FUNC0"},
+    {0x24A, "VSH_OUTMAP_TOTAL1"},
+    {0x251, "VSH_OUTMAP_TOTAL2"},
+    {0x252, "GSH_MISC0"},
+    {0x253, "GEOSTAGE_CONFIG2"},
+    {0x254, "GSH_MISC1"},
+    {0x25E, "PRIMITIVE_CONFIG"},
+    {0x25F, "RESTART_PRIMITIVE"},
+    {0x280, "GSH_BOOLUNIFORM"},
+    {0x289, "GSH_INPUTBUFFER_CONFIG"},
+    {0x28A, "GSH_ENTRYPOINT"},
+    {0x28B, "GSH_ATTRIBUTES_PERMUTATION_LOW"},
+    {0x28C, "GSH_ATTRIBUTES_PERMUTATION_HIGH"},
+    {0x28D, "GSH_OUTMAP_MASK"},
+    {0x28F, "GSH_CODETRANSFER_END"},
+    {0x290, "GSH_FLOATUNIFORM_CONFIG"},
+    {0x291, "GSH_FLOATUNIFORM_DATA"},
+    {0x29B, "GSH_CODETRANSFER_CONFIG"},
+    {0x29C, "GSH_CODETRANSFER_DATA"},
+    {0x2A5, "GSH_OPDESCS_CONFIG"},
+    {0x2A6, "GSH_OPDESCS_DATA"},
+    {0x2B0, "VSH_BOOLUNIFORM"},
+    {0x2B1, "VSH_INTUNIFORM_I0"},
+    {0x2B9, "VSH_INPUTBUFFER_CONFIG"},
+    {0x2BA, "VSH_ENTRYPOINT"},
+    {0x2BB, "VSH_ATTRIBUTES_PERMUTATION_LOW"},
+    {0x2BC, "VSH_ATTRIBUTES_PERMUTATION_HIGH"},
+    {0x2BD, "VSH_OUTMAP_MASK"},
+    {0x2BF, "VSH_CODETRANSFER_END"},
+    {0x2C0, "VSH_FLOATUNIFORM_CONFIG"},
+    {0x2C1, "VSH_FLOATUNIFORM_DATA"},
+    {0x2CB, "VSH_CODETRANSFER_CONFIG"},
+    {0x2CC, "VSH_CODETRANSFER_DATA"},
+    {0x2D5, "VSH_OPDESCS_CONFIG"},
+    {0x2D6, "VSH_OPDESCS_DATA"},
+};
+
+// Registers whose writes have side effects or stream data, so repeating a value is not redundant.
+static const char* streamingPatterns[] = {"DRAW", "FLUSH", "INVALIDATE", "FINALIZE", "VTX_FUNC", "_DATA", "_INDEX", "CMDBUF", "RESTART", "CLEAR"};
+
+typedef struct {
+    uint32_t commands;
+    uint32_t words;
+    uint32_t redundant;
+} DrawStats;
+
+typedef struct {
+    uint32_t writes;
+    uint32_t redundant;
+} RegisterStats;
+
+static std::string names[REGISTER_COUNT];
+static bool streaming[REGISTER_COUNT];
+
+static void initNames() {
+    for(uint32_t id = 0; id < REGISTER_COUNT; id++) {
+        char buf[16];
+        snprintf(buf, sizeof(buf), "0x%03X", id);
+        names[id] = buf;
+        streaming[id] = false;
+    }
+
+    for(size_t i = 0; i < sizeof(registerNames) / sizeof(registerNames[0]); i++) {
+        const RegisterName& reg = registerNames[i];
+        names[reg.id] = reg.name;
+        for(size_t p = 0; p < sizeof(streamingPatterns) / sizeof(streamingPatterns[0]); p++) {
+            if(strstr(reg.name, streamingPatterns[p]) != NULL) {
+                streaming[reg.id] = true;
+            }
+        }
+
+        // Uniform, code and descriptor uploads accept data on eight consecutive ports.
+        if(streaming[reg.id] && strstr(reg.name, "SH_") != NULL && strstr(reg.name, "_DATA") != NULL) {
+            for(uint32_t port = 1; port < 8 && reg.id + port < REGISTER_COUNT; port++) {
+                names[reg.id + port] = std::string(reg.name) + "+" + (char) ('0' + port);
+                streaming[reg.id + port] = true;
+            }
+        }
+    }
+}
+
+static uint32_t expandMask(uint32_t mask) {
+    uint32_t bits = 0;
+    for(uint32_t i = 0; i < 4; i++) {
+        if(mask & (1 << i)) {
+            bits |= 0xFF << (i * 8);
+        }
+    }
+
+    return bits;
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 2) {
+        printf("Usage: %s trace.bin [-s]\n", argv[0]);
+        return 1;
+    }
+
+    bool summaryOnly = argc > 2 && strcmp(argv[2], "-s") == 0;
+
+    FILE* fd = fopen(argv[1], "rb");
+    if(fd == NULL) {
+        perror("Failed to open trace");
+        return 1;
+    }
+
+    uint32_t header[2];
+    if(fread(header, sizeof(header), 1, fd) != 1 || header[0] != TRACE_MAGIC || header[1] != TRACE_VERSION) {
+        fprintf(stderr, "Not a citrus command trace.\n");
+        fclose(fd);
+        return 1;
+    }
+
+    initNames();
+
+    uint32_t values[REGISTER_COUNT];
+    bool known[REGISTER_COUNT];
+    memset(known, 0, sizeof(known));
+
+    std::vector<DrawStats> draws;
+    DrawStats current = {0, 0, 0};
+    std::vector<RegisterStats> registers(REGISTER_COUNT);
+    uint32_t segments = 0;
+    uint32_t totalWords = 0;
+    uint32_t buffers = 0;
+    uint64_t bufferBytes = 0;
+
+    while(true) {
+        uint32_t chunk[2];
+        if(fread(chunk, sizeof(chunk), 1, fd) != 1) {
+            fprintf(stderr, "Trace is truncated.\n");
+            break;
+        }
+
+        if(chunk[0] == TRACE_CHUNK_END) {
+            break;
+        }
+
+        std::vector<uint32_t> data((chunk[1] + 3) / 4);
+        if(chunk[1] > 0 && fread(&data[0], chunk[1], 1, fd) != 1) {
+            fprintf(stderr, "Trace is truncated.\n");
+            break;
+        }
+
+        if(chunk[0] == TRACE_CHUNK_BUFFER) {
+            if(!summaryOnly) {
+                printf("buffer 0x%08X, %u bytes\n", data[0], chunk[1] - 4);
+            }
+
+            buffers++;
+            bufferBytes += chunk[1] - 4;
+            continue;
+        }
+
+        if(chunk[0] != TRACE_CHUNK_COMMANDS) {
+            continue;
+        }
+
+        if(!summaryOnly) {
+            printf("segment %u, %u words\n", segments, (uint32_t) data.size());
+        }
+
+        segments++;
+        totalWords += data.size();
+
+        size_t pos = 0;
+        while(pos + 2 <= data.size()) {
+            uint32_t param = data[pos];
+            uint32_t cmd = data[pos + 1];
+            pos += 2;
+
+            uint32_t id = cmd & 0x3FF;
+            uint32_t mask = (cmd >> 16) & 0xF;
+            uint32_t extra = (cmd >> 20) & 0x7FF;
+            bool consecutive = (cmd >> 31) != 0;
+
+            if(pos + extra > data.size()) {
+                fprintf(stderr, "Command at word %u runs past the end of its segment.\n", (uint32_t) (pos - 2));
+                break;
+            }
+
+            current.commands++;
+            current.words += 2 + extra + (extra & 1);
+
+            uint32_t bits = expandMask(mask);
+            for(uint32_t i = 0; i <= extra; i++) {
+                uint32_t reg = (consecutive ? id + i : id) & 0x3FF;
+                uint32_t value = i == 0 ? param : data[pos + i - 1];
+                uint32_t merged = known[reg] ? (values[reg] & ~bits) | (value & bits) : value;
+                bool redundant = !streaming[reg] && known[reg] && mask != 0 && merged == values[reg];
+
+                registers[reg].writes++;
+                if(redundant) {
+                    registers[reg].redundant++;
+                    current.redundant++;
+                }
+
+                if(!summaryOnly) {
+                    printf("  %-32s mask %X  0x%08X%s\n", names[reg].c_str(), mask, value, redundant ? "  (redundant)" : "");
+                }
+
+                if(mask == 0xF || known[reg]) {
+                    values[reg] = merged;
+                    known[reg] = true;
+                }
+
+                if(reg == 0x22E || reg == 0x22F) {
+                    if(!summaryOnly) {
+                        printf("-- draw %u: %u commands, %u words, %u redundant\n", (uint32_t) draws.size(), current.commands, current.words, current.redundant);
+                    }
+
+                    draws.push_back(current);
+                    current.commands = 0;
+                    current.words = 0;
+                    current.redundant = 0;
+                }
+            }
+
+            pos += extra + (extra & 1);
+        }
+    }
+
+    fclose(fd);
+
+    uint32_t redundantTotal = 0;
+    for(size_t i = 0; i < draws.size(); i++) {
+        redundantTotal += draws[i].redundant;
+    }
+
+    redundantTotal += current.redundant;
+
+    printf("\n%u segments, %u command words, %u draws, %u redundant writes\n", segments, totalWords, (uint32_t) draws.size(), redundantTotal);
+    printf("%u buffers, %llu bytes\n", buffers, (unsigned long long) bufferBytes);
+    if(!draws.empty()) {
+        uint32_t maxWords = 0;
+        uint64_t sumWords = 0;
+        for(size_t i = 0; i < draws.size(); i++) {
+            maxWords = std::max(maxWords, draws[i].words);
+            sumWords += draws[i].words;
+        }
+
+        printf("words per draw: avg %.1f, max %u\n", (double) sumWords / draws.size(), maxWords);
+    }
+
+    std::vector<uint32_t> order;
+    for(uint32_t reg = 0; reg < REGISTER_COUNT; reg++) {
+        if(registers[reg].writes > 0) {
+            order.push_back(reg);
+        }
+    }
+
+    std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+        return registers[a].writes > registers[b].writes;
+    });
+
+    printf("\n%-32s %8s %10s\n", "register", "writes", "redundant");
+    for(size_t i = 0; i < order.size(); i++) {
+        printf("%-32s %8u %10u\n", names[order[i]].c_str(), registers[order[i]].writes, registers[order[i]].redundant);
+    }
+
+    return 0;
+}
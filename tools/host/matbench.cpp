@@ -0,0 +1,283 @@
+// Checks the optimized gput matrix functions against the original naive implementations and times both.
+//
+// Build: g++ -O2 -I../../include -o matbench matbench.cpp ../../source/citrus/gput_matrix.cpp
+// Usage: matbench [iterations]
+//
+// Host x86 builds use the SSE path in gput_matrix.cpp; add -DCITRUS_NO_SIMD to time the scalar path the console uses.
+
+#include "citrus/gput.hpp"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+
+using namespace ctr;
+
+static void naiveMultMatrix(float* out, const float* m1, const float* m2) {
+    for(u32 x1 = 0; x1 < 4; x1++) {
+        for(u32 y2 = 0; y2 < 4; y2++) {
+            out[y2 * 4 + x1] = 0;
+            for(u32 y1 = 0; y1 < 4; y1++) {
+                out[y2 * 4 + x1] += m1[y1 * 4 + x1] * m2[y2 * 4 + y1];
+            }
+        }
+    }
+}
+
+static void naiveRotationX(float* out, float rotation) {
+    memset(out, 0, 16 * sizeof(float));
+    out[0] = 1.0f;
+    out[5] = cosf(rotation);
+    out[6] = sinf(rotation);
+    out[9] = -sinf(rotation);
+    out[10] = cosf(rotation);
+    out[15] = 1.0f;
+}
+
+static void naiveRotationY(float* out, float rotation) {
+    memset(out, 0, 16 * sizeof(float));
+    out[0] = cosf(rotation);
+    out[2] = sinf(rotation);
+    out[5] = 1.0f;
+    out[8] = -sinf(rotation);
+    out[10] = cosf(rotation);
+    out[15] = 1.0f;
+}
+
+static void naiveRotationZ(float* out, float rotation) {
+    memset(out, 0, 16 * sizeof(float));
+    out[0] = cosf(rotation);
+    out[1] = sinf(rotation);
+    out[4] = -sinf(rotation);
+    out[5] = cosf(rotation);
+    out[10] = 1.0f;
+    out[15] = 1.0f;
+}
+
+// The original gput::rotate: three rotation matrices and three full multiplies.
+static void naiveRotate(float* modelview, float x, float y, float z) {
+    float tempMatrix[16];
+    float tempMatrix2[16];
+    float tempMatrix3[16];
+
+    naiveRotationX(tempMatrix, x);
+    naiveRotationY(tempMatrix2, y);
+    naiveMultMatrix(tempMatrix3, tempMatrix, tempMatrix2);
+
+    naiveRotationZ(tempMatrix2, z);
+    naiveMultMatrix(tempMatrix, tempMatrix3, tempMatrix2);
+
+    naiveMultMatrix(tempMatrix2, modelview, tempMatrix);
+    memcpy(modelview, tempMatrix2, sizeof(tempMatrix2));
+}
+
+static void naiveTransform(float* out, float tx, float ty, float tz, float rx, float ry, float rz, float sx, float sy, float sz) {
+    float translation[16];
+    gput::setIdentityMatrix(out);
+    gput::setTranslationMatrix(translation, tx, ty, tz);
+
+    float temp[16];
+    naiveMultMatrix(temp, out, translation);
+    memcpy(out, temp, sizeof(temp));
+
+    naiveRotate(out, rx, ry, rz);
+    gput::setScaleMatrix(out, sx, sy, sz);
+}
+
+// Applies a node's scale, rotation and translation to a point one step at a time.
+static void naiveNodePoint(float* out, const float* in, const float* transform) {
+    float rotation[16];
+    gput::setIdentityMatrix(rotation);
+    naiveRotate(rotation, transform[3], transform[4], transform[5]);
+
+    float scaled[3] = {in[0] * transform[6], in[1] * transform[7], in[2] * transform[8]};
+    for(u32 r = 0; r < 3; r++) {
+        out[r] = rotation[r * 4 + 0] * scaled[0] + rotation[r * 4 + 1] * scaled[1] + rotation[r * 4 + 2] * scaled[2] + transform[r];
+    }
+}
+
+static float randomFloat() {
+    return (float) rand() / (float) RAND_MAX * 2.0f - 1.0f;
+}
+
+static void randomMatrix(float* out, bool affine) {
+    for(u32 i = 0; i < 16; i++) {
+        out[i] = randomFloat();
+    }
+
+    if(affine) {
+        out[12] = 0.0f;
+        out[13] = 0.0f;
+        out[14] = 0.0f;
+        out[15] = 1.0f;
+    }
+}
+
+static bool compare(const char* name, const float* a, const float* b, u32 count) {
+    for(u32 i = 0; i < count; i++) {
+        if(fabsf(a[i] - b[i]) > 1e-4f * (1.0f + fabsf(b[i]))) {
+            printf("FAIL %s: element %u is %f, expected %f\n", name, i, a[i], b[i]);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+template<typename F>
+static double time(u32 iterations, F func) {
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for(u32 i = 0; i < iterations; i++) {
+        func(i);
+    }
+
+    return std::chrono::duration<double, std::nano>(std::chrono::high_resolution_clock::now() - start).count() / iterations;
+}
+
+static volatile float sink;
+
+int main(int argc, char* argv[]) {
+    u32 iterations = argc > 1 ? (u32) atoi(argv[1]) : 1000000;
+    bool ok = true;
+
+    for(u32 test = 0; test < 1000; test++) {
+        float m1[16];
+        float m2[16];
+        float expected[16];
+        float actual[16];
+
+        bool affine = (test & 1) != 0;
+        randomMatrix(m1, affine);
+        randomMatrix(m2, affine);
+
+        naiveMultMatrix(expected, m1, m2);
+        gput::multMatrix(actual, m1, m2);
+        ok &= compare("multMatrix", actual, expected, 16);
+
+        gput::multMatrix(m1, m1, m2);
+        ok &= compare("multMatrix in place", m1, expected, 16);
+
+        float rx = randomFloat() * 3.0f;
+        float ry = randomFloat() * 3.0f;
+        float rz = randomFloat() * 3.0f;
+
+        gput::setIdentityMatrix(expected);
+        naiveRotate(expected, rx, ry, rz);
+        gput::setRotationMatrix(actual, rx, ry, rz);
+        ok &= compare("setRotationMatrix", actual, expected, 16);
+
+        float tx = randomFloat() * 10.0f;
+        float ty = randomFloat() * 10.0f;
+        float tz = randomFloat() * 10.0f;
+        float sx = randomFloat() * 2.0f;
+        float sy = randomFloat() * 2.0f;
+        float sz = randomFloat() * 2.0f;
+
+        naiveTransform(expected, tx, ty, tz, rx, ry, rz, sx, sy, sz);
+        gput::setTransformMatrix(actual, tx, ty, tz, rx, ry, rz, sx, sy, sz);
+        ok &= compare("setTransformMatrix", actual, expected, 16);
+
+        float points[3 * 4];
+        float transformed[3 * 4];
+        float reference[3 * 4];
+        for(u32 i = 0; i < 12; i++) {
+            points[i] = randomFloat() * 100.0f;
+        }
+
+        randomMatrix(m2, true);
+        gput::transformPoints(m2, points, transformed, 4);
+        for(u32 p = 0; p < 4; p++) {
+            for(u32 r = 0; r < 3; r++) {
+                reference[p * 3 + r] = m2[r * 4 + 0] * points[p * 3 + 0] + m2[r * 4 + 1] * points[p * 3 + 1] + m2[r * 4 + 2] * points[p * 3 + 2] + m2[r * 4 + 3];
+            }
+        }
+
+        ok &= compare("transformPoints", transformed, reference, 12);
+
+        // Two-level node hierarchy, composed the way gput::updateNodes does it.
+        float parent[9];
+        float child[9];
+        for(u32 i = 0; i < 9; i++) {
+            parent[i] = randomFloat() * (i < 3 ? 10.0f : i < 6 ? 3.0f : 2.0f);
+            child[i] = randomFloat() * (i < 3 ? 10.0f : i < 6 ? 3.0f : 2.0f);
+        }
+
+        float parentWorld[16];
+        float childLocal[16];
+        float childWorld[16];
+        gput::setLocalTransformMatrix(parentWorld, parent[0], parent[1], parent[2], parent[3], parent[4], parent[5], parent[6], parent[7], parent[8]);
+        gput::setLocalTransformMatrix(childLocal, child[0], child[1], child[2], child[3], child[4], child[5], child[6], child[7], child[8]);
+        gput::multMatrix(childWorld, childLocal, parentWorld);
+
+        gput::transformPoints(childWorld, points, transformed, 4);
+        for(u32 p = 0; p < 4; p++) {
+            float local[3];
+            naiveNodePoint(local, &points[p * 3], child);
+            naiveNodePoint(&reference[p * 3], local, parent);
+        }
+
+        ok &= compare("node hierarchy", transformed, reference, 12);
+        if(!ok) {
+            return 1;
+        }
+    }
+
+    printf("All results match the reference implementations.\n\n");
+
+    float a[16];
+    float b[16];
+    float c[16];
+    randomMatrix(a, false);
+    randomMatrix(b, false);
+
+    float affineA[16];
+    float affineB[16];
+    randomMatrix(affineA, true);
+    randomMatrix(affineB, true);
+
+    printf("%-28s %10s %10s\n", "operation", "naive ns", "new ns");
+
+    double naive = time(iterations, [&](u32 i) { b[0] = (float) i; naiveMultMatrix(c, a, b); sink = c[0]; });
+    double fast = time(iterations, [&](u32 i) { b[0] = (float) i; gput::multMatrix(c, a, b); sink = c[0]; });
+    printf("%-28s %10.1f %10.1f\n", "multMatrix", naive, fast);
+
+    naive = time(iterations, [&](u32 i) { affineB[0] = (float) i; naiveMultMatrix(c, affineA, affineB); sink = c[0]; });
+    fast = time(iterations, [&](u32 i) { affineB[0] = (float) i; gput::multMatrix(c, affineA, affineB); sink = c[0]; });
+    printf("%-28s %10.1f %10.1f\n", "multMatrix (affine)", naive, fast);
+
+    naive = time(iterations, [&](u32 i) { gput::setIdentityMatrix(c); naiveRotate(c, (float) i, 0.5f, 0.25f); sink = c[0]; });
+    fast = time(iterations, [&](u32 i) { gput::setRotationMatrix(c, (float) i, 0.5f, 0.25f); sink = c[0]; });
+    printf("%-28s %10.1f %10.1f\n", "rotate xyz", naive, fast);
+
+    naive = time(iterations, [&](u32 i) { naiveTransform(c, 1.0f, 2.0f, 3.0f, (float) i, 0.5f, 0.25f, 2.0f, 2.0f, 2.0f); sink = c[0]; });
+    fast = time(iterations, [&](u32 i) { gput::setTransformMatrix(c, 1.0f, 2.0f, 3.0f, (float) i, 0.5f, 0.25f, 2.0f, 2.0f, 2.0f); sink = c[0]; });
+    printf("%-28s %10.1f %10.1f\n", "translate + rotate + scale", naive, fast);
+
+    static float points[1024 * 3];
+    static float transformed[1024 * 3];
+    for(u32 i = 0; i < 1024 * 3; i++) {
+        points[i] = randomFloat();
+    }
+
+    u32 batches = iterations / 1024 > 0 ? iterations / 1024 : 1;
+    naive = time(batches, [&](u32 i) {
+        affineA[3] = (float) i;
+        for(u32 p = 0; p < 1024; p++) {
+            float in[16] = {points[p * 3], 0, 0, 0, points[p * 3 + 1], 0, 0, 0, points[p * 3 + 2], 0, 0, 0, 1, 0, 0, 0};
+            float result[16];
+            naiveMultMatrix(result, in, affineA);
+            transformed[p * 3] = result[0];
+            transformed[p * 3 + 1] = result[4];
+            transformed[p * 3 + 2] = result[8];
+        }
+
+        sink = transformed[0];
+    }) / 1024;
+    fast = time(batches, [&](u32 i) { affineA[3] = (float) i; gput::transformPoints(affineA, points, transformed, 1024); sink = transformed[0]; }) / 1024;
+    printf("%-28s %10.1f %10.1f\n", "transform point", naive, fast);
+
+    return 0;
+}
@@ -0,0 +1,463 @@
+// Generates a signed distance field font (BMFont text descriptor plus raw A8 pages) from a TTF/OTF file,
+// for use with ctr::gput::loadFont, setFontPage and setFontDistanceField.
+//
+// Build: g++ -O2 -o sdfgen sdfgen.cpp $(pkg-config --cflags --libs freetype2)
+// Usage: sdfgen font.ttf out [-s size] [-r spread] [-c charset] [-p pagesize]
+//
+// Glyphs are rendered at 4x the requested pixel size (default 32), converted to exact Euclidean distances
+// and sampled down, with the edge at 128 and -spread..+spread output pixels (default 4) mapped to 255..0.
+// The charset is a list of codepoints and ranges such as "32-126,0x3000-0x30FF", or @file to take every
+// character in a UTF-8 text file (default 32-126). Writes out.fnt and out_N.a8, where each page is
+// pagesize x pagesize (default 256) bytes, top row first:
+//   setFontPage(font, N, data, pagesize, pagesize, ctr::gpu::PIXEL_A8);
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <ft2build.h>
+#include FT_FREETYPE_H
+
+#define UPSCALE 4
+#define DISTANCE_INF 1e20f
+
+typedef struct {
+    uint32_t codepoint;
+    uint32_t glyphIndex;
+    int width;
+    int height;
+    int xOffset;
+    int yOffset;
+    int advance;
+    std::vector<uint8_t> pixels;
+
+    uint32_t page;
+    int x;
+    int y;
+} Glyph;
+
+static bool parseCharset(const char* spec, std::set<uint32_t>& out) {
+    if(spec[0] == '@') {
+        FILE* fd = fopen(spec + 1, "rb");
+        if(fd == NULL) {
+            perror("Failed to open charset file");
+            return false;
+        }
+
+        std::string text;
+        char buffer[4096];
+        size_t read;
+        while((read = fread(buffer, 1, sizeof(buffer), fd)) > 0) {
+            text.append(buffer, read);
+        }
+
+        fclose(fd);
+
+        size_t pos = 0;
+        while(pos < text.size()) {
+            uint8_t lead = (uint8_t) text[pos];
+            uint32_t codepoint = lead;
+            size_t units = 1;
+            if(lead >= 0xF0) {
+                codepoint = lead & 0x07;
+                units = 4;
+            } else if(lead >= 0xE0) {
+                codepoint = lead & 0x0F;
+                units = 3;
+            } else if(lead >= 0xC0) {
+                codepoint = lead & 0x1F;
+                units = 2;
+            }
+
+            for(size_t i = 1; i < units && pos + i < text.size(); i++) {
+                codepoint = (codepoint << 6) | ((uint8_t) text[pos + i] & 0x3F);
+            }
+
+            pos += units;
+            if(codepoint >= 0x20) {
+                out.insert(codepoint);
+            }
+        }
+
+        return true;
+    }
+
+    const char* pos = spec;
+    while(*pos != '\0') {
+        char* end = NULL;
+        uint32_t first = (uint32_t) strtoul(pos, &end, 0);
+        if(end == pos) {
+            fprintf(stderr, "Invalid charset: %s\n", spec);
+            return false;
+        }
+
+        uint32_t last = first;
+        pos = end;
+        if(*pos == '-') {
+            last = (uint32_t) strtoul(pos + 1, &end, 0);
+            pos = end;
+        }
+
+        for(uint32_t codepoint = first; codepoint <= last; codepoint++) {
+            out.insert(codepoint);
+        }
+
+        if(*pos == ',') {
+            pos++;
+        }
+    }
+
+    return true;
+}
+
+// Felzenszwalb-Huttenlocher 1D squared distance transform.
+static void distance1d(const float* f, float* d, int n, int* v, float* z) {
+    int k = 0;
+    v[0] = 0;
+    z[0] = -DISTANCE_INF;
+    z[1] = DISTANCE_INF;
+    for(int q = 1; q < n; q++) {
+        float s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+        while(s <= z[k]) {
+            k--;
+            s = ((f[q] + q * q) - (f[v[k]] + v[k] * v[k])) / (2 * q - 2 * v[k]);
+        }
+
+        k++;
+        v[k] = q;
+        z[k] = s;
+        z[k + 1] = DISTANCE_INF;
+    }
+
+    k = 0;
+    for(int q = 0; q < n; q++) {
+        while(z[k + 1] < q) {
+            k++;
+        }
+
+        d[q] = (q - v[k]) * (q - v[k]) + f[v[k]];
+    }
+}
+
+// Squared distance from every pixel to the nearest pixel where grid is zero.
+static void distance2d(std::vector<float>& grid, int width, int height) {
+    int n = width > height ? width : height;
+    std::vector<float> f(n);
+    std::vector<float> d(n);
+    std::vector<int> v(n);
+    std::vector<float> z(n + 1);
+
+    for(int x = 0; x < width; x++) {
+        for(int y = 0; y < height; y++) {
+            f[y] = grid[y * width + x];
+        }
+
+        distance1d(&f[0], &d[0], height, &v[0], &z[0]);
+        for(int y = 0; y < height; y++) {
+            grid[y * width + x] = d[y];
+        }
+    }
+
+    for(int y = 0; y < height; y++) {
+        distance1d(&grid[y * width], &d[0], width, &v[0], &z[0]);
+        memcpy(&grid[y * width], &d[0], width * sizeof(float));
+    }
+}
+
+static bool renderGlyph(FT_Face face, Glyph& glyph, int spread, int base) {
+    if(FT_Load_Glyph(face, glyph.glyphIndex, FT_LOAD_RENDER) != 0) {
+        return false;
+    }
+
+    FT_GlyphSlot slot = face->glyph;
+    const FT_Bitmap* bitmap = &slot->bitmap;
+    glyph.advance = (int) lround(slot->advance.x / 64.0 / UPSCALE);
+
+    if(bitmap->width == 0 || bitmap->rows == 0) {
+        glyph.width = 0;
+        glyph.height = 0;
+        glyph.xOffset = 0;
+        glyph.yOffset = 0;
+        return true;
+    }
+
+    // Align the high resolution bitmap to the output grid, with room for the spread on every side.
+    int left = slot->bitmap_left;
+    int top = -slot->bitmap_top;
+    int outX = (int) floor((double) left / UPSCALE) - spread;
+    int outY = (int) floor((double) top / UPSCALE) - spread;
+    int outRight = (int) ceil((double) (left + (int) bitmap->width) / UPSCALE) + spread;
+    int outBottom = (int) ceil((double) (top + (int) bitmap->rows) / UPSCALE) + spread;
+
+    glyph.width = outRight - outX;
+    glyph.height = outBottom - outY;
+    glyph.xOffset = outX;
+    glyph.yOffset = base + outY;
+
+    int hiWidth = glyph.width * UPSCALE;
+    int hiHeight = glyph.height * UPSCALE;
+    int offsetX = left - outX * UPSCALE;
+    int offsetY = top - outY * UPSCALE;
+
+    std::vector<float> inside(hiWidth * hiHeight, DISTANCE_INF);
+    std::vector<float> outside(hiWidth * hiHeight, 0);
+    for(unsigned int row = 0; row < bitmap->rows; row++) {
+        for(unsigned int col = 0; col < bitmap->width; col++) {
+            uint8_t coverage = bitmap->pixel_mode == FT_PIXEL_MODE_MONO ? ((bitmap->buffer[row * bitmap->pitch + col / 8] >> (7 - col % 8)) & 1) * 255 : bitmap->buffer[row * bitmap->pitch + col];
+            if(coverage >= 128) {
+                int index = (offsetY + row) * hiWidth + offsetX + col;
+                inside[index] = 0;
+                outside[index] = DISTANCE_INF;
+            }
+        }
+    }
+
+    // inside holds the distance to the glyph, outside the distance to the background.
+    distance2d(inside, hiWidth, hiHeight);
+    distance2d(outside, hiWidth, hiHeight);
+
+    glyph.pixels.resize(glyph.width * glyph.height);
+    for(int y = 0; y < glyph.height; y++) {
+        for(int x = 0; x < glyph.width; x++) {
+            int index = (y * UPSCALE + UPSCALE / 2) * hiWidth + x * UPSCALE + UPSCALE / 2;
+            float distance = (sqrtf(inside[index]) - sqrtf(outside[index])) / UPSCALE;
+            float value = 0.5f - distance / (2.0f * spread);
+            value = value < 0 ? 0 : value > 1 ? 1 : value;
+            glyph.pixels[y * glyph.width + x] = (uint8_t) lroundf(value * 255);
+        }
+    }
+
+    return true;
+}
+
+static bool compareHeight(const Glyph* a, const Glyph* b) {
+    return a->height > b->height;
+}
+
+static bool packGlyphs(std::vector<Glyph>& glyphs, int pageSize, uint32_t* pages) {
+    std::vector<Glyph*> order;
+    for(size_t i = 0; i < glyphs.size(); i++) {
+        glyphs[i].page = 0;
+        glyphs[i].x = 0;
+        glyphs[i].y = 0;
+        if(glyphs[i].width > 0) {
+            order.push_back(&glyphs[i]);
+        }
+    }
+
+    // Shelf packing, tallest first.
+    std::sort(order.begin(), order.end(), compareHeight);
+
+    uint32_t page = 0;
+    int x = 0;
+    int y = 0;
+    int shelf = 0;
+    for(size_t i = 0; i < order.size(); i++) {
+        Glyph* glyph = order[i];
+        if(glyph->width > pageSize || glyph->height > pageSize) {
+            fprintf(stderr, "Glyph U+%04X does not fit on a %dx%d page.\n", glyph->codepoint, pageSize, pageSize);
+            return false;
+        }
+
+        if(x + glyph->width > pageSize) {
+            x = 0;
+            y += shelf;
+            shelf = 0;
+        }
+
+        if(y + glyph->height > pageSize) {
+            page++;
+            x = 0;
+            y = 0;
+            shelf = 0;
+        }
+
+        glyph->page = page;
+        glyph->x = x;
+        glyph->y = y;
+        x += glyph->width;
+        if(glyph->height > shelf) {
+            shelf = glyph->height;
+        }
+    }
+
+    *pages = order.empty() ? 0 : page + 1;
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if(argc < 3) {
+        printf("Usage: %s font.ttf out [-s size] [-r spread] [-c charset] [-p pagesize]\n", argv[0]);
+        return 1;
+    }
+
+    int size = 32;
+    int spread = 4;
+    int pageSize = 256;
+    const char* charsetSpec = "32-126";
+    for(int i = 3; i + 1 < argc; i += 2) {
+        if(strcmp(argv[i], "-s") == 0) {
+            size = atoi(argv[i + 1]);
+        } else if(strcmp(argv[i], "-r") == 0) {
+            spread = atoi(argv[i + 1]);
+        } else if(strcmp(argv[i], "-c") == 0) {
+            charsetSpec = argv[i + 1];
+        } else if(strcmp(argv[i], "-p") == 0) {
+            pageSize = atoi(argv[i + 1]);
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    if(size <= 0 || spread <= 0 || pageSize <= 0 || pageSize % 8 != 0) {
+        fprintf(stderr, "Size and spread must be positive, and the page size a multiple of 8.\n");
+        return 1;
+    }
+
+    std::set<uint32_t> charset;
+    if(!parseCharset(charsetSpec, charset)) {
+        return 1;
+    }
+
+    FT_Library library;
+    FT_Face face;
+    if(FT_Init_FreeType(&library) != 0) {
+        fprintf(stderr, "Failed to initialize FreeType.\n");
+        return 1;
+    }
+
+    if(FT_New_Face(library, argv[1], 0, &face) != 0) {
+        fprintf(stderr, "Failed to load font: %s\n", argv[1]);
+        FT_Done_FreeType(library);
+        return 1;
+    }
+
+    FT_Set_Pixel_Sizes(face, 0, (FT_UInt) (size * UPSCALE));
+
+    int base = (int) lround(face->size->metrics.ascender / 64.0 / UPSCALE);
+    int lineHeight = (int) lround(face->size->metrics.height / 64.0 / UPSCALE);
+
+    std::vector<Glyph> glyphs;
+    uint32_t missing = 0;
+    for(std::set<uint32_t>::iterator it = charset.begin(); it != charset.end(); it++) {
+        Glyph glyph;
+        glyph.codepoint = *it;
+        glyph.glyphIndex = FT_Get_Char_Index(face, *it);
+        if(glyph.glyphIndex == 0) {
+            missing++;
+            continue;
+        }
+
+        if(!renderGlyph(face, glyph, spread, base)) {
+            fprintf(stderr, "Failed to render U+%04X.\n", *it);
+            continue;
+        }
+
+        glyphs.push_back(glyph);
+    }
+
+    uint32_t pageCount = 0;
+    if(glyphs.empty() || !packGlyphs(glyphs, pageSize, &pageCount)) {
+        if(glyphs.empty()) {
+            fprintf(stderr, "No glyphs to write.\n");
+        }
+
+        FT_Done_Face(face);
+        FT_Done_FreeType(library);
+        return 1;
+    }
+
+    std::string out = argv[2];
+    std::vector<uint8_t> page(pageSize * pageSize);
+    for(uint32_t p = 0; p < pageCount; p++) {
+        std::fill(page.begin(), page.end(), 0);
+        for(size_t i = 0; i < glyphs.size(); i++) {
+            const Glyph& glyph = glyphs[i];
+            if(glyph.page != p || glyph.width == 0) {
+                continue;
+            }
+
+            for(int row = 0; row < glyph.height; row++) {
+                memcpy(&page[(glyph.y + row) * pageSize + glyph.x], &glyph.pixels[row * glyph.width], glyph.width);
+            }
+        }
+
+        char name[32];
+        snprintf(name, sizeof(name), "_%u.a8", p);
+
+        FILE* fd = fopen((out + name).c_str(), "wb");
+        if(fd == NULL) {
+            perror("Failed to write page");
+            FT_Done_Face(face);
+            FT_Done_FreeType(library);
+            return 1;
+        }
+
+        fwrite(&page[0], 1, page.size(), fd);
+        fclose(fd);
+    }
+
+    // Kerning is tabulated for every pair, which is only practical for small charsets.
+    std::vector<std::string> kernings;
+    if(FT_HAS_KERNING(face) && glyphs.size() <= 1024) {
+        for(size_t first = 0; first < glyphs.size(); first++) {
+            for(size_t second = 0; second < glyphs.size(); second++) {
+                FT_Vector kerning;
+                if(FT_Get_Kerning(face, glyphs[first].glyphIndex, glyphs[second].glyphIndex, FT_KERNING_DEFAULT, &kerning) != 0) {
+                    continue;
+                }
+
+                int amount = (int) lround(kerning.x / 64.0 / UPSCALE);
+                if(amount != 0) {
+                    char line[96];
+                    snprintf(line, sizeof(line), "kerning first=%u second=%u amount=%d\n", glyphs[first].codepoint, glyphs[second].codepoint, amount);
+                    kernings.push_back(line);
+                }
+            }
+        }
+    }
+
+    FILE* fd = fopen((out + ".fnt").c_str(), "w");
+    if(fd == NULL) {
+        perror("Failed to write descriptor");
+        FT_Done_Face(face);
+        FT_Done_FreeType(library);
+        return 1;
+    }
+
+    fprintf(fd, "info face=\"%s\" size=%d bold=0 italic=0 charset=\"\" unicode=1 stretchH=100 smooth=1 aa=1 padding=%d,%d,%d,%d spacing=0,0\n", face->family_name != NULL ? face->family_name : "", size, spread, spread, spread, spread);
+    fprintf(fd, "common lineHeight=%d base=%d scaleW=%d scaleH=%d pages=%u packed=0\n", lineHeight, base, pageSize, pageSize, pageCount);
+    for(uint32_t p = 0; p < pageCount; p++) {
+        std::string::size_type slash = out.find_last_of("/\\");
+        fprintf(fd, "page id=%u file=\"%s_%u.a8\"\n", p, out.substr(slash == std::string::npos ? 0 : slash + 1).c_str(), p);
+    }
+
+    fprintf(fd, "chars count=%u\n", (uint32_t) glyphs.size());
+    for(size_t i = 0; i < glyphs.size(); i++) {
+        const Glyph& glyph = glyphs[i];
+        fprintf(fd, "char id=%u x=%d y=%d width=%d height=%d xoffset=%d yoffset=%d xadvance=%d page=%u chnl=15\n", glyph.codepoint, glyph.x, glyph.y, glyph.width, glyph.height, glyph.xOffset, glyph.yOffset, glyph.advance, glyph.page);
+    }
+
+    if(!kernings.empty()) {
+        fprintf(fd, "kernings count=%u\n", (uint32_t) kernings.size());
+        for(size_t i = 0; i < kernings.size(); i++) {
+            fputs(kernings[i].c_str(), fd);
+        }
+    }
+
+    fclose(fd);
+
+    printf("%u glyphs on %u page(s), %u kerning pairs, %u codepoints missing from the font.\n", (uint32_t) glyphs.size(), pageCount, (uint32_t) kernings.size(), missing);
+
+    FT_Done_Face(face);
+    FT_Done_FreeType(library);
+    return 0;
+}